@@ -0,0 +1,394 @@
+#ifndef __RECORDRING_H
+#define __RECORDRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Circular store of variable-length byte records with a small fixed index
+ *
+ * Records are stored oldest to newest in a byte buffer. When a new record does not fit, the oldest
+ * records are discarded to make room, so adding a record, getting a record by age, and removing a record
+ * from either end are all O(1) and never move existing data.
+ *
+ * A record is never split across the end of the buffer, so the bytes of a record can always be
+ * accessed using a single pointer from getData(). The unused space at the end of the buffer when
+ * a record wraps around is reclaimed when the records before it are discarded.
+ *
+ * Like RingBuffer, the storage for both the bytes and the index is passed in so the caller decides
+ * whether it's static, part of another object, or allocated on the heap.
+ *
+ * This class is not thread safe.
+ */
+class RecordRing {
+public:
+	/**
+	 * @brief Index entry for a single record
+	 *
+	 * The aux and flags fields are not used by RecordRing and are available to the user of the
+	 * class to store per-record information. They are cleared to 0 when a record is added.
+	 */
+	struct Record {
+		uint16_t offset;
+		uint16_t length;
+		uint16_t aux;
+		uint8_t flags;
+	};
+
+	/**
+	 * @brief Construct an empty ring with no storage. Call setStorage() before use.
+	 */
+	RecordRing() {};
+
+	/**
+	 * @brief Construct a ring
+	 *
+	 * @param data Buffer to hold the record bytes. Must be at least dataSize bytes.
+	 *
+	 * @param dataSize Size of data in bytes. Limited to 65535 bytes.
+	 *
+	 * @param records Array to hold the index
+	 *
+	 * @param maxRecords Number of entries in records. This is the maximum number of records
+	 * that can be stored, regardless of their size.
+	 *
+	 * @param recordSize Size of each entry in records. To keep more data with each record, use an array of
+	 * a struct whose first member is a Record and pass its size. The whole entry is moved with the record.
+	 */
+	RecordRing(char *data, size_t dataSize, Record *records, size_t maxRecords, size_t recordSize = sizeof(Record)) {
+		setStorage(data, dataSize, records, maxRecords, recordSize);
+	};
+
+	/**
+	 * @brief Destructor. The storage is owned by the caller and is not freed.
+	 */
+	~RecordRing() {};
+
+	/**
+	 * @brief Set the storage to use. Any existing records are discarded.
+	 */
+	void setStorage(char *data, size_t dataSize, Record *records, size_t maxRecords, size_t recordSize = sizeof(Record)) {
+		this->data = data;
+		this->dataSize = (dataSize < 65535) ? dataSize : 65535;
+		this->records = (char *)records;
+		this->maxRecords = maxRecords;
+		this->recordSize = recordSize;
+		clear();
+	}
+
+	/**
+	 * @brief Move to a larger data buffer, keeping all records
+	 *
+	 * @param data Buffer to hold the record bytes. The existing bytes are copied to the same offsets, so
+	 * the index is unchanged. The old buffer is no longer used.
+	 *
+	 * @param dataSize Size of data in bytes. Limited to 65535 bytes. Does nothing if it's smaller than the
+	 * current size.
+	 *
+	 * If the records currently wrap around, the new space at the end is used once the records before it
+	 * are discarded, the same way as the unused space at the end when a record wraps.
+	 */
+	void growStorage(char *data, size_t dataSize) {
+		if (dataSize > 65535) {
+			dataSize = 65535;
+		}
+		if (dataSize < this->dataSize) {
+			return;
+		}
+		if (this->dataSize) {
+			memcpy(data, this->data, this->dataSize);
+		}
+		this->data = data;
+		this->dataSize = dataSize;
+	}
+
+	/**
+	 * @brief Move to a larger data buffer and a larger index, keeping all records
+	 *
+	 * @param records Array to hold the index, with entries of the same size as the current one. The records
+	 * are copied oldest first, so the slot of each record changes.
+	 *
+	 * @param maxRecords Number of entries in records. Does nothing if it's smaller than the current number.
+	 *
+	 * The data is moved the same way as the other growStorage().
+	 */
+	void growStorage(char *data, size_t dataSize, Record *records, size_t maxRecords) {
+		if (maxRecords < this->maxRecords || dataSize < this->dataSize) {
+			return;
+		}
+		for(size_t ii = 0; ii < count; ii++) {
+			memcpy((char *)records + ii * recordSize, getEntry((first + ii) % this->maxRecords), recordSize);
+		}
+		this->records = (char *)records;
+		this->maxRecords = maxRecords;
+		first = 0;
+		growStorage(data, dataSize);
+	}
+
+	/**
+	 * @brief Remove all records
+	 */
+	void clear() {
+		first = 0;
+		count = 0;
+	}
+
+	/**
+	 * @brief Returns the number of records currently stored
+	 */
+	size_t size() const {
+		return count;
+	}
+
+	/**
+	 * @brief Returns the number of entries in the index (maximum number of records)
+	 */
+	size_t getMaxRecords() const {
+		return maxRecords;
+	}
+
+	/**
+	 * @brief Returns the size of the data buffer in bytes (maximum size of a single record)
+	 */
+	size_t getDataSize() const {
+		return dataSize;
+	}
+
+	/**
+	 * @brief Add a new record, discarding the oldest records if necessary
+	 *
+	 * @param src The bytes to copy into the record
+	 *
+	 * @param len The number of bytes. Must be greater than 0.
+	 *
+	 * @return true if the record was added, false if it's empty or too large to ever fit.
+	 *
+	 * The new record has its aux and flags set to 0. It's the record at index 0 in get().
+	 */
+	bool add(const char *src, size_t len) {
+		if (len == 0 || len > dataSize || maxRecords == 0) {
+			return false;
+		}
+
+		int offset;
+		while((offset = findSpace(len)) < 0) {
+			removeOldest();
+		}
+
+		memcpy(&data[offset], src, len);
+
+		Record *rec = getEntry((first + count) % maxRecords);
+		count++;
+
+		rec->offset = (uint16_t) offset;
+		rec->length = (uint16_t) len;
+		rec->aux = 0;
+		rec->flags = 0;
+		return true;
+	}
+
+	/**
+	 * @brief Find where a record would be added without discarding any records
+	 *
+	 * @param len The number of bytes in the record
+	 *
+	 * @return The offset in the data buffer, or -1 if one or more of the oldest records would need
+	 * to be discarded to add it
+	 */
+	int findSpace(size_t len) const {
+		if (len > dataSize || maxRecords == 0) {
+			return -1;
+		}
+		if (count == 0) {
+			return 0;
+		}
+		if (count >= maxRecords) {
+			return -1;
+		}
+
+		size_t tail = getOldest()->offset;
+		size_t head = getHead();
+		if (isWrapped()) {
+			// Free space is between the end of the newest and the start of the oldest
+			if ((tail - head) >= len) {
+				return (int)head;
+			}
+		}
+		else {
+			// Free space is after the newest and before the oldest
+			if ((dataSize - head) >= len) {
+				return (int)head;
+			}
+			if (tail >= len) {
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	/**
+	 * @brief Returns the offset just past the end of the newest record, or 0 if empty
+	 */
+	size_t getHeadOffset() const {
+		return (count > 0) ? getHead() : 0;
+	}
+
+	/**
+	 * @brief Append bytes to the newest record, discarding older records if necessary
+	 *
+	 * @return true if the bytes were appended. Returns false if there are no records or there's not
+	 * enough contiguous space after the newest record, in which case nothing is changed.
+	 */
+	bool append(const char *src, size_t len) {
+		if (count == 0) {
+			return false;
+		}
+		while(isWrapped()) {
+			if ((getOldest()->offset - getHead()) >= len) {
+				break;
+			}
+			removeOldest();
+		}
+		size_t head = getHead();
+		if (!isWrapped() && (dataSize - head) < len) {
+			return false;
+		}
+
+		memcpy(&data[head], src, len);
+		getNewest()->length += (uint16_t) len;
+		return true;
+	}
+
+	/**
+	 * @brief Remove the oldest record. Does nothing if empty.
+	 */
+	void removeOldest() {
+		if (count > 0) {
+			first = (first + 1) % maxRecords;
+			count--;
+		}
+	}
+
+	/**
+	 * @brief Remove the newest record. Does nothing if empty.
+	 */
+	void removeNewest() {
+		if (count > 0) {
+			count--;
+		}
+	}
+
+	/**
+	 * @brief Remove a record by age
+	 *
+	 * @param index 0 = the newest record, 1 = the one before that, ... Does nothing if index >= size().
+	 *
+	 * The index entries of the records newer than the removed record are moved down one slot, which
+	 * is O(index), and the removed bytes are not reused until the records before them are discarded.
+	 * Any parallel per-slot data (see getSlot()) must be moved the same way before calling this. Data
+	 * in the index entry after the Record (see setStorage()) is moved with it.
+	 */
+	void remove(size_t index) {
+		if (index >= count) {
+			return;
+		}
+		for(size_t ii = index; ii > 0; ii--) {
+			memcpy(getEntry(getSlot(ii)), getEntry(getSlot(ii - 1)), recordSize);
+		}
+		count--;
+	}
+
+	/**
+	 * @brief Get a record by age
+	 *
+	 * @param index 0 = the newest record, 1 = the one before that, ...
+	 *
+	 * @return The record, or NULL if index >= size(). The pointer is valid until the record is removed.
+	 */
+	Record *get(size_t index) {
+		if (index >= count) {
+			return NULL;
+		}
+		return getEntry(getSlot(index));
+	}
+
+	/**
+	 * @brief Get a record by age (const version)
+	 */
+	const Record *get(size_t index) const {
+		if (index >= count) {
+			return NULL;
+		}
+		return getEntry(getSlot(index));
+	}
+
+	/**
+	 * @brief Gets the index slot for a record by age
+	 *
+	 * @param index 0 = the newest record, 1 = the one before that, ... Must be < size().
+	 *
+	 * The slot is in the range 0 <= slot < getMaxRecords() and does not change while the record is
+	 * stored (except by growStorage() with a new index), so it can be used to index a parallel array of
+	 * additional per-record data.
+	 */
+	size_t getSlot(size_t index) const {
+		return (first + count - 1 - index) % maxRecords;
+	}
+
+	/**
+	 * @brief Get a pointer to the bytes of a record. The bytes are not null terminated.
+	 */
+	const char *getData(const Record *rec) const {
+		return &data[rec->offset];
+	}
+
+	/**
+	 * @brief Get a pointer to the bytes of a record so they can be modified in place
+	 */
+	char *getData(const Record *rec) {
+		return &data[rec->offset];
+	}
+
+	/**
+	 * @brief Get the index entry in a slot, which is a Record followed by any other data (see the constructor)
+	 */
+	Record *getEntry(size_t slot) {
+		return (Record *)(records + slot * recordSize);
+	}
+
+	/**
+	 * @brief Get the index entry in a slot (const version)
+	 */
+	const Record *getEntry(size_t slot) const {
+		return (const Record *)(records + slot * recordSize);
+	}
+
+protected:
+	Record *getNewest() {
+		return getEntry(getSlot(0));
+	}
+
+	const Record *getOldest() const {
+		return getEntry(first);
+	}
+
+	size_t getHead() const {
+		const Record *rec = getEntry(getSlot(0));
+		return rec->offset + rec->length;
+	}
+
+	bool isWrapped() const {
+		return count > 1 && getEntry(getSlot(0))->offset < getOldest()->offset;
+	}
+
+	char *data = NULL;
+	size_t dataSize = 0;
+	char *records = NULL;
+	size_t maxRecords = 0;
+	size_t recordSize = sizeof(Record);
+	size_t first = 0;
+	size_t count = 0;
+};
+
+#endif /* __RECORDRING_H */
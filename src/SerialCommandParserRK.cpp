@@ -2,6 +2,26 @@
 
 
 #include <string.h> // strtok_s
+#include <algorithm> // std::reverse
+#include <cstddef> // std::max_align_t
+#include <new> // placement new
+
+#if SERIAL_COMMAND_HAS_FILESYSTEM
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h> // rename
+#endif
+
+#if SERIAL_COMMAND_TCP_EPOLL
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 // Define the debug logging level here
 // 0 = Off
@@ -19,8 +39,10 @@
 static Logger _log("app.sercmd");
 
 #define DEBUG_NORMAL(x) _log.info x
+#define DEBUG_ERROR(x) _log.error x
 #else
 #define DEBUG_NORMAL(x)
+#define DEBUG_ERROR(x)
 #endif
 
 #if SERIAL_COMMAND_DEBUG_LEVEL >= 2
@@ -81,6 +103,15 @@ CommandHandlerInfo &CommandHandlerInfo::addCommandOption(CommandOption *opt) {
 	return *this;
 }
 
+CommandHandlerInfo &CommandHandlerInfo::withOptionCompleter(char shortOpt, CommandCompleter completer) {
+	for(CommandOption *opt : cmdOptions) {
+		if (opt->shortOpt == shortOpt) {
+			opt->completer = completer;
+		}
+	}
+	return *this;
+}
+
 const CommandOption *CommandHandlerInfo::getByShortOpt(char shortOpt) const {
 	for(const CommandOption *opt : cmdOptions) {
 		if (opt->shortOpt == shortOpt) {
@@ -110,9 +141,24 @@ SerialCommandConfig::~SerialCommandConfig() {
 		delete commandHandlers.back();
 		commandHandlers.pop_back();
 	}
+	while(!ignoredHandlers.empty()) {
+		delete ignoredHandlers.back();
+		ignoredHandlers.pop_back();
+	}
 }
 
 CommandHandlerInfo &SerialCommandConfig::addCommandHandler(const char *cmdNames, const char *helpStr, std::function<void(SerialCommandParserBase *parser)> handler) {
+	if (frozen) {
+		// Other threads may be reading the command table, so it can't change
+		DEBUG_ERROR(("config is frozen, command %s not added", cmdNames));
+		CommandHandlerInfo *chi = new CommandHandlerInfo(std::vector<String>(), helpStr, handler);
+#if SERIAL_COMMAND_HAS_THREADS
+		// Not handlerMutex, which is held while a handler runs and the handler may be the caller
+		std::lock_guard<std::mutex> lock(ignoredMutex);
+#endif
+		ignoredHandlers.push_back(chi);
+		return *chi;
+	}
 
 	std::vector<String> cmdNamesVector;
 
@@ -140,9 +186,26 @@ CommandHandlerInfo &SerialCommandConfig::addCommandHandler(const char *cmdNames,
 
 	commandHandlers.push_back(chi);
 
+	for(const String &name : chi->cmdNames) {
+		// Names that are the same as an existing one go after it, so the first handler added wins
+		CommandIndexEntry entry = { name.c_str(), chi };
+		commandIndex.insert(commandIndex.begin() + findCommandIndex(entry.name, name.length() + 1, true), entry);
+	}
+
 	return *chi;
 }
 
+void SerialCommandConfig::callHandler(CommandHandlerInfo *chi, SerialCommandParserBase *parser) {
+#if SERIAL_COMMAND_HAS_THREADS
+	if (frozen && !chi->threadSafe) {
+		std::lock_guard<std::mutex> lock(handlerMutex);
+		chi->handler(parser);
+		return;
+	}
+#endif
+	chi->handler(parser);
+}
+
 void SerialCommandConfig::addHelpCommand(const char *helpCommands) {
 	addCommandHandler(helpCommands, "", [this](SerialCommandParserBase *parser) {
 		parser->printHelp();
@@ -150,20 +213,38 @@ void SerialCommandConfig::addHelpCommand(const char *helpCommands) {
 }
 
 CommandHandlerInfo *SerialCommandConfig::getCommandHandlerInfo(const char *cmd) const {
-
-	if (!commandHandlers.empty()) {
-		for(CommandHandlerInfo *chi : commandHandlers) {
-			for(String cmdName : chi->cmdNames) {
-				if (strcmp(cmdName, cmd) == 0) {
-					return chi;
-				}
-			}
-		}
+	// Comparing the null terminator too makes this an exact match
+	size_t index = findCommandIndex(cmd, strlen(cmd) + 1, false);
+	if (index < commandIndex.size() && strcmp(commandIndex[index].name, cmd) == 0) {
+		return commandIndex[index].chi;
 	}
 
 	return NULL;
 }
 
+size_t SerialCommandConfig::findCommandPrefix(const char *prefix, size_t len, size_t &count) const {
+	size_t first = findCommandIndex(prefix, len, false);
+	count = findCommandIndex(prefix, len, true) - first;
+	return first;
+}
+
+size_t SerialCommandConfig::findCommandIndex(const char *str, size_t len, bool upper) const {
+	size_t low = 0;
+	size_t high = commandIndex.size();
+
+	while(low < high) {
+		size_t mid = (low + high) / 2;
+		int cmp = strncmp(commandIndex[mid].name, str, len);
+		if (cmp < 0 || (upper && cmp == 0)) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
 CommandArgsParserBase::CommandArgsParserBase() {
 }
 
@@ -394,8 +475,8 @@ void SerialCommandParserBase::setup() {
 
 
 void SerialCommandParserBase::loop() {
-#ifndef UNITTEST
 	if (stream) {
+#ifndef UNITTEST
 		if (streamType == StreamType::USBSerial) {
 			USBSerial *usbSerial = (USBSerial *)stream;
 
@@ -405,11 +486,68 @@ void SerialCommandParserBase::loop() {
 				usbWasConnected = usbIsConnected;
 			}
 		}
+#endif /* UNITTEST */
 		while(stream->available()) {
 			filterChar(stream->read());
 		}
 	}
+}
+
+unsigned long SerialCommandParserBase::nextDeadline() {
+	// The base parser has no timers; it only needs to run when there is input
+	return 0;
+}
+
+bool SerialCommandParserBase::hasPendingInput() {
+	if (stream) {
+#ifndef UNITTEST
+		if (streamType == StreamType::USBSerial) {
+			USBSerial *usbSerial = (USBSerial *)stream;
+			if (usbSerial->isConnected() != usbWasConnected) {
+				return true;
+			}
+		}
 #endif /* UNITTEST */
+		return stream->available() > 0;
+	}
+	return false;
+}
+
+// [static]
+unsigned long SerialCommandParserBase::earliestDeadline(unsigned long a, unsigned long b) {
+	if (a == 0) {
+		return b;
+	}
+	if (b == 0) {
+		return a;
+	}
+	// Signed difference so this works across millis() rollover
+	return ((long)(a - b) < 0) ? a : b;
+}
+
+// [static]
+unsigned long SerialCommandParserBase::deadlineAfter(unsigned long start, unsigned long ms) {
+	unsigned long deadline = start + ms;
+	if (deadline == 0) {
+		// 0 means no deadline, so be 1 ms late instead
+		deadline = 1;
+	}
+	return deadline;
+}
+
+// [static]
+unsigned long SerialCommandParserBase::millisUntilDeadline(unsigned long deadline, unsigned long maxWait) {
+	if (deadline == 0) {
+		return maxWait;
+	}
+	long remaining = (long)(deadline - millis());
+	if (remaining <= 0) {
+		return 0;
+	}
+	if ((unsigned long)remaining > maxWait) {
+		return maxWait;
+	}
+	return (unsigned long)remaining;
 }
 
 
@@ -473,54 +611,7 @@ void SerialCommandParserBase::processLine() {
 		argsBuffer[argsCount++] = src;
 
 		char *dst = src;
-
-		bool inBackslash = false;
-		bool inDoubleQuote = false;
-		bool inSingleQuote = false;
-		while(*src) {
-			if (!inBackslash && *src == '\\') {
-				// Backslash escape the next character regardless of double quote or single quote
-				inBackslash = true;
-				src++;
-			}
-			else {
-				inBackslash = false;
-			}
-
-			if (inDoubleQuote) {
-				if (*src == '"') {
-					inDoubleQuote = false;
-					src++;
-				}
-			}
-			else
-			if (inSingleQuote) {
-				if (*src == '\'') {
-					inSingleQuote = false;
-					src++;
-				}
-			}
-
-			if (!inDoubleQuote && !inSingleQuote && !inBackslash) {
-				if (*src == '"') {
-					inDoubleQuote = true;
-					src++;
-				}
-				else
-				if (*src == '\'') {
-					inSingleQuote = true;
-					src++;
-				}
-				else
-				if (*src == ' ' || *src == '\t') {
-					// Whitespace not in quotes or backslash marks the end of this argument
-					break;
-				}
-			}
-
-			// Copy character
-			*dst++ = *src++;
-		}
+		src = scanToken(src, dst);
 
 		bool atEnd = (*src == 0);
 
@@ -573,12 +664,12 @@ void SerialCommandParserBase::processLine() {
 			parsingState = new CommandParsingState(chi);
 			if (parsingState) {
 				parsingState->parse(argsBuffer, argsCount);
-				chi->handler(this);
+				config->callHandler(chi, this);
 			}
 		}
 		else {
 			// No options, call handler always
-			chi->handler(this);
+			config->callHandler(chi, this);
 		}
 
 	}
@@ -592,19 +683,28 @@ void SerialCommandParserBase::processLine() {
 
 // Virtual override class Print
 size_t SerialCommandParserBase::write(uint8_t c) {
-#ifndef UNITTEST
 	if (stream) {
 		return stream->write(c);
 	}
-	else {
-		return 0;
-	}
+#ifndef UNITTEST
+	return 0;
 #else
 	putchar(c);
 	return 1;
 #endif /* UNITTEST */
 }
 
+size_t SerialCommandParserBase::write(const uint8_t *buf, size_t size) {
+	if (stream) {
+		return stream->write(buf, size);
+	}
+#ifndef UNITTEST
+	return 0;
+#else
+	return fwrite(buf, 1, size, stdout);
+#endif /* UNITTEST */
+}
+
 void SerialCommandParserBase::printHelp() {
 	for(CommandHandlerInfo *chi : config->getCommandHandlers()) {
 		printHelpForCommand(chi);
@@ -673,6 +773,66 @@ size_t SerialCommandParserBase::printWithNewLine(const char *str, bool endWithNe
 	return numLines;
 }
 
+// [static]
+char *SerialCommandParserBase::scanToken(char *src, char *&dst) {
+	bool inBackslash = false;
+	bool inDoubleQuote = false;
+	bool inSingleQuote = false;
+	while(*src) {
+		if (!inBackslash && *src == '\\') {
+			// Backslash escape the next character regardless of double quote or single quote
+			inBackslash = true;
+			src++;
+		}
+		else {
+			inBackslash = false;
+		}
+
+		if (inDoubleQuote) {
+			if (*src == '"') {
+				inDoubleQuote = false;
+				src++;
+			}
+		}
+		else
+		if (inSingleQuote) {
+			if (*src == '\'') {
+				inSingleQuote = false;
+				src++;
+			}
+		}
+
+		if (!inDoubleQuote && !inSingleQuote && !inBackslash) {
+			if (*src == '"') {
+				inDoubleQuote = true;
+				src++;
+			}
+			else
+			if (*src == '\'') {
+				inSingleQuote = true;
+				src++;
+			}
+			else
+			if (*src == ' ' || *src == '\t') {
+				// Whitespace not in quotes or backslash marks the end of this argument
+				break;
+			}
+		}
+
+		if (!*src) {
+			// Closing quote or backslash at the end of the line
+			break;
+		}
+
+		// Copy character
+		if (dst) {
+			*dst++ = *src;
+		}
+		src++;
+	}
+	return src;
+}
+
 bool SerialCommandParserBase::handleRawLine() {
 	// false = continue with default behavior
 	// true = don't parse into tokens, just clear buffer
@@ -727,43 +887,204 @@ void SerialCommandParserBase::deleteToEnd(size_t index) {
 
 
 void SerialCommandParserBase::insertCharacterAt(size_t index, char c) {
+	insertCharactersAt(index, &c, 1);
+}
+
+size_t SerialCommandParserBase::insertCharactersAt(size_t index, const char *str, size_t len) {
 	if (index > bufferOffset) {
 		index = bufferOffset;
 	}
-	if (index >= bufferOffset && index < (bufferSize - 1)) {
-		// Append
-		buffer[bufferOffset++] = c;
+
+	// Leave room for the null terminator
+	reserveBuffer(bufferOffset + len + 1);
+	size_t space = bufferSize - 1 - bufferOffset;
+	if (len > space) {
+		len = space;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	memmove(&buffer[index + len], &buffer[index], bufferOffset - index);
+	memcpy(&buffer[index], str, len);
+	bufferOffset += len;
+	return len;
+}
+
+void SerialCommandParserBase::deleteCharactersAt(size_t index, size_t len) {
+	if (index >= bufferOffset) {
+		// Nothing to delete
 		return;
 	}
+	if (len > bufferOffset - index) {
+		len = bufferOffset - index;
+	}
 
-	// Insert
-	memmove(&buffer[index + 1], &buffer[index], bufferOffset - index);
-	buffer[index] = c;
-	bufferOffset++;
+	memmove(&buffer[index], &buffer[index + len], bufferOffset - index - len);
+	bufferOffset -= len;
 }
 
 void SerialCommandParserBase::appendCharacter(char c) {
-	if (bufferOffset < (bufferSize - 1)) {
+	if (reserveBuffer(bufferOffset + 2)) {
 		buffer[bufferOffset++] = c;
 	}
 }
 
+bool SerialCommandParserBase::reserveBuffer(size_t size) {
+	if (size > bufferSize) {
+		growBuffer(size);
+	}
+	return size <= bufferSize;
+}
+
 char *SerialCommandParserBase::getBuffer() {
 	buffer[bufferOffset] = 0;
 	return buffer;
 }
 
 
-SerialCommandEditorBase::SerialCommandEditorBase(char *historyBuffer, size_t historyBufferSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize) :
-		SerialCommandParserBase(buffer, bufferSize, argsBuffer, argsBufferSize),
-		historyBuffer(historyBuffer), historyBufferSize(historyBufferSize) {
+SerialCommandKeymap::SerialCommandKeymap(bool withDefaults) {
+	if (withDefaults) {
+		setDefaults();
+	}
+	else {
+		clear();
+	}
+}
 
-	historyBuffer[0] = 0;
+SerialCommandKeymap::~SerialCommandKeymap() {
+}
 
+SerialCommandKeymap &SerialCommandKeymap::bind(char key, Action action, uint8_t modifiers) {
+	actions[modifiers % NUM_MODIFIERS][(uint8_t)key] = (uint8_t) action;
+	return *this;
 }
 
-SerialCommandEditorBase::~SerialCommandEditorBase() {
+SerialCommandKeymap::Action SerialCommandKeymap::addCustomAction(CustomActionHandler handler) {
+	if (customActions.size() >= (256 - (size_t)Action::CUSTOM)) {
+		return Action::NONE;
+	}
+	customActions.push_back(handler);
+	return (Action)((size_t)Action::CUSTOM + customActions.size() - 1);
+}
+
+bool SerialCommandKeymap::runCustomAction(Action action, SerialCommandEditorBase *editor, char key) const {
+	if (action < Action::CUSTOM) {
+		return false;
+	}
+	size_t index = (size_t)action - (size_t)Action::CUSTOM;
+	if (index >= customActions.size() || !customActions[index]) {
+		return false;
+	}
+	customActions[index](editor, key);
+	return true;
+}
+
+void SerialCommandKeymap::clear() {
+	memset(actions, 0, sizeof(actions));
+}
+
+void SerialCommandKeymap::setDefaults() {
+	clear();
+
+	bind(SerialCommandEditorBase::KEY_CTRL_A, Action::BEGINNING_OF_LINE);
+	bind(SerialCommandEditorBase::KEY_HOME, Action::BEGINNING_OF_LINE);
+	bind(SerialCommandEditorBase::KEY_BACKSPACE, Action::BACKWARD_DELETE_CHAR);
+	bind(SerialCommandEditorBase::KEY_DELETE, Action::BACKWARD_DELETE_CHAR);
+	bind(SerialCommandEditorBase::KEY_CTRL_B, Action::BACKWARD_CHAR);
+	bind(SerialCommandEditorBase::KEY_LEFT, Action::BACKWARD_CHAR);
+	bind(SerialCommandEditorBase::KEY_CTRL_E, Action::END_OF_LINE);
+	bind(SerialCommandEditorBase::KEY_END, Action::END_OF_LINE);
+	bind(SerialCommandEditorBase::KEY_CTRL_F, Action::FORWARD_CHAR);
+	bind(SerialCommandEditorBase::KEY_RIGHT, Action::FORWARD_CHAR);
+	bind(SerialCommandEditorBase::KEY_TAB, Action::COMPLETE);
+	bind(SerialCommandEditorBase::KEY_CTRL_L, Action::CLEAR_SCREEN);
+	bind(SerialCommandEditorBase::KEY_CTRL_K, Action::KILL_LINE);
+	bind(SerialCommandEditorBase::KEY_CTRL_N, Action::NEXT_HISTORY);
+	bind(SerialCommandEditorBase::KEY_DOWN, Action::NEXT_HISTORY);
+	bind(SerialCommandEditorBase::KEY_CTRL_P, Action::PREVIOUS_HISTORY);
+	bind(SerialCommandEditorBase::KEY_UP, Action::PREVIOUS_HISTORY);
+	bind(SerialCommandEditorBase::KEY_CR, Action::ACCEPT_LINE);
+	bind(SerialCommandEditorBase::KEY_LF, Action::ACCEPT_LINE);
+	bind(SerialCommandEditorBase::KEY_FORWARD_DELETE, Action::DELETE_CHAR);
+	bind(SerialCommandEditorBase::KEY_CTRL_UNDERSCORE, Action::UNDO);
+	bind(SerialCommandEditorBase::KEY_CTRL_CARET, Action::REDO);
+
+	bind('b', Action::BACKWARD_WORD, MOD_ALT);
+	bind('B', Action::BACKWARD_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_LEFT, Action::BACKWARD_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_LEFT, Action::BACKWARD_WORD, MOD_CTRL);
+	bind('f', Action::FORWARD_WORD, MOD_ALT);
+	bind('F', Action::FORWARD_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_RIGHT, Action::FORWARD_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_RIGHT, Action::FORWARD_WORD, MOD_CTRL);
+	bind('d', Action::KILL_WORD, MOD_ALT);
+	bind('D', Action::KILL_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_BACKSPACE, Action::BACKWARD_KILL_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_DELETE, Action::BACKWARD_KILL_WORD, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_CTRL_W, Action::UNIX_WORD_RUBOUT);
+	bind(SerialCommandEditorBase::KEY_CTRL_U, Action::UNIX_LINE_DISCARD);
+	bind(SerialCommandEditorBase::KEY_CTRL_Y, Action::YANK);
+	bind('y', Action::YANK_POP, MOD_ALT);
+	bind('Y', Action::YANK_POP, MOD_ALT);
+	bind(SerialCommandEditorBase::KEY_CTRL_R, Action::REVERSE_SEARCH_HISTORY);
+	bind(SerialCommandEditorBase::KEY_PAGE_UP, Action::PREVIOUS_MOST_USED_HISTORY);
+	bind(SerialCommandEditorBase::KEY_PAGE_DOWN, Action::NEXT_MOST_USED_HISTORY);
+}
 
+// [static]
+SerialCommandKeymap *SerialCommandKeymap::getDefault() {
+	static SerialCommandKeymap defaultKeymap;
+	return &defaultKeymap;
+}
+
+// Convert the final character of an xterm CSI sequence to a key code, or 0 if not a key
+static char xtermKeyCode(char c) {
+	switch(c) {
+	case 'A':
+		return SerialCommandEditorBase::KEY_UP;
+	case 'B':
+		return SerialCommandEditorBase::KEY_DOWN;
+	case 'C':
+		return SerialCommandEditorBase::KEY_RIGHT;
+	case 'D':
+		return SerialCommandEditorBase::KEY_LEFT;
+	case 'H':
+		return SerialCommandEditorBase::KEY_HOME;
+	case 'F':
+		return SerialCommandEditorBase::KEY_END;
+	default:
+		return 0;
+	}
+}
+
+// Convert an xterm modifier parameter (ESC[1;5C, 1 + bit mask of shift=1, alt=2, ctrl=4) to keymap modifiers
+static uint8_t xtermModifiers(int param) {
+	uint8_t modifiers = SerialCommandKeymap::MOD_NONE;
+	if (param > 1) {
+		if ((param - 1) & 0x02) {
+			modifiers |= SerialCommandKeymap::MOD_ALT;
+		}
+		if ((param - 1) & 0x04) {
+			modifiers |= SerialCommandKeymap::MOD_CTRL;
+		}
+	}
+	return modifiers;
+}
+
+
+SerialCommandEditorBase::SerialCommandEditorBase(char *historyBuffer, size_t historyBufferSize, SerialCommandHistory::IndexEntry *historyIndex, size_t historyIndexSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize) :
+		SerialCommandParserBase(buffer, bufferSize, argsBuffer, argsBufferSize),
+		ownHistory(historyBuffer, historyBufferSize, historyIndex, historyIndexSize),
+		undoLog(undoData, sizeof(undoData), undoRecords, UNDO_MAX_RECORDS),
+		killRing(killData, sizeof(killData), killRecords, KILL_RING_MAX_RECORDS) {
+
+}
+
+SerialCommandEditorBase::~SerialCommandEditorBase() {
+	if (historyStore) {
+		historyStore->detach(&ownHistory);
+	}
 }
 
 /**
@@ -776,8 +1097,12 @@ void SerialCommandEditorBase::clear() {
 	SerialCommandParserBase::clear();
 	cursorPos = 0;
 	horizScroll = 0;
+	historyCursor = 0;
+	savedLine = "";
+	suggestSeq = 0;
+	suggestFor = 0;
 	promptRendered = false;
-	historyClear();
+	undoClear();
 }
 
 
@@ -785,6 +1110,10 @@ void SerialCommandEditorBase::clear() {
 
 void SerialCommandEditorBase::handleConnected(bool isConnected) {
 	clear();
+	if (history == &ownHistory && !historyStore) {
+		// Saved or shared history is kept across connections
+		historyClear();
+	}
 
 	if (terminalType != TerminalType::DUMB) {
 		getScreenSize();
@@ -812,32 +1141,96 @@ void SerialCommandEditorBase::getScreenSize() {
 	// https://stackoverflow.com/questions/35688348/how-do-i-determine-size-of-ansi-terminal
 	gettingScreenSize = true;
 	startScreenSizeMillis = millis();
-	setCursorPosition(999, 999);
-	getCursorPosition();
+	if (screenSizeProbe) {
+		setCursorPosition(999, 999);
+		getCursorPosition();
+	}
+}
+
+void SerialCommandEditorBase::setScreenSize(int rows, int cols) {
+	if (rows <= 0 || cols <= 0) {
+		return;
+	}
+	DEBUG_HIGH(("setScreenSize rows=%d cols=%d", rows, cols));
+	screenRows = rows;
+	screenCols = cols;
+
+	if (gettingScreenSize) {
+		gettingScreenSize = false;
+		terminalType = TerminalType::ANSI;
+		startScreenSizeMillis = 0;
+		startEditing();
+	}
+	else
+	if (terminalType == TerminalType::ANSI && editRow > 0) {
+		// Resized while editing
+		beginFrame();
+		if (editRow > screenRows) {
+			editRow = screenRows;
+		}
+		scrollToView(ScrollView::VISIBLE, true);
+		endFrame();
+	}
+}
+
+SerialCommandEditorBase &SerialCommandEditorBase::withLineInput(bool value) {
+	if (value != lineInput) {
+		lineInput = value;
+		terminalType = value ? TerminalType::DUMB : TerminalType::UNKNOWN;
+		keyEscapeOffset = 0;
+	}
+	return *this;
+}
+
+SerialCommandEditorBase &SerialCommandEditorBase::withScreenSizeProbe(bool value) {
+	screenSizeProbe = value;
+	if (value && gettingScreenSize) {
+		getScreenSize();
+	}
+	return *this;
 }
 
 
 
 void SerialCommandEditorBase::loop() {
 	// Check for escape
-	if ((keyEscapeOffset == 1) && (millis() - lastKeyMillis > 10)) {
+	if ((keyEscapeOffset == 1) && (millis() - lastKeyMillis > ESCAPE_TIMEOUT_MS)) {
 		// Got an ESC but did not get a [ right away, so it's probably someone hitting the ESC key
 		DEBUG_HIGH(("esc timed out"));
 		handleSpecialKey(KEY_ESC);
 		keyEscapeOffset = 0;
 	}
-	if (startScreenSizeMillis != 0 && millis() - startScreenSizeMillis > 500) {
+	if (startScreenSizeMillis != 0 && millis() - startScreenSizeMillis > SCREEN_SIZE_TIMEOUT_MS) {
 		// Terminal did not respond with a screen size. Set at 80x24.
 		DEBUG_HIGH(("didn't get screen size"));
 		startScreenSizeMillis = 0;
 		terminalType = TerminalType::DUMB;
 		startEditing();
 	}
+	if (historyStore) {
+		historyStore->loop();
+	}
 
 	// Call base class
 	SerialCommandParserBase::loop();
 }
 
+unsigned long SerialCommandEditorBase::nextDeadline() {
+	unsigned long deadline = SerialCommandParserBase::nextDeadline();
+
+	// loop() uses > for both timeouts, so the deadline is 1 ms after the timeout
+	if (keyEscapeOffset == 1) {
+		deadline = earliestDeadline(deadline, deadlineAfter(lastKeyMillis, ESCAPE_TIMEOUT_MS + 1));
+	}
+	if (startScreenSizeMillis != 0) {
+		deadline = earliestDeadline(deadline, deadlineAfter(startScreenSizeMillis, SCREEN_SIZE_TIMEOUT_MS + 1));
+	}
+	if (historyStore) {
+		deadline = earliestDeadline(deadline, historyStore->nextDeadline());
+	}
+	return deadline;
+}
+
 
 void SerialCommandEditorBase::filterChar(char c) {
 	// _log.trace("char %c %d", c, c);
@@ -845,10 +1238,26 @@ void SerialCommandEditorBase::filterChar(char c) {
 
 	promptRendered = false;
 
+	// Everything written in response to this character is sent in one write
+	beginFrame();
+
+	if (lineInput) {
+		// The client already edited and echoed the line, so just collect it and process it at the end
+		SerialCommandParserBase::processChar(c);
+		endFrame();
+		return;
+	}
+
 	if (c == KEY_ESC && keyEscapeOffset == 0) {
 		keyEscapeBuf[keyEscapeOffset++] = c;
 	}
 	else
+	if (keyEscapeOffset == 1 && (c < 32 || c == KEY_DELETE) && keymap->getAction(c, SerialCommandKeymap::MOD_ALT) != SerialCommandKeymap::Action::NONE) {
+		// Alt with a control character, like Alt-Backspace
+		keyEscapeOffset = 0;
+		handleSpecialKey(c, SerialCommandKeymap::MOD_ALT);
+	}
+	else
 	if (c < 32 || c == KEY_DELETE) {
 		// Handle all control characters, also things like KEY_BACKSPACE, KEY_TAB, etc.
 		handleSpecialKey(c);
@@ -863,6 +1272,13 @@ void SerialCommandEditorBase::filterChar(char c) {
 			if (c == '[') {
 				keyEscapeBuf[keyEscapeOffset++] = c;
 			}
+			else
+			if (keymap->getAction(c, SerialCommandKeymap::MOD_ALT) != SerialCommandKeymap::Action::NONE) {
+				// Alt (Meta) key, sent by the terminal as ESC followed by the key
+				DEBUG_HIGH(("got alt key %c", c));
+				keyEscapeOffset = 0;
+				handleSpecialKey(c, SerialCommandKeymap::MOD_ALT);
+			}
 			else {
 				// Send the ESC and also the key that was just pressed and clear ESC mode.
 				DEBUG_HIGH(("esc not CSI"));
@@ -876,22 +1292,9 @@ void SerialCommandEditorBase::filterChar(char c) {
 			if (c >= 'A' && c <= 'Z') {
 				// Single character xterm sequences
 				DEBUG_HIGH(("got xterm  key %c", c));
-				switch(c) {
-				case 'A':
-					handleSpecialKey(KEY_UP);
-					break;
-
-				case 'B':
-					handleSpecialKey(KEY_DOWN);
-					break;
-
-				case 'C':
-					handleSpecialKey(KEY_RIGHT);
-					break;
-
-				case 'D':
-					handleSpecialKey(KEY_LEFT);
-					break;
+				char key = xtermKeyCode(c);
+				if (key) {
+					handleSpecialKey(key);
 				}
 
 				keyEscapeOffset = 0;
@@ -916,6 +1319,18 @@ void SerialCommandEditorBase::filterChar(char c) {
 					break;
 				}
 			}
+			// Terminate the parameters before searching them
+			keyEscapeBuf[keyEscapeOffset] = 0;
+
+			if (c >= 'A' && c <= 'Z' && c != 'R' && strchr(&keyEscapeBuf[2], ';') != NULL) {
+				// xterm cursor key with modifiers, for example ESC[1;5C for Ctrl-Right
+				char key = xtermKeyCode(c);
+				if (key) {
+					handleSpecialKey(key, xtermModifiers(atoi(strchr(&keyEscapeBuf[2], ';') + 1)));
+				}
+				keyEscapeOffset = 0;
+			}
+			else
 			if (keyEscapeOffset >= (sizeof(keyEscapeBuf) - 1) || c == '~' || c == 'R') {
 
 				// End of sequence normally ends with ~ except for
@@ -935,6 +1350,11 @@ void SerialCommandEditorBase::filterChar(char c) {
 				}
 				if (c == 'R') {
 					DEBUG_HIGH(("got DSR rows=%d cols=%d", n1, n2));
+					if (n1 <= 0 || n2 <= 0) {
+						// Malformed, like ESC[24R. The screen size probe times out instead.
+						DEBUG_HIGH(("ignoring invalid DSR"));
+					}
+					else
 					if (gettingScreenSize) {
 						gettingScreenSize = false;
 						terminalType = TerminalType::ANSI;
@@ -952,31 +1372,33 @@ void SerialCommandEditorBase::filterChar(char c) {
 				}
 				else {
 					DEBUG_HIGH(("got ansi n1=%d n2=%d", n1, n2));
+					// For keys with modifiers, n2 is the xterm modifier, for example ESC[3;5~ for Ctrl-Forward Delete
+					uint8_t modifiers = xtermModifiers(n2);
 					switch(n1) {
 					case 1:
 					case 7:
-						handleSpecialKey(KEY_HOME);
+						handleSpecialKey(KEY_HOME, modifiers);
 						break;
 
 					case 2:
 					case 8:
-						handleSpecialKey(KEY_INSERT);
+						handleSpecialKey(KEY_INSERT, modifiers);
 						break;
 
 					case 3:
-						handleSpecialKey(KEY_FORWARD_DELETE);
+						handleSpecialKey(KEY_FORWARD_DELETE, modifiers);
 						break;
 
 					case 4:
-						handleSpecialKey(KEY_END);
+						handleSpecialKey(KEY_END, modifiers);
 						break;
 
 					case 5:
-						handleSpecialKey(KEY_PAGE_UP);
+						handleSpecialKey(KEY_PAGE_UP, modifiers);
 						break;
 
 					case 6:
-						handleSpecialKey(KEY_PAGE_DOWN);
+						handleSpecialKey(KEY_PAGE_DOWN, modifiers);
 						break;
 
 					default:
@@ -998,6 +1420,11 @@ void SerialCommandEditorBase::filterChar(char c) {
 	else {
 		processChar(c);
 	}
+
+	if (keyEscapeOffset == 0) {
+		suggestUpdate();
+	}
+	endFrame();
 }
 
 void SerialCommandEditorBase::startEditing() {
@@ -1027,6 +1454,7 @@ void SerialCommandEditorBase::handlePromptWithCallback(std::function<void()> han
 		getCursorPosition([this,handlePromptCallback](int row, int col) {
 			editRow = row;
 			editCol = col;
+			wrapRowsDrawn = 1;
 
 			DEBUG_HIGH(("prompt editRow=%d editCol=%d", editRow, editCol));
 
@@ -1045,67 +1473,409 @@ void SerialCommandEditorBase::handlePromptWithCallback(std::function<void()> han
 }
 
 void SerialCommandEditorBase::handleCompletion() {
-	// This null-terminates buffer
-	char *cp = getBuffer();
+	completionAmbiguous = false;
 
-	// Only do completion if we are at the end of the buffer and it has no spaces (command completion only for now)
-	if (cursorPos != (int)bufferOffset || strchr(cp, ' ') != 0) {
+	// Only do completion if we are at the end of the buffer
+	CompletionWord word;
+	if (cursorPos != (int)bufferOffset || !findCompletionWord(word)) {
 		return;
 	}
 
-	// Looks like we can try completion
-
-	std::vector<String> possibleMatches;
-
-	for(CommandHandlerInfo *chi : config->getCommandHandlers()) {
-		for(String s : chi->cmdNames) {
-			if (strncmp(s, buffer, bufferOffset) == 0) {
-				possibleMatches.push_back(s);
+	size_t count = 0;
+	String common;
+	if (word.tokenIndex == 0) {
+		// Names are sorted, so the longest prefix of all of the matches is the one shared by the first and last
+		size_t first = config->findCommandPrefix(word.prefix.c_str(), word.prefix.length(), count);
+		if (count > 0) {
+			const char *firstName = config->getCommandName(first);
+			const char *lastName = config->getCommandName(first + count - 1);
+			size_t len = 0;
+			while(firstName[len] && firstName[len] == lastName[len]) {
+				len++;
 			}
+			common = String(firstName).substring(0, len);
 		}
 	}
+	else {
+		completionCandidates(word, [&count, &common](const char *candidate) {
+			if (count++ == 0) {
+				common = candidate;
+			}
+			else {
+				size_t len = 0;
+				while(len < common.length() && common.charAt(len) == candidate[len]) {
+					len++;
+				}
+				common = common.substring(0, len);
+			}
+		});
+	}
+	DEBUG_HIGH(("%u matches, matching up to %u", count, common.length()));
 
-	if (possibleMatches.size() == 0) {
+	if (count == 0) {
 		// No matches
 		print(KEY_CTRL_G); // bell
 		return;
 	}
-	else
-	if (possibleMatches.size() == 1) {
-		// Exactly one match, match the whole thing
-		setBuffer(possibleMatches[0], true);
+
+	if (common.length() > word.prefix.length()) {
+		completionInsert(&common.c_str()[word.prefix.length()]);
 	}
-	else {
-		// Otherwise, find the longest match and only fill that much
-		for(size_t ii = bufferOffset; ; ii++) {
-			bool matchedAll = true;
-			String s1;
-			for(String s : possibleMatches) {
-				if (s1.length() == 0) {
-					s1 = s;
-				}
-				else {
-					if (strncmp(s1, s, ii) != 0) {
-						DEBUG_HIGH(("did not match s1=%s s=%s", s1.c_str(), s.c_str()));
-						matchedAll = false;
-						break;
-					}
-				}
-			}
-			if (!matchedAll) {
-				// Only match up to ii - 1 characters
-				setBuffer(s1.substring(0, ii - 1), true);
-				DEBUG_HIGH(("matching up to %u: %s", ii - 1, buffer));
-				print(KEY_CTRL_G); // bell
-				break;
-			}
+	if (count > 1) {
+		// Pressing Tab again lists the matches
+		completionAmbiguous = true;
+		print(KEY_CTRL_G); // bell
+	}
+}
+
+bool SerialCommandEditorBase::findCompletionWord(CompletionWord &word) {
+	// This null-terminates buffer
+	char *src = getBuffer();
+
+	const CommandOption *option = NULL;
+	size_t optionArgsLeft = 0;
+
+	for(word.tokenIndex = 0; ; word.tokenIndex++) {
+		while(*src == ' ' || *src == '\t') {
+			src++;
+		}
+
+		char *dst = NULL;
+		char *end = scanToken(src, dst);
+		if (!*end) {
+			// This is the word being completed, which is empty if the line ends with white space
+			break;
+		}
+
+		String token(src, end - src);
+		if (word.tokenIndex == 0) {
+			word.chi = config->getCommandHandlerInfo(token);
+			if (!word.chi) {
+				return false;
+			}
+		}
+		else
+		if (optionArgsLeft > 0) {
+			optionArgsLeft--;
+		}
+		else
+		if (token.startsWith("--")) {
+			option = word.chi->getByLongOpt(&token.c_str()[2]);
+			optionArgsLeft = option ? option->requiredArgs : 0;
+		}
+		else
+		if (token.startsWith("-") && token.length() > 1) {
+			// Only the last of grouped short options can have arguments
+			option = word.chi->getByShortOpt(token.charAt(token.length() - 1));
+			optionArgsLeft = option ? option->requiredArgs : 0;
+		}
+		else {
+			word.argIndex++;
+		}
+		src = end;
+	}
+
+	if (optionArgsLeft > 0) {
+		word.option = option;
+		word.argIndex = option->requiredArgs - optionArgsLeft;
+	}
+
+	// Remove the quotes and escapes from the word in a copy so the buffer is not changed
+	char *copy = strdup(src);
+	if (copy) {
+		char *dst = copy;
+		scanToken(copy, dst);
+		*dst = 0;
+		word.prefix = copy;
+		free(copy);
+	}
+	return true;
+}
+
+void SerialCommandEditorBase::completionCandidates(const CompletionWord &word, const std::function<void(const char *candidate)> &fn) {
+	const char *prefix = word.prefix.c_str();
+	size_t prefixLen = word.prefix.length();
+
+	if (word.tokenIndex == 0) {
+		size_t count;
+		size_t first = config->findCommandPrefix(prefix, prefixLen, count);
+		for(size_t ii = 0; ii < count; ii++) {
+			fn(config->getCommandName(first + ii));
+		}
+	}
+	else
+	if (!word.option && prefix[0] == '-') {
+		for(const CommandOption *opt : word.chi->cmdOptions) {
+			if (opt->longOpt) {
+				String name = String("--") + opt->longOpt;
+				if (strncmp(name, prefix, prefixLen) == 0) {
+					fn(name);
+				}
+			}
+		}
+	}
+	else {
+		const CommandCompleter &completer = word.option ? word.option->completer : word.chi->completer;
+		if (completer) {
+			completer(prefix, word.argIndex, [prefix, prefixLen, &fn](const char *candidate) {
+				if (strncmp(candidate, prefix, prefixLen) == 0) {
+					fn(candidate);
+				}
+			});
+		}
+	}
+}
+
+void SerialCommandEditorBase::completionInsert(const char *str) {
+	String escaped;
+	for(const char *cp = str; *cp; cp++) {
+		if (strchr(" \t\"'\\", *cp)) {
+			escaped.concat('\\');
+		}
+		escaped.concat(*cp);
+	}
+	editInsert(bufferOffset, escaped.c_str(), escaped.length());
+	scrollToView(ScrollView::END, true);
+}
+
+void SerialCommandEditorBase::listCompletions(size_t from) {
+	CompletionWord word;
+	if (!findCompletionWord(word)) {
+		completionListFrom = -1;
+		return;
+	}
+
+	// Candidates with a usage score, up to SerialCommandUsageTable::MAX_ENTRIES of them, are kept sorted by
+	// score and listed first. The rest, usually most of them, aren't kept: the candidates are generated once
+	// for the count and column width, and again to lay out only the ones on this page.
+	String ranked[SerialCommandUsageTable::MAX_ENTRIES];
+	uint16_t scores[SerialCommandUsageTable::MAX_ENTRIES];
+	size_t numRanked = 0;
+	size_t count = 0;
+	size_t width = 0;
+	completionCandidates(word, [&](const char *candidate) {
+		size_t len = strlen(candidate);
+		count++;
+		if (len > width) {
+			width = len;
+		}
+		uint16_t score = usageTable ? usageTable->getScore(candidate, len) : 0;
+		if (score == 0 || numRanked >= SerialCommandUsageTable::MAX_ENTRIES) {
+			return;
+		}
+		size_t ii = numRanked++;
+		for(; ii > 0 && scores[ii - 1] < score; ii--) {
+			ranked[ii] = ranked[ii - 1];
+			scores[ii] = scores[ii - 1];
+		}
+		ranked[ii] = candidate;
+		scores[ii] = score;
+	});
+	width += 2;
+
+	size_t cols = ((screenCols > 0) ? (size_t)screenCols : 80) / width;
+	if (cols == 0) {
+		cols = 1;
+	}
+	// Leave a row for --More-- or the prompt
+	size_t pageRows = (screenRows > 1) ? (size_t)(screenRows - 1) : count;
+	size_t last = from + pageRows * cols;
+	if (last > count) {
+		last = count;
+	}
+
+	// Build the whole page so it's written at once
+	String page;
+	size_t rows = 0;
+	size_t index = 0;
+	auto addToPage = [&](const char *candidate) {
+		if (index >= from && index < last) {
+			page.concat(candidate);
+			if (((index - from + 1) % cols) == 0 || (index + 1) == last) {
+				page.concat("\r\n");
+				rows++;
+			}
+			else {
+				for(size_t pad = strlen(candidate); pad < width; pad++) {
+					page.concat(' ');
+				}
+			}
+		}
+		index++;
+	};
+	for(size_t ii = 0; ii < numRanked; ii++) {
+		addToPage(ranked[ii].c_str());
+	}
+	if (last > numRanked) {
+		// The first numRanked candidates with a score were listed above
+		size_t scored = 0;
+		completionCandidates(word, [&](const char *candidate) {
+			if (index >= last) {
+				return;
+			}
+			if (scored < numRanked && usageTable->getScore(candidate, strlen(candidate)) != 0) {
+				scored++;
+				return;
+			}
+			addToPage(candidate);
+		});
+	}
+
+	beginFrame();
+	setCursorPosition(editRow, 1);
+	if (wrapMode) {
+		eraseToEndOfScreen();
+	}
+	else {
+		eraseToEndOfLine();
+	}
+	promptRendered = false;
+
+	write((const uint8_t *)page.c_str(), page.length());
+	editRow += rows;
+	if (screenRows > 0 && editRow > screenRows) {
+		// The terminal scrolled, leaving the cursor on the last row
+		editRow = screenRows;
+	}
+
+	if (last < count) {
+		print("--More--");
+		completionListFrom = (int)last;
+	}
+	else {
+		completionListFrom = -1;
+		printMessagePrompt();
+	}
+	endFrame();
+}
+
+int SerialCommandEditorBase::suggestIndex() const {
+	// The line could have been removed from shared history since it was found
+	int index = (suggestSeq != 0) ? history->findOlder(suggestSeq + 1) : -1;
+	return (index >= 0 && history->getSeq(index) == suggestSeq) ? index : -1;
+}
+
+String SerialCommandEditorBase::getSuggestion() {
+	String result;
+	int index = suggestIndex();
+	if (index >= 0 && cursorPos == (int)bufferOffset) {
+		SerialCommandHistory::Entry entry = history->get(index);
+		for(size_t ii = bufferOffset; ii < entry.length(); ii++) {
+			result.concat(entry.charAt(ii));
+		}
+	}
+	return result;
+}
+
+void SerialCommandEditorBase::suggestUpdate() {
+	if (!suggestEnabled || wrapMode || terminalType != TerminalType::ANSI) {
+		return;
+	}
+	if (cursorPos != (int)bufferOffset || bufferOffset == 0 || searching || completionListFrom >= 0) {
+		// A suggestion that's already drawn stays while the cursor moves, but a new one is only drawn at the end
+		return;
+	}
+	if (suggestFor == bufferOffset) {
+		// Line not changed
+		return;
+	}
+
+	int index;
+	if (suggestFor > 0) {
+		// Only added characters, so lines newer than the last match still don't match
+		index = (suggestSeq != 0) ? history->findOlder(suggestSeq + 1) : -1;
+	}
+	else {
+		index = 0;
+	}
+	for(; index >= 0 && index < (int)history->size(); index++) {
+		SerialCommandHistory::Entry entry = history->get(index);
+		if (entry.length() > bufferOffset && entry.startsWith(buffer, bufferOffset)) {
+			break;
+		}
+	}
+	if (index >= (int)history->size()) {
+		index = -1;
+	}
+	suggestSeq = (index >= 0) ? history->getSeq(index) : 0;
+	suggestFor = bufferOffset;
+
+	if (suggestSeq != 0 && suggestSeq == suggestDrawnSeq && suggestDrawn > 0) {
+		// Typed the next character of the suggestion that's already on the screen
+		return;
+	}
+	if (suggestDrawn > 0) {
+		eraseToEndOfLine();
+	}
+	if (index < 0) {
+		return;
+	}
+
+	// Stop before the last column, like the line itself, so the terminal doesn't wrap
+	SerialCommandHistory::Entry entry = history->get(index);
+	int cursorCol = editCol + (cursorPos - horizScroll);
+	int numToDraw = (int)(entry.length() - bufferOffset);
+	if (numToDraw > (screenCols - 1 - cursorCol)) {
+		numToDraw = screenCols - 1 - cursorCol;
+	}
+	if (numToDraw <= 0) {
+		return;
+	}
+
+	setGraphicRendition(2);
+	for(int ii = 0; ii < numToDraw; ii++) {
+		print(entry.charAt(bufferOffset + ii));
+	}
+	setGraphicRendition(0);
+	cursorBack(numToDraw);
+	suggestDrawn = numToDraw;
+	suggestDrawnSeq = suggestSeq;
+}
+
+bool SerialCommandEditorBase::suggestAccept() {
+	String suggestion = getSuggestion();
+	if (suggestion.length() == 0) {
+		return false;
+	}
+
+	int cursorCol = editCol + (cursorPos - horizScroll);
+	size_t count = editInsert(bufferOffset, suggestion.c_str(), suggestion.length());
+	if ((cursorCol + (int)count) < (screenCols - 1)) {
+		// Fits on the screen, so just print over the dimmed text
+		print(suggestion.substring(0, count));
+		cursorPos += count;
+		suggestDrawn = 0;
+	}
+	else {
+		scrollToView(ScrollView::END, true);
+	}
+	return true;
+}
+
+void SerialCommandEditorBase::suggestErase() {
+	if (suggestDrawn > 0 && !wrapMode) {
+		if (cursorPos != (int)bufferOffset) {
+			setCursorPosition(editRow, editCol + bufferOffset - horizScroll);
 		}
+		eraseToEndOfLine();
+	}
+}
+
+void SerialCommandEditorBase::completionMoreKey(char key) {
+	if (key == ' ' || key == KEY_TAB) {
+		listCompletions(completionListFrom);
+	}
+	else {
+		completionListFrom = -1;
+		setCursorPosition(editRow, 1);
+		eraseToEndOfLine();
+		printMessagePrompt();
 	}
 }
 
 
 
-void SerialCommandEditorBase::handleSpecialKey(char key) {
+void SerialCommandEditorBase::handleSpecialKey(char key, uint8_t modifiers) {
 	if (terminalType == TerminalType::UNKNOWN) {
 		if ((key == KEY_CR || key == KEY_LF || key == KEY_CTRL_L) && bufferOffset == 0 && screenRows == 0 && screenCols == 0) {
 			// Hitting return with an unknown terminal type starts detection
@@ -1114,35 +1884,60 @@ void SerialCommandEditorBase::handleSpecialKey(char key) {
 		}
 	}
 	if (terminalType != TerminalType::ANSI) {
-		SerialCommandParserBase::processChar(key);
+		if (modifiers == SerialCommandKeymap::MOD_NONE) {
+			SerialCommandParserBase::processChar(key);
+		}
+		return;
+	}
+
+	if (completionListFrom >= 0) {
+		completionMoreKey(key);
+		return;
+	}
+
+	DEBUG_HIGH(("special key %d modifiers %d", key, modifiers));
+	SerialCommandKeymap::Action action = keymap->getAction(key, modifiers);
+	if (searching && searchKey(key, action)) {
 		return;
 	}
+	performAction(action, key);
+}
 
-	DEBUG_HIGH(("special key %d", key));
-	switch(key) {
+void SerialCommandEditorBase::performAction(SerialCommandKeymap::Action action, char key) {
+	// yankPop() is only valid right after a yank
+	SerialCommandKeymap::Action previousAction = lastAction;
+	lastAction = action;
+
+	switch(action) {
+	case SerialCommandKeymap::Action::NONE:
+		break;
 
-	case KEY_CTRL_A:
-	case KEY_HOME:
+	case SerialCommandKeymap::Action::BEGINNING_OF_LINE:
 		cursorPos = 0;
 		horizScroll = 0;
-		redraw(0);
+		if (!wrapMode) {
+			redraw(0);
+		}
 		setCursor();
 		break;
 
-	case KEY_BACKSPACE:
-	case KEY_DELETE:
+	case SerialCommandKeymap::Action::BACKWARD_DELETE_CHAR:
 		// Delete the character to the left of cursorPos
 		if (cursorPos > 0) {
-			deleteCharacterLeft(cursorPos);
+			editDelete(cursorPos - 1, 1);
 			cursorPos--;
 			scrollToView(ScrollView::VISIBLE, true);
 		}
 		break;
 
-	case KEY_CTRL_B:
-	case KEY_LEFT:
+	case SerialCommandKeymap::Action::BACKWARD_CHAR:
 		if (cursorPos > 0) {
 			cursorPos--;
+			if (wrapMode) {
+				// May move up to the end of the previous row
+				setCursor();
+			}
+			else
 			if (cursorPos >= horizScroll) {
 				cursorBack(1);
 			}
@@ -1154,26 +1949,40 @@ void SerialCommandEditorBase::handleSpecialKey(char key) {
 		}
 		break;
 
-	case KEY_CTRL_E:
-	case KEY_END:
+	case SerialCommandKeymap::Action::END_OF_LINE:
+		if (cursorPos == (int)bufferOffset && suggestAccept()) {
+			break;
+		}
 		cursorPos = bufferOffset;
 		scrollToView(ScrollView::END, true);
 		break;
 
-	case KEY_CTRL_F:
-	case KEY_RIGHT:
-		if (cursorPos < (int)bufferOffset) {
+	case SerialCommandKeymap::Action::FORWARD_CHAR:
+		if (cursorPos == (int)bufferOffset) {
+			suggestAccept();
+		}
+		else {
+			if (wrapMode) {
+				cursorPos++;
+				setCursor();
+				break;
+			}
 			cursorForward(1);
 			cursorPos++;
 			scrollToView(ScrollView::VISIBLE, false);
 		}
 		break;
 
-	case KEY_TAB:
-		handleCompletion();
+	case SerialCommandKeymap::Action::COMPLETE:
+		if (previousAction == SerialCommandKeymap::Action::COMPLETE && completionAmbiguous) {
+			listCompletions(0);
+		}
+		else {
+			handleCompletion();
+		}
 		break;
 
-	case KEY_CTRL_L:
+	case SerialCommandKeymap::Action::CLEAR_SCREEN:
 		setCursorPosition(1, 1);
 		eraseScreen();
 		handlePromptWithCallback([this]() {
@@ -1181,51 +1990,134 @@ void SerialCommandEditorBase::handleSpecialKey(char key) {
 		});
 		break;
 
-	case KEY_CTRL_K:
-		deleteToEnd(cursorPos);
-		scrollToView(ScrollView::VISIBLE, true);
+	case SerialCommandKeymap::Action::KILL_LINE:
+		killText(cursorPos, bufferOffset - cursorPos);
+		redrawFrom(cursorPos);
+		break;
+
+	case SerialCommandKeymap::Action::UNIX_LINE_DISCARD:
+		killText(0, cursorPos);
+		cursorPos = 0;
+		redrawFrom(0);
 		break;
 
-	case KEY_CTRL_N:
-	case KEY_DOWN:
-		if (curHistory > 0) {
-			// There is a next history
-			setBuffer(historyGet(--curHistory));
-			scrollToView(ScrollView::END, false);
+	case SerialCommandKeymap::Action::BACKWARD_WORD:
+		cursorPos = findWordStart(cursorPos);
+		scrollToView(ScrollView::VISIBLE, cursorPos < horizScroll);
+		break;
 
-			if (curHistory == 0 && firstHistoryIsTemporary) {
-				historyRemoveFirst();
-				firstHistoryIsTemporary = false;
-				curHistory = -1;
-			}
+	case SerialCommandKeymap::Action::FORWARD_WORD:
+		cursorPos = findWordEnd(cursorPos);
+		scrollToView(ScrollView::VISIBLE, false);
+		break;
+
+	case SerialCommandKeymap::Action::KILL_WORD:
+		killText(cursorPos, findWordEnd(cursorPos) - cursorPos);
+		redrawFrom(cursorPos);
+		break;
+
+	case SerialCommandKeymap::Action::BACKWARD_KILL_WORD: {
+		size_t start = findWordStart(cursorPos);
+		killText(start, cursorPos - start);
+		cursorPos = start;
+		redrawFrom(cursorPos);
+		break;
+	}
+
+	case SerialCommandKeymap::Action::UNIX_WORD_RUBOUT: {
+		// Words are separated by whitespace only, unlike BACKWARD_KILL_WORD
+		size_t start = cursorPos;
+		while(start > 0 && buffer[start - 1] == ' ') {
+			start--;
 		}
-		else
-		if (curHistory == 0) {
-			// Down from first history if not temporary should make a blank line
-			setBuffer("");
-			curHistory = -1;
+		while(start > 0 && buffer[start - 1] != ' ') {
+			start--;
+		}
+		killText(start, cursorPos - start);
+		cursorPos = start;
+		redrawFrom(cursorPos);
+		break;
+	}
+
+	case SerialCommandKeymap::Action::YANK:
+		if (!yank()) {
+			print(KEY_CTRL_G); // bell
+		}
+		break;
+
+	case SerialCommandKeymap::Action::YANK_POP:
+		if ((previousAction != SerialCommandKeymap::Action::YANK && previousAction != SerialCommandKeymap::Action::YANK_POP) || !yankPop()) {
+			print(KEY_CTRL_G); // bell
+			lastAction = SerialCommandKeymap::Action::NONE;
+		}
+		break;
+
+	case SerialCommandKeymap::Action::PREVIOUS_MOST_USED_HISTORY:
+		historyMostUsed(true);
+		break;
+
+	case SerialCommandKeymap::Action::NEXT_MOST_USED_HISTORY:
+		historyMostUsed(false);
+		break;
+
+	case SerialCommandKeymap::Action::REVERSE_SEARCH_HISTORY:
+		searchStart();
+		break;
+
+	case SerialCommandKeymap::Action::UNDO:
+		if (!undo()) {
+			print(KEY_CTRL_G); // bell
+		}
+		break;
+
+	case SerialCommandKeymap::Action::REDO:
+		if (!redo()) {
+			print(KEY_CTRL_G); // bell
+		}
+		break;
+
+	case SerialCommandKeymap::Action::NEXT_HISTORY:
+		if (historyCursor != 0) {
+			int index = history->findNewer(historyCursor);
+			if (index >= 0) {
+				historyCursor = history->getSeq(index);
+				setBuffer(history->get(index));
+				scrollToView(ScrollView::END, false);
+			}
+			else {
+				// Down from the newest line goes back to the line that was being edited, which may be blank
+				historyCursor = 0;
+				setBuffer(savedLine.c_str(), true);
+				savedLine = "";
+			}
 		}
 		break;
 
-	case KEY_CTRL_P:
-	case KEY_UP:
+	case SerialCommandKeymap::Action::PREVIOUS_HISTORY:
 		// Previous in history
-		if ((curHistory + 1) < historySize()) {
-			// There is an entry to go back to
-			if (curHistory == -1 && bufferOffset > 0) {
-				// Save existing buffer as temporary entry
-				historyAdd(getBuffer(), true);
-				curHistory++;
+		{
+			int index = (historyCursor == 0) ? ((history->size() > 0) ? 0 : -1) : history->findOlder(historyCursor);
+			if (index >= 0) {
+				if (historyCursor == 0) {
+					// Save the line being edited so going down again restores it
+					savedLine = getBuffer();
+				}
+				historyCursor = history->getSeq(index);
+				setBuffer(history->get(index));
+				scrollToView(ScrollView::END, false);
 			}
-			setBuffer(historyGet(++curHistory));
-			scrollToView(ScrollView::END, false);
 		}
 		break;
 
-	case KEY_CR:
-	case KEY_LF:
+	case SerialCommandKeymap::Action::ACCEPT_LINE:
 		// Terminate the buffer and move to the next line
 		buffer[bufferOffset] = 0;
+		suggestErase();
+		if (wrapMode && terminalType == TerminalType::ANSI) {
+			// Leave the cursor below the last row of the line, not the row the cursor is on
+			editRow = wrapRow(bufferOffset);
+			setCursorPosition(editRow, wrapCol(bufferOffset));
+		}
 		println("");
 		if (editRow < screenRows) {
 			editRow++;
@@ -1233,6 +2125,7 @@ void SerialCommandEditorBase::handleSpecialKey(char key) {
 
 		// Save the line in history
 		historyAdd(buffer, false);
+		usageRecord(buffer);
 
 		// processLine will redraw the prompt as well
 		processLine();
@@ -1242,19 +2135,23 @@ void SerialCommandEditorBase::handleSpecialKey(char key) {
 
 		break;
 
-	case KEY_FORWARD_DELETE:
-		if (cursorPos < (int)(bufferOffset - 1)) {
-			deleteCharacterAt(cursorPos);
-			scrollToView(ScrollView::VISIBLE, false);
+	case SerialCommandKeymap::Action::DELETE_CHAR:
+		if (cursorPos < (int)bufferOffset) {
+			editDelete(cursorPos, 1);
+			scrollToView(ScrollView::VISIBLE, true);
 		}
 		break;
 
+	default:
+		keymap->runCustomAction(action, this, key);
+		break;
 	}
 
 }
 
 void SerialCommandEditorBase::setBuffer(const char *str, bool atEnd) {
 	size_t len = strlen(str);
+	reserveBuffer(len + 1);
 	if (len < (bufferSize - 1)) {
 		strcpy(buffer, str);
 		bufferOffset = len;
@@ -1264,6 +2161,20 @@ void SerialCommandEditorBase::setBuffer(const char *str, bool atEnd) {
 		buffer[bufferSize - 1] = 0;
 		bufferOffset = bufferSize - 1;
 	}
+	bufferReplaced(atEnd);
+}
+
+void SerialCommandEditorBase::setBuffer(const SerialCommandHistory::Entry &entry, bool atEnd) {
+	reserveBuffer(entry.length() + 1);
+	bufferOffset = entry.copyTo(buffer, bufferSize);
+	bufferReplaced(atEnd);
+}
+
+void SerialCommandEditorBase::bufferReplaced(bool atEnd) {
+	// The edits in the undo log apply to the old line, not this one
+	undoClear();
+	markDirty(0);
+
 	if (atEnd) {
 		scrollToView(ScrollView::END, true);
 	}
@@ -1273,20 +2184,49 @@ void SerialCommandEditorBase::setBuffer(const char *str, bool atEnd) {
 }
 
 void SerialCommandEditorBase::processChar(char c) {
+	lastAction = SerialCommandKeymap::Action::NONE;
+
 	if (terminalType != TerminalType::ANSI) {
 		SerialCommandParserBase::processChar(c);
 	}
 	else
+	if (completionListFrom >= 0) {
+		completionMoreKey(c);
+	}
+	else
+	if (searching) {
+		searchAddChar(c);
+	}
+	else
 	if (cursorPos == (int)bufferOffset) {
 		// Typing at end of the line
-		appendCharacter(c);
+		if (editInsert(cursorPos, &c, 1) == 0) {
+			// Buffer is full
+			return;
+		}
 		DEBUG_HIGH(("append %c at %d", c, cursorPos));
 
+		if (wrapMode) {
+			print(c);
+			cursorPos++;
+			dirtyPos = -1;
+			if (wrapCol(cursorPos) == 1) {
+				// Filled the last column, so explicitly move to the start of the next row
+				wrapEnsureRows();
+				setCursor();
+			}
+			return;
+		}
+
 		int cursorCol = editCol + (cursorPos - horizScroll);
 		if (cursorCol < (screenCols - 1)) {
 			DEBUG_HIGH(("append %c at cursorPos=%d", c, cursorPos));
 			print(c);
 			cursorPos++;
+			if (suggestDrawn > 0) {
+				// The character replaced the first character of the suggestion on the screen
+				suggestDrawn--;
+			}
 		}
 		else {
 			// We're at the rightmost column so we need to scroll instead of just printing and wrapping
@@ -1299,8 +2239,14 @@ void SerialCommandEditorBase::processChar(char c) {
 	else {
 		// Inserting in the middle of the line
 		DEBUG_HIGH(("insert %c at cursorPos=%d bufferOffset=%d", c, cursorPos, bufferOffset));
-		insertCharacterAt(cursorPos, c);
+		if (editInsert(cursorPos, &c, 1) == 0) {
+			// Buffer is full
+			return;
+		}
 		redraw(cursorPos++);
+		if (!wrapMode) {
+			setCursor();
+		}
 	}
 }
 
@@ -1311,6 +2257,26 @@ void SerialCommandEditorBase::scrollToView(ScrollView which, bool forceRedraw) {
 
 	DEBUG_HIGH(("scrollToView which=%d forceRedraw=%d editCol=%d", which, forceRedraw, editCol));
 
+	if (wrapMode) {
+		// Everything is always visible, so only the changed part of the line needs to be drawn
+		horizScroll = 0;
+		if (which == ScrollView::HOME) {
+			cursorPos = 0;
+		}
+		else
+		if (which == ScrollView::END) {
+			cursorPos = (int)bufferOffset;
+		}
+		if (forceRedraw || dirtyPos >= 0) {
+			// Leaves the cursor at cursorPos
+			redraw((int)bufferOffset);
+		}
+		else {
+			setCursor();
+		}
+		return;
+	}
+
 	int widthRightOfPrompt = screenCols - editCol;
 
 	switch(which) {
@@ -1411,6 +2377,11 @@ void SerialCommandEditorBase::redraw(int fromPos) {
 
 	DEBUG_HIGH(("redraw fromPos=%d horizScroll=%d", fromPos, horizScroll));
 
+	if (wrapMode) {
+		redrawWrapped(fromPos);
+		return;
+	}
+
 	// "fromPosCol" is the column for fromPos (taking into account scrolling and the prompt)
 	int fromPosCol = editCol + (fromPos - horizScroll);
 
@@ -1431,17 +2402,109 @@ void SerialCommandEditorBase::redraw(int fromPos) {
 	eraseToEndOfLine();
 }
 
-void SerialCommandEditorBase::setCursor() {
-	DEBUG_HIGH(("setCursor editRow=%d editCol=%d cursorPos=%d horizScroll=%d", editRow, editCol, cursorPos, horizScroll));
-	setCursorPosition(editRow, editCol + cursorPos - horizScroll);
-}
+void SerialCommandEditorBase::redrawFrom(int fromPos) {
+	if (terminalType != TerminalType::ANSI) {
+		return;
+	}
 
-void SerialCommandEditorBase::printMessage(const char *fmt, ...) {
-	va_list ap;
+	if (wrapMode) {
+		redraw(fromPos);
+		return;
+	}
 
-	va_start(ap, fmt);
-	vprintMessage(true, fmt, ap);
-	va_end(ap);
+	// Only redraw the changed part if the horizontal scroll position would not change
+	int widthRightOfPrompt = screenCols - editCol;
+	bool scrollUnchanged;
+	if ((int)bufferOffset <= widthRightOfPrompt) {
+		scrollUnchanged = (horizScroll == 0);
+	}
+	else {
+		scrollUnchanged = (cursorPos >= horizScroll && cursorPos <= (horizScroll + widthRightOfPrompt) && (horizScroll + widthRightOfPrompt) <= (int)bufferOffset);
+	}
+
+	if (scrollUnchanged) {
+		redraw((fromPos > horizScroll) ? fromPos : horizScroll);
+		setCursor();
+	}
+	else {
+		scrollToView(ScrollView::VISIBLE, true);
+	}
+}
+
+void SerialCommandEditorBase::setCursor() {
+	DEBUG_HIGH(("setCursor editRow=%d editCol=%d cursorPos=%d horizScroll=%d", editRow, editCol, cursorPos, horizScroll));
+	if (wrapMode) {
+		setCursorPosition(wrapRow(cursorPos), wrapCol(cursorPos));
+	}
+	else {
+		setCursorPosition(editRow, editCol + cursorPos - horizScroll);
+	}
+}
+
+void SerialCommandEditorBase::wrapEnsureRows() {
+	// The row after the last character must exist too, since the cursor can be there
+	int overflow = wrapRow(bufferOffset) - screenRows;
+	if (overflow > 0) {
+		// A line feed on the bottom row scrolls the whole screen up one row
+		setCursorPosition(screenRows, 1);
+		for(int ii = 0; ii < overflow; ii++) {
+			print('\n');
+		}
+		editRow -= overflow;
+		if (editRow < 1) {
+			// The line is taller than the screen, so its start has scrolled off
+			editRow = 1;
+		}
+	}
+	int rows = wrapRow(bufferOffset) - editRow + 1;
+	if (rows > wrapRowsDrawn) {
+		wrapRowsDrawn = rows;
+	}
+}
+
+void SerialCommandEditorBase::redrawWrapped(int fromPos) {
+	// Anything changed before fromPos that hasn't been drawn yet must be drawn too
+	if (dirtyPos >= 0 && dirtyPos < fromPos) {
+		fromPos = dirtyPos;
+	}
+	if (fromPos > (int)bufferOffset) {
+		fromPos = (int)bufferOffset;
+	}
+	dirtyPos = -1;
+
+	int rowsBefore = wrapRowsDrawn;
+	wrapRowsDrawn = 0;
+	wrapEnsureRows();
+	int rowsNow = wrapRowsDrawn;
+
+	DEBUG_HIGH(("redrawWrapped fromPos=%d rowsBefore=%d rowsNow=%d", fromPos, rowsBefore, rowsNow));
+
+	setCursorPosition(wrapRow(fromPos), wrapCol(fromPos));
+	if (fromPos < (int)bufferOffset) {
+		// The terminal wraps at the right margin so the rest of the line can be printed at once
+		write((const uint8_t *)&buffer[fromPos], bufferOffset - fromPos);
+
+		// Explicitly position after the last character, as the cursor is left in the last column
+		// when the line ends exactly at the right margin
+		setCursorPosition(wrapRow(bufferOffset), wrapCol(bufferOffset));
+	}
+
+	if (rowsNow < rowsBefore) {
+		// Line got shorter, also clear the rows it no longer uses
+		eraseToEndOfScreen();
+	}
+	else {
+		eraseToEndOfLine();
+	}
+	setCursor();
+}
+
+void SerialCommandEditorBase::printMessage(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintMessage(true, fmt, ap);
+	va_end(ap);
 }
 
 void SerialCommandEditorBase::printMessageNoPrompt(const char *fmt, ...) {
@@ -1473,6 +2536,8 @@ void SerialCommandEditorBase::vprintMessage(bool prompt, const char *fmt, va_lis
     	message = internalBuf;
     }
 
+	beginFrame();
+
 	if (terminalType != TerminalType::ANSI) {
 		// Just print the message for dumb terminal or non-interactive mode
 		printWithNewLine(message, true);
@@ -1480,7 +2545,13 @@ void SerialCommandEditorBase::vprintMessage(bool prompt, const char *fmt, va_lis
 	else {
 		// Move cursor to the left
 		setCursorPosition(editRow, 1);
-		eraseToEndOfLine();
+		if (wrapMode) {
+			// The line being edited may use more than one row
+			eraseToEndOfScreen();
+		}
+		else {
+			eraseToEndOfLine();
+		}
 		promptRendered = false;
 
 		editRow += printWithNewLine(message, true);
@@ -1490,6 +2561,8 @@ void SerialCommandEditorBase::vprintMessage(bool prompt, const char *fmt, va_lis
 		}
 	}
 
+	endFrame();
+
     if (message != internalBuf) {
     	free((void *)message);
     }
@@ -1505,271 +2578,2495 @@ void SerialCommandEditorBase::printMessagePrompt() {
 }
 
 
-void SerialCommandEditorBase::historyAdd(const char *line, bool temporary) {
-	size_t len = strlen(line) + 1;
+size_t SerialCommandEditorBase::editInsert(size_t pos, const char *str, size_t len) {
+	if (pos > bufferOffset) {
+		pos = bufferOffset;
+	}
+	len = insertCharactersAt(pos, str, len);
+	if (len > 0) {
+		undoRecord(true, pos, &buffer[pos], len);
+		markDirty(pos);
+	}
+	return len;
+}
 
-	if (len > historyBufferSize) {
-		// Line is too long to fit, so ignore
+void SerialCommandEditorBase::editDelete(size_t pos, size_t len) {
+	if (pos >= bufferOffset) {
+		return;
+	}
+	if (len > bufferOffset - pos) {
+		len = bufferOffset - pos;
+	}
+	if (len == 0) {
 		return;
 	}
+	// Save the bytes before they're removed
+	undoRecord(false, pos, &buffer[pos], len);
+	deleteCharactersAt(pos, len);
+	markDirty(pos);
+}
+
+void SerialCommandEditorBase::undoRecord(bool isInsert, size_t pos, const char *data, size_t len) {
+	// A new edit discards anything that could have been redone
+	while(undoRedoCount > 0) {
+		undoLog.removeNewest();
+		undoRedoCount--;
+		undoSealed = true;
+	}
 
-	if (firstHistoryIsTemporary) {
-		// Remove the existing temporary history
-		historyRemoveFirst();
+	RecordRing::Record *last = undoSealed ? NULL : undoLog.get(0);
+	if (last) {
+		if (isInsert) {
+			// Typing extends the previous insert, but each word is a separate undo step
+			if ((last->flags & UNDO_FLAG_INSERT) && pos == (size_t)(last->aux + last->length) &&
+				!(undoLog.getData(last)[last->length - 1] == ' ' && data[0] != ' ')) {
+				if (undoLog.append(data, len)) {
+					return;
+				}
+			}
+		}
+		else
+		if (!(last->flags & UNDO_FLAG_INSERT)) {
+			if (pos == last->aux && !(last->flags & UNDO_FLAG_BACKWARD)) {
+				// Forward delete at the same position
+				if (undoLog.append(data, len)) {
+					return;
+				}
+			}
+			else
+			if (len == 1 && (pos + 1) == last->aux && (last->length == 1 || (last->flags & UNDO_FLAG_BACKWARD))) {
+				// Backspace, the bytes are saved in reverse order
+				if (undoLog.append(data, len)) {
+					last->flags |= UNDO_FLAG_BACKWARD;
+					last->aux = (uint16_t) pos;
+					return;
+				}
+			}
+		}
 	}
 
-	while((strlen(historyBuffer) + len + 1) > historyBufferSize) {
-		historyRemoveLast();
+	if (!undoLog.add(data, len)) {
+		// Too large to save. The older edits can't be undone correctly without it.
+		undoClear();
+		return;
 	}
-	memmove(&historyBuffer[len], historyBuffer, strlen(historyBuffer) + 1);
+	RecordRing::Record *rec = undoLog.get(0);
+	rec->aux = (uint16_t) pos;
+	rec->flags = isInsert ? UNDO_FLAG_INSERT : 0;
+	undoSealed = false;
+}
 
-	memmove(historyBuffer, line, len - 1);
-	historyBuffer[len - 1] = '\n';
+bool SerialCommandEditorBase::undo() {
+	RecordRing::Record *rec = undoLog.get(undoRedoCount);
+	if (!rec) {
+		return false;
+	}
+	undoRedoCount++;
+	undoSealed = true;
+	markDirty(rec->aux);
 
-	firstHistoryIsTemporary = temporary;
+	if (rec->flags & UNDO_FLAG_INSERT) {
+		deleteCharactersAt(rec->aux, rec->length);
+		cursorPos = rec->aux;
+	}
+	else {
+		size_t len = insertCharactersAt(rec->aux, undoLog.getData(rec), rec->length);
+		if (rec->flags & UNDO_FLAG_BACKWARD) {
+			// Restore the original order and put the cursor back after the deleted text
+			std::reverse(&buffer[rec->aux], &buffer[rec->aux + len]);
+			cursorPos = rec->aux + len;
+		}
+		else {
+			cursorPos = rec->aux;
+		}
+	}
+	scrollToView(ScrollView::VISIBLE, true);
+	return true;
 }
 
-String SerialCommandEditorBase::historyGet(int index) {
+bool SerialCommandEditorBase::redo() {
+	if (undoRedoCount == 0) {
+		return false;
+	}
+	RecordRing::Record *rec = undoLog.get(--undoRedoCount);
+	markDirty(rec->aux);
 
-	char *cp, *last;
+	if (rec->flags & UNDO_FLAG_INSERT) {
+		size_t len = insertCharactersAt(rec->aux, undoLog.getData(rec), rec->length);
+		cursorPos = rec->aux + len;
+	}
+	else {
+		deleteCharactersAt(rec->aux, rec->length);
+		cursorPos = rec->aux;
+	}
+	scrollToView(ScrollView::VISIBLE, true);
+	return true;
+}
 
-	cp = historyBuffer;
-	for(size_t ii = 0; *cp; ii++) {
-		last = cp;
-		cp = strchr(last, '\n');
-		if ((int)ii == index) {
-			if (cp) {
-				return String(last, cp - last);
-			}
-			else {
-				return String(last);
-			}
-		}
+void SerialCommandEditorBase::undoClear() {
+	undoLog.clear();
+	undoRedoCount = 0;
+	undoSealed = true;
+}
 
-		if (!cp) {
-			break;
-		}
-		cp++;
+void SerialCommandEditorBase::killText(size_t pos, size_t len) {
+	if (pos >= bufferOffset || len == 0) {
+		return;
+	}
+	if (len > bufferOffset - pos) {
+		len = bufferOffset - pos;
 	}
-	return String("");
+	// If the text is larger than the kill ring it's still deleted, it just can't be yanked
+	killRing.add(&buffer[pos], len);
+	editDelete(pos, len);
 }
 
-int SerialCommandEditorBase::historySize() {
-	DEBUG_HIGH(("historySize: buffer=%s", historyBuffer));
-	int size = 0;
-	char *cp = historyBuffer;
-	while(*cp) {
-		size++;
-		cp = strchr(cp, '\n');
-		if (!cp) {
-			break;
-		}
-		cp++;
+bool SerialCommandEditorBase::yank() {
+	const RecordRing::Record *rec = killRing.get(0);
+	if (!rec) {
+		return false;
 	}
-	return size;
+	yankIndex = 0;
+	yankPos = cursorPos;
+	yankLen = editInsert(cursorPos, killRing.getData(rec), rec->length);
+	cursorPos += yankLen;
+	redrawFrom(yankPos);
+	return true;
 }
 
-void SerialCommandEditorBase::historyClear() {
-	historyBuffer[0] = 0;
+bool SerialCommandEditorBase::yankPop() {
+	if (killRing.size() < 2) {
+		return false;
+	}
+	yankIndex = (yankIndex + 1) % killRing.size();
+	const RecordRing::Record *rec = killRing.get(yankIndex);
+
+	editDelete(yankPos, yankLen);
+	yankLen = editInsert(yankPos, killRing.getData(rec), rec->length);
+	cursorPos = yankPos + yankLen;
+	redrawFrom(yankPos);
+	return true;
 }
 
-void SerialCommandEditorBase::historyRemoveFirst() {
-	char *cp = strchr(historyBuffer, '\n');
-	if (cp) {
-		cp++;
-		memmove(historyBuffer, cp,  strlen(cp) + 1);
+size_t SerialCommandEditorBase::findWordStart(size_t pos) {
+	if (pos > bufferOffset) {
+		pos = bufferOffset;
+	}
+	// Skip separators to the left of pos, then the word itself
+	while(pos > 0 && !isalnum((unsigned char)buffer[pos - 1])) {
+		pos--;
+	}
+	while(pos > 0 && isalnum((unsigned char)buffer[pos - 1])) {
+		pos--;
 	}
+	return pos;
 }
 
-void SerialCommandEditorBase::historyRemoveLast() {
-	// First remove the trailing \n
-	size_t len = strlen(historyBuffer);
-	if (len > 0 && historyBuffer[len - 1] == '\n') {
-		historyBuffer[len - 1] = 0;
+size_t SerialCommandEditorBase::findWordEnd(size_t pos) {
+	// Skip separators at pos, then the word itself
+	while(pos < bufferOffset && !isalnum((unsigned char)buffer[pos])) {
+		pos++;
 	}
-	// Now find the \n before that
-	char *cp = strrchr(historyBuffer, '\n');
-	if (cp) {
-		// And remove everything after it
-		cp[1] = 0;
+	while(pos < bufferOffset && isalnum((unsigned char)buffer[pos])) {
+		pos++;
 	}
-	else {
-		historyBuffer[0] = 0;
+	return pos;
+}
+
+size_t SerialCommandEditorBase::write(uint8_t c) {
+	if (frameDepth == 0) {
+		return SerialCommandParserBase::write(c);
 	}
+	if (frameOffset >= sizeof(frameBuffer)) {
+		flushFrame();
+	}
+	frameBuffer[frameOffset++] = c;
+	return 1;
 }
 
-#ifndef UNITTEST
+size_t SerialCommandEditorBase::write(const uint8_t *buf, size_t size) {
+	if (frameDepth == 0) {
+		return SerialCommandParserBase::write(buf, size);
+	}
+	if (frameOffset + size > sizeof(frameBuffer)) {
+		flushFrame();
+		if (size > sizeof(frameBuffer)) {
+			// Too large to buffer, write it directly
+			return SerialCommandParserBase::write(buf, size);
+		}
+	}
+	memcpy(&frameBuffer[frameOffset], buf, size);
+	frameOffset += size;
+	return size;
+}
 
-SerialCommandTCPClient::SerialCommandTCPClient(SerialCommandTCPServer *server) : server(server) {
+void SerialCommandEditorBase::endFrame() {
+	if (frameDepth > 0 && --frameDepth == 0) {
+		flushFrame();
+	}
 }
 
-SerialCommandTCPClient::~SerialCommandTCPClient() {
-	client.stop();
+void SerialCommandEditorBase::flushFrame() {
+	if (frameOffset > 0) {
+		SerialCommandParserBase::write(frameBuffer, frameOffset);
+		frameOffset = 0;
+	}
+}
 
-	if (editor) {
-		delete editor;
+void SerialCommandEditorBase::searchStart() {
+	if (terminalType != TerminalType::ANSI) {
+		return;
 	}
-	delete[] historyBuffer;
-	delete[] buffer;
-	delete[] argsBuffer;
+	searching = true;
+	searchFailed = false;
+	searchLen = 0;
+	searchSeq = 0;
+	searchNewestSeq = 0;
+
+	setCursorPosition(editRow, 1);
+	if (wrapMode) {
+		// The search is shown on one row, so clear the other rows of the line
+		eraseToEndOfScreen();
+	}
+	searchRender();
+}
+
+bool SerialCommandEditorBase::searchKey(char key, SerialCommandKeymap::Action action) {
+	switch(action) {
+	case SerialCommandKeymap::Action::REVERSE_SEARCH_HISTORY:
+		// Next older match for the same search string
+		if (searchLen > 0) {
+			searchFind(searchOlderIndex());
+		}
+		return true;
+
+	case SerialCommandKeymap::Action::BACKWARD_DELETE_CHAR:
+		if (searchLen > 0) {
+			// A shorter string can match lines that were already skipped, so start again from the newest line
+			searchLen--;
+			searchSeq = 0;
+			searchFailed = false;
+			if (searchLen > 0) {
+				searchFind(0);
+			}
+			else {
+				searchRender();
+			}
+		}
+		return true;
 
+	default:
+		break;
+	}
+
+	if (key == KEY_CTRL_G || key == KEY_ESC) {
+		searchEnd(false);
+		return true;
+	}
+
+	searchEnd(true);
+	return false;
 }
 
-void SerialCommandTCPClient::setup() {
-	historyBuffer = new char[server->historyBufSize];
-	buffer = new char[server->bufferSize];
-	argsBuffer = new char*[server->maxArgs];
+void SerialCommandEditorBase::searchAddChar(char c) {
+	if (searchLen >= SEARCH_STRING_SIZE) {
+		print(KEY_CTRL_G); // bell
+		return;
+	}
+	searchString[searchLen++] = c;
+
+	// Lines newer than the match didn't contain the shorter string, so they can't contain the longer one
+	// and the search continues from the match. If lines were added, as can happen with shared history,
+	// the newer lines have not been checked and it starts again from the newest line.
+	size_t fromIndex = 0;
+	if (searchSeq != 0 && history->size() > 0 && history->getSeq(0) == searchNewestSeq) {
+		int index = searchMatchIndex();
+		fromIndex = (index >= 0) ? (size_t)index : searchOlderIndex();
+	}
+	searchFind(fromIndex);
+}
 
-	editor = new SerialCommandEditorBase(historyBuffer, server->historyBufSize, buffer, server->bufferSize, argsBuffer, server->maxArgs);
-	if (editor) {
-		editor->withConfig(server);
-		editor->setup();
+int SerialCommandEditorBase::searchMatchIndex() const {
+	// The line could have been removed from shared history since it was found
+	int index = (searchSeq != 0) ? history->findOlder(searchSeq + 1) : -1;
+	return (index >= 0 && history->getSeq(index) == searchSeq) ? index : -1;
+}
+
+size_t SerialCommandEditorBase::searchOlderIndex() const {
+	if (searchSeq == 0) {
+		return 0;
 	}
+	int index = history->findOlder(searchSeq);
+	return (index >= 0) ? (size_t)index : history->size();
 }
 
-void SerialCommandTCPClient::loop() {
-	if (client.connected()) {
-		editor->loop();
+void SerialCommandEditorBase::searchFind(size_t fromIndex) {
+	if (fromIndex == 0) {
+		// Every line newer than the match is checked
+		searchNewestSeq = (history->size() > 0) ? history->getSeq(0) : 0;
+	}
+
+	int index = history->find(searchString, searchLen, fromIndex);
+	if (index >= 0) {
+		searchSeq = history->getSeq(index);
+		searchFailed = false;
 	}
 	else {
-		// Not connected
-		if (wasConnected) {
-			// Was previously connected, mark as not connected
-			editor->handleConnected(false);
-			wasConnected = false;
-		}
+		// Keep showing the previous match
+		searchFailed = true;
+		print(KEY_CTRL_G); // bell
 	}
+	searchRender();
 }
 
-void SerialCommandTCPClient::setClient(TCPClient client) {
-	this->client = client;
-	editor->withStream(&this->client);
-	editor->handleConnected(true);
+void SerialCommandEditorBase::searchEnd(bool accept) {
+	searching = false;
 
-	wasConnected = true;
-};
+	int index = searchMatchIndex();
+	if (accept && index >= 0) {
+		SerialCommandHistory::Entry entry = history->get(index);
+		reserveBuffer(entry.length() + 1);
+		bufferOffset = entry.copyTo(buffer, bufferSize);
+		undoClear();
 
+		// Leave the cursor at the start of the match
+		int matchPos = entry.indexOf(searchString, searchLen);
+		cursorPos = (matchPos > (int)bufferOffset || matchPos < 0) ? (int)bufferOffset : matchPos;
+	}
 
-SerialCommandTCPServer::SerialCommandTCPServer(size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t maxSessions, bool preallocate, uint16_t port) :
-		historyBufSize(historyBufSize), bufferSize(bufferSize), maxArgs(maxArgs), maxSessions(maxSessions), preallocate(preallocate),
-		server(port) {
+	// The prompt is the same length as before, so editCol does not change
+	setCursorPosition(editRow, 1);
+	SerialCommandParserBase::handlePrompt();
+	horizScroll = 0;
+	wrapRowsDrawn = 1;
+	markDirty(0);
+	scrollToView(ScrollView::VISIBLE, true);
+}
+
+void SerialCommandEditorBase::searchRender() {
+	const char *label = searchFailed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+
+	setCursorPosition(editRow, 1);
+	print(label);
+	write((const uint8_t *)searchString, searchLen);
+	print("': ");
+
+	// Until something matches, show the line being edited
+	SerialCommandHistory::Entry entry(buffer, bufferOffset);
+	int matchPos = 0;
+	int index = searchMatchIndex();
+	if (index >= 0) {
+		entry = history->get(index);
+		matchPos = entry.indexOf(searchString, searchLen);
+	}
+
+	// Stop before the last column so the terminal does not wrap
+	int col = 1 + (int)strlen(label) + (int)searchLen + 3;
+	int avail = screenCols - col;
+	for(int ii = 0; ii < (int)entry.length() && ii < avail; ii++) {
+		print(entry.charAt(ii));
+	}
+	eraseToEndOfLine();
 
+	if (matchPos < 0) {
+		matchPos = 0;
+	}
+	if (matchPos > avail) {
+		matchPos = (avail > 0) ? avail : 0;
+	}
+	setCursorPosition(editRow, col + matchPos);
 }
 
-SerialCommandTCPServer::~SerialCommandTCPServer() {
+void SerialCommandEditorBase::historyAdd(const char *line, bool temporary) {
+	if (temporary) {
+		// The line being edited is kept by this editor, not in history, which may be shared
+		savedLine = line;
+		return;
+	}
 
-	if (clients) {
-		for(size_t ii = 0; ii < maxSessions; ii++) {
-			delete clients[ii];
-		}
-		delete[] clients;
+	size_t len = strlen(line);
+	if (history == &ownHistory) {
+		growHistory(len);
+	}
+	if (history->add(line, len) && historyStore) {
+		historyStore->append(line, len);
 	}
 }
 
-void SerialCommandTCPServer::setup() {
-	clients = new SerialCommandTCPClient*[maxSessions];
+String SerialCommandEditorBase::historyGet(int index) {
+	SerialCommandHistory::Entry entry = history->get(index);
 
-	if (preallocate) {
-		for(size_t ii = 0; ii < maxSessions; ii++) {
-			clients[ii] = new SerialCommandTCPClient(this);
+	String result;
+	result.reserve(entry.length());
+	for(size_t ii = 0; ii < entry.length(); ii++) {
+		result.concat(entry.charAt(ii));
+	}
+	return result;
+}
 
-			clients[ii]->setup();
+int SerialCommandEditorBase::historySize() {
+	return (int)history->size();
+}
 
-			if (!clients[ii]->isAllocated()) {
-				DEBUG_NORMAL(("failed to allocate client %u, not enough RAM", ii));
-				delete clients[ii];
-				clients[ii] = 0;
-			}
-		}
+void SerialCommandEditorBase::historyClear() {
+	history->clear();
+	historyCursor = 0;
+	savedLine = "";
+	if (historyStore) {
+		historyStore->clear();
 	}
-	else {
-		for(size_t ii = 0; ii < maxSessions; ii++) {
-			clients[ii] = 0;
-		}
+}
+
+SerialCommandEditorBase &SerialCommandEditorBase::withHistoryStore(SerialCommandHistoryStore *store) {
+	if (historyStore && historyStore != store) {
+		historyStore->detach(&ownHistory);
+	}
+	historyStore = store;
+	if (historyStore) {
+		historyStore->load(*history);
 	}
+	return *this;
 }
-void SerialCommandTCPServer::loop() {
-	if (!clients) {
+
+uint16_t SerialCommandEditorBase::historyScore(size_t index) const {
+	if (!usageTable || index >= history->size()) {
+		return 0;
+	}
+	SerialCommandHistory::Entry entry = history->get(index);
+	uint32_t hash = SerialCommandUsageTable::HASH_INIT;
+	for(size_t ii = 0; ii < entry.length(); ii++) {
+		hash = SerialCommandUsageTable::hashAdd(hash, entry.charAt(ii));
+	}
+	return usageTable->getScoreHash(hash);
+}
+
+void SerialCommandEditorBase::historyMostUsed(bool lessUsed) {
+	// The current position is the score and sequence number of the line being shown, so there's no
+	// ranked list to keep up to date as lines are added
+	uint32_t curScore = 0x10000;
+	uint32_t curSeq = 0;
+	if (historyCursor != 0) {
+		int index = history->findOlder(historyCursor + 1);
+		if (index >= 0 && history->getSeq(index) == historyCursor) {
+			curScore = historyScore(index);
+			curSeq = historyCursor;
+		}
+	}
+	else
+	if (!lessUsed) {
+		// Not browsing history, and there's nothing more used than the first line
 		return;
 	}
 
-	bool connected = isNetworkConnected();
-	if (networkWasConnected != connected) {
-		DEBUG_NORMAL(("networkConnected=%d", connected));
-		if (connected) {
-			// Network connected, initialize listener
-#if Wiring_WiFi
-			DEBUG_NORMAL(("IP address %s", WiFi.localIP().toString().c_str()));
-#endif
-			server.begin();
+	int best = -1;
+	uint32_t bestScore = 0;
+	for(size_t ii = 0; ii < history->size(); ii++) {
+		uint32_t score = historyScore(ii);
+		uint32_t seq = history->getSeq(ii);
+		bool isNext, isBetter;
+		if (lessUsed) {
+			isNext = (score < curScore) || (score == curScore && seq < curSeq);
+			isBetter = (best < 0) || (score > bestScore);
 		}
 		else {
-			// Network disconnected, release all clients
-			if (!preallocate) {
-				for(size_t ii = 0; ii < maxSessions; ii++) {
-					delete clients[ii];
-					clients[ii] = 0;
-				}
-			}
+			isNext = (score > curScore) || (score == curScore && seq > curSeq);
+			isBetter = (best < 0) || (score < bestScore) || (score == bestScore);
+		}
+		// Lines are checked newest to oldest, so of the lines with the same score, Page Up goes to the
+		// newest first and Page Down to the oldest first
+		if (isNext && isBetter) {
+			best = (int)ii;
+			bestScore = score;
 		}
-		networkWasConnected = connected;
 	}
 
-	for(size_t ii = 0; ii < maxSessions; ii++) {
-		if (clients[ii]) {
-			clients[ii]->loop();
-			if (!preallocate) {
-				if (!clients[ii]->isConnected()) {
-					// Disconnected, free entry
-					delete clients[ii];
-					clients[ii] = 0;
-					DEBUG_HIGH(("freed session=%u", ii));
-				}
-			}
+	if (best >= 0) {
+		if (historyCursor == 0) {
+			// Save the line being edited so going back restores it
+			savedLine = getBuffer();
 		}
+		historyCursor = history->getSeq(best);
+		setBuffer(history->get(best));
+		scrollToView(ScrollView::END, false);
+	}
+	else
+	if (!lessUsed && historyCursor != 0) {
+		// Past the most used line goes back to the line that was being edited
+		historyCursor = 0;
+		setBuffer(savedLine.c_str(), true);
+		savedLine = "";
 	}
+}
 
-	// Check for connections
-	TCPClient client = server.available();
-	if (client.connected()) {
-		// Find a free entry
-		bool foundFree = false;
-		for(size_t ii = 0; ii < maxSessions; ii++) {
-			if (preallocate) {
-				if (clients[ii] && !clients[ii]->isConnected()) {
-					clients[ii]->setClient(client);
-					foundFree = true;
-					DEBUG_HIGH(("connection started session=%u", ii));
-					break;
-				}
-			}
-			else {
-				if (clients[ii] == 0) {
-					clients[ii] = new SerialCommandTCPClient(this);
-					clients[ii]->setup();
-					if (clients[ii]->isAllocated()) {
-						clients[ii]->setClient(client);
-						foundFree = true;
-						DEBUG_HIGH(("connection started session=%u", ii));
-					}
-					else {
-						clients[ii]->stop();
-						delete clients[ii];
-						clients[ii] = 0;
-						DEBUG_NORMAL(("failed to allocate client"));
-					}
-					break;
+void SerialCommandEditorBase::usageRecord(char *line) {
+	if (!usageTable) {
+		return;
+	}
+	usageTable->record(line, strlen(line));
+
+	// Also count the command name so it ranks higher when completing commands
+	while(*line == ' ' || *line == '\t') {
+		line++;
+	}
+	char *dst = NULL;
+	const char *end = scanToken(line, dst);
+	if (*end) {
+		usageTable->record(line, end - line);
+	}
+}
+
+SerialCommandEditorBase &SerialCommandEditorBase::withHistory(SerialCommandHistory *history, SerialCommandHistoryStore *store) {
+	if (historyStore && historyStore != store) {
+		historyStore->detach(&ownHistory);
+	}
+	this->history = history ? history : &ownHistory;
+	historyStore = store;
+	historyCursor = 0;
+	return *this;
+}
+
+void SerialCommandEditorBase::historyRemoveFirst() {
+	history->removeNewest();
+}
+
+void SerialCommandEditorBase::historyRemoveLast() {
+	history->removeOldest();
+}
+
+void SerialCommandHistory::Entry::addSegment(const char *data, size_t len) {
+	if (len > 0 && numSegments < MAX_SEGMENTS) {
+		segments[numSegments].data = data;
+		segments[numSegments].len = len;
+		numSegments++;
+		this->len += len;
+	}
+}
+
+char SerialCommandHistory::Entry::charAt(size_t index) const {
+	for(size_t ii = 0; ii < numSegments; ii++) {
+		if (index < segments[ii].len) {
+			return segments[ii].data[index];
+		}
+		index -= segments[ii].len;
+	}
+	return 0;
+}
+
+size_t SerialCommandHistory::Entry::copyTo(char *buf, size_t bufSize) const {
+	size_t count = 0;
+	for(size_t ii = 0; ii < numSegments; ii++) {
+		size_t n = segments[ii].len;
+		if (n > bufSize - 1 - count) {
+			n = bufSize - 1 - count;
+		}
+		memcpy(&buf[count], segments[ii].data, n);
+		count += n;
+	}
+	buf[count] = 0;
+	return count;
+}
+
+bool SerialCommandHistory::Entry::matchAt(size_t pos, const char *str, size_t len) const {
+	for(size_t ii = 0; ii < len; ii++) {
+		if (charAt(pos + ii) != str[ii]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SerialCommandHistory::Entry::startsWith(const char *str, size_t len) const {
+	return len <= this->len && matchAt(0, str, len);
+}
+
+int SerialCommandHistory::Entry::indexOf(const char *str, size_t len) const {
+	for(size_t ii = 0; ii + len <= this->len; ii++) {
+		if (matchAt(ii, str, len)) {
+			return (int)ii;
+		}
+	}
+	return -1;
+}
+
+bool SerialCommandHistory::add(const char *line, size_t len) {
+	if (len == 0 || len > ring.getDataSize()) {
+		return false;
+	}
+	if (ring.size() > 0 && get(0).equals(line, len)) {
+		// Same as the newest line
+		return false;
+	}
+
+	uint32_t mask = charMask(line, len);
+	if (moveToFront) {
+		for(size_t ii = 1; ii < ring.size(); ii++) {
+			if (getIndexEntry(ii)->mask == mask && get(ii).equals(line, len)) {
+				remove(ii);
+				break;
+			}
+		}
+	}
+
+	size_t prefix;
+	for(;;) {
+		// Share the start of the newest line if the rest of this line can be stored right after it
+		prefix = 0;
+		if (ring.size() > 0 && ring.get(0)->flags < MAX_PREFIX_DEPTH) {
+			Entry newest = get(0);
+			while(prefix < newest.length() && (prefix + 1) < len && newest.charAt(prefix) == line[prefix]) {
+				prefix++;
+			}
+			if (prefix < MIN_PREFIX_LENGTH) {
+				prefix = 0;
+			}
+		}
+		if (prefix > 0) {
+			int offset = ring.findSpace(len - prefix);
+			if (offset >= 0 && (size_t)offset == ring.getHeadOffset()) {
+				break;
+			}
+		}
+		if (ring.findSpace(len) >= 0) {
+			prefix = 0;
+			break;
+		}
+		removeOldest();
+	}
+
+	uint8_t depth = (prefix > 0) ? (ring.get(0)->flags + 1) : 0;
+
+	// There is space, so this never discards lines
+	ring.add(&line[prefix], len - prefix);
+
+	IndexEntry *entry = getIndexEntry(0);
+	entry->record.aux = (uint16_t) prefix;
+	entry->record.flags = depth;
+	entry->mask = mask;
+	entry->seq = nextSeq++;
+	return true;
+}
+
+SerialCommandHistory::Entry SerialCommandHistory::get(size_t index) const {
+	Entry entry;
+	const RecordRing::Record *rec = ring.get(index);
+	if (rec) {
+		decode(entry, index, rec->aux + rec->length);
+	}
+	return entry;
+}
+
+void SerialCommandHistory::decode(Entry &entry, size_t index, size_t n) const {
+	const RecordRing::Record *rec = ring.get(index);
+	if (!rec || n == 0) {
+		return;
+	}
+	size_t prefix = rec->aux;
+	if (n <= prefix) {
+		// Only need characters that are shared with the older line
+		decode(entry, index + 1, n);
+		return;
+	}
+	decode(entry, index + 1, prefix);
+	entry.addSegment(ring.getData(rec), n - prefix);
+}
+
+void SerialCommandHistory::removeOldest() {
+	size_t count = ring.size();
+	if (count >= 2) {
+		RecordRing::Record *next = ring.get(count - 2);
+		if (next->aux > 0) {
+			// The oldest line is always stored in full, so its first bytes are the shared prefix
+			expandPrefix(next, ring.getData(ring.get(count - 1)));
+		}
+	}
+	ring.removeOldest();
+}
+
+void SerialCommandHistory::remove(size_t index) {
+	size_t count = ring.size();
+	if (index >= count) {
+		return;
+	}
+	if (index == count - 1) {
+		removeOldest();
+		return;
+	}
+
+	if (index > 0) {
+		RecordRing::Record *newer = ring.get(index - 1);
+		RecordRing::Record *rec = ring.get(index);
+		if (newer->aux > rec->aux) {
+			// Part of the newer line's prefix is stored in rec, so move it to just before the newer line
+			size_t len = newer->aux - rec->aux;
+			memmove(ring.getData(newer) - len, ring.getData(rec), len);
+			newer->offset -= len;
+			newer->length += len;
+			newer->aux = rec->aux;
+		}
+		// The newer line now shares its prefix with the line before rec
+		newer->flags = (newer->aux > 0) ? (ring.get(index + 1)->flags + 1) : 0;
+
+		// If the newer lines are all after rec in the buffer, move them down so the space can be reused
+		RecordRing::Record *newest = ring.get(0);
+		if (newer->offset > rec->offset && newest->offset >= newer->offset) {
+			size_t gap = newer->offset - rec->offset;
+			memmove(ring.getData(rec), ring.getData(newer), newest->offset + newest->length - newer->offset);
+			for(size_t ii = 0; ii < index; ii++) {
+				ring.get(ii)->offset -= gap;
+			}
+		}
+	}
+
+	ring.remove(index);
+}
+
+int SerialCommandHistory::findOlder(uint32_t seq) const {
+	// Sequence numbers decrease as the index increases, so find the first index with a smaller one
+	size_t low = 0, high = ring.size();
+	while(low < high) {
+		size_t mid = (low + high) / 2;
+		if (getSeq(mid) < seq) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+	return (low < ring.size()) ? (int)low : -1;
+}
+
+int SerialCommandHistory::findNewer(uint32_t seq) const {
+	// The line just before the first one that is not newer
+	size_t low = 0, high = ring.size();
+	while(low < high) {
+		size_t mid = (low + high) / 2;
+		if (getSeq(mid) <= seq) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+	return (int)low - 1;
+}
+
+void SerialCommandHistory::expandPrefix(RecordRing::Record *rec, const char *prefixFrom) {
+	memmove(ring.getData(rec) - rec->aux, prefixFrom, rec->aux);
+	rec->offset -= rec->aux;
+	rec->length += rec->aux;
+	rec->aux = 0;
+	rec->flags = 0;
+}
+
+int SerialCommandHistory::find(const char *str, size_t len, size_t fromIndex) const {
+	uint32_t mask = charMask(str, len);
+
+	for(size_t ii = fromIndex; ii < ring.size(); ii++) {
+		// The mask check is cheap and rejects most lines that can't contain str
+		if ((getIndexEntry(ii)->mask & mask) == mask && get(ii).indexOf(str, len) >= 0) {
+			return (int)ii;
+		}
+	}
+	return -1;
+}
+
+// [static]
+uint32_t SerialCommandHistory::charMask(const char *str, size_t len) {
+	uint32_t mask = 0;
+	for(size_t ii = 0; ii < len; ii++) {
+		char c = str[ii];
+		int bit;
+		if (c >= 'a' && c <= 'z') {
+			bit = c - 'a';
+		}
+		else
+		if (c >= 'A' && c <= 'Z') {
+			bit = c - 'A';
+		}
+		else
+		if (c >= '0' && c <= '9') {
+			bit = 26 + (c - '0') % 4;
+		}
+		else
+		if (c == ' ') {
+			bit = 30;
+		}
+		else {
+			bit = 31;
+		}
+		mask |= (uint32_t)1 << bit;
+	}
+	return mask;
+}
+
+void SerialCommandUsageTable::recordHash(uint32_t hash) {
+	Entry *found = NULL;
+	Entry *leastUsed = &entries[0];
+	for(size_t ii = 0; ii < MAX_ENTRIES; ii++) {
+		if (entries[ii].count > 0 && entries[ii].hash == hash) {
+			found = &entries[ii];
+			break;
+		}
+		if (entries[ii].count < leastUsed->count) {
+			leastUsed = &entries[ii];
+		}
+	}
+	if (!found) {
+		// Replace an unused entry, or the least used one if the table is full
+		found = leastUsed;
+		found->hash = hash;
+		found->count = 0;
+	}
+	if (found->count < 0xffff) {
+		found->count++;
+	}
+
+	if (--usesUntilDecay == 0) {
+		decay();
+	}
+}
+
+uint16_t SerialCommandUsageTable::getScoreHash(uint32_t hash) const {
+	for(size_t ii = 0; ii < MAX_ENTRIES; ii++) {
+		if (entries[ii].count > 0 && entries[ii].hash == hash) {
+			return entries[ii].count;
+		}
+	}
+	return 0;
+}
+
+void SerialCommandUsageTable::decay() {
+	for(size_t ii = 0; ii < MAX_ENTRIES; ii++) {
+		entries[ii].count /= 2;
+	}
+	usesUntilDecay = DECAY_INTERVAL;
+}
+
+void SerialCommandUsageTable::clear() {
+	for(size_t ii = 0; ii < MAX_ENTRIES; ii++) {
+		entries[ii].count = 0;
+	}
+	usesUntilDecay = DECAY_INTERVAL;
+}
+
+// [static]
+uint32_t SerialCommandUsageTable::hash(const char *str, size_t len) {
+	uint32_t hash = HASH_INIT;
+	for(size_t ii = 0; ii < len; ii++) {
+		hash = hashAdd(hash, str[ii]);
+	}
+	return hash;
+}
+
+#if SERIAL_COMMAND_HAS_FILESYSTEM
+
+SerialCommandHistoryFileStore::SerialCommandHistoryFileStore(const char *path) : path(path) {
+}
+
+SerialCommandHistoryFileStore::~SerialCommandHistoryFileStore() {
+	// history may already be gone, so only append
+	writeBuffer();
+}
+
+void SerialCommandHistoryFileStore::load(SerialCommandHistory &history) {
+	this->history = &history;
+	fileSize = 0;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		// No saved history yet
+		return;
+	}
+
+	char *line = (char *)malloc(history.getBufferSize());
+	if (line) {
+		uint8_t header[RECORD_HEADER_SIZE];
+		while(true) {
+			int count = read(fd, header, sizeof(header));
+			if (count == 0) {
+				break;
+			}
+			size_t len = header[0] | (header[1] << 8);
+			uint16_t crc = header[2] | (header[3] << 8);
+			if (count != (int)sizeof(header) || len == 0 || len > history.getBufferSize() ||
+				read(fd, line, len) != (int)len || crc16((const uint8_t *)line, len) != crc) {
+				// Partially written or corrupted, so keep the lines before it and rewrite the file
+				DEBUG_NORMAL(("history file %s bad record at %u", path.c_str(), fileSize));
+				needCompact = true;
+				break;
+			}
+			history.add(line, len);
+			fileSize += RECORD_HEADER_SIZE + len;
+		}
+		free(line);
+	}
+	close(fd);
+
+	if (needCompact) {
+		compact();
+	}
+}
+
+void SerialCommandHistoryFileStore::detach(SerialCommandHistory *history) {
+	if (history && this->history == history) {
+		flush();
+		this->history = NULL;
+	}
+}
+
+void SerialCommandHistoryFileStore::append(const char *line, size_t len) {
+	if (len == 0 || len > 0xffff) {
+		return;
+	}
+	uint16_t crc = crc16((const uint8_t *)line, len);
+	uint8_t header[RECORD_HEADER_SIZE] = { (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)crc, (uint8_t)(crc >> 8) };
+	bufferBytes(header, sizeof(header));
+	bufferBytes((const uint8_t *)line, len);
+
+	if (flushDeadline == 0) {
+		flushDeadline = SerialCommandParserBase::deadlineAfter(millis(), flushDelayMs);
+	}
+}
+
+void SerialCommandHistoryFileStore::clear() {
+	writeOffset = 0;
+	flushDeadline = 0;
+	needCompact = false;
+	fileSize = 0;
+	unlink(path.c_str());
+}
+
+void SerialCommandHistoryFileStore::flush() {
+	flushDeadline = 0;
+
+	// Only compact when the file is at least twice its size after the last compaction, so rewrites are infrequent
+	size_t limit = maxFileSize;
+	if (limit < 2 * compactedSize) {
+		limit = 2 * compactedSize;
+	}
+	if (needCompact || (fileSize + writeOffset) > limit) {
+		compact();
+	}
+	else {
+		writeBuffer();
+	}
+}
+
+void SerialCommandHistoryFileStore::loop() {
+	if (flushDeadline != 0 && (long)(millis() - flushDeadline) >= 0) {
+		flush();
+	}
+}
+
+void SerialCommandHistoryFileStore::bufferBytes(const uint8_t *data, size_t len) {
+	while(len > 0) {
+		if (writeOffset == sizeof(writeBuf)) {
+			writeBuffer();
+		}
+		size_t count = sizeof(writeBuf) - writeOffset;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(&writeBuf[writeOffset], data, count);
+		writeOffset += count;
+		data += count;
+		len -= count;
+	}
+}
+
+bool SerialCommandHistoryFileStore::writeBuffer() {
+	if (writeOffset == 0) {
+		return true;
+	}
+	bool written;
+	if (writeFd >= 0) {
+		// Compacting
+		written = (write(writeFd, writeBuf, writeOffset) == (int)writeOffset);
+	}
+	else {
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		written = (fd >= 0 && write(fd, writeBuf, writeOffset) == (int)writeOffset);
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	if (written) {
+		fileSize += writeOffset;
+	}
+	else {
+		// The file may end with part of a record, so rewrite it from history
+		DEBUG_NORMAL(("history file %s write failed errno=%d", path.c_str(), errno));
+		needCompact = true;
+	}
+	writeOffset = 0;
+	return written;
+}
+
+void SerialCommandHistoryFileStore::compact() {
+	if (!history) {
+		writeBuffer();
+		return;
+	}
+	needCompact = false;
+
+	// Lines waiting to be written are already in history, so they're written below
+	writeOffset = 0;
+
+	String tempPath = path + ".tmp";
+	writeFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (writeFd < 0) {
+		DEBUG_NORMAL(("history file %s open failed errno=%d", tempPath.c_str(), errno));
+		needCompact = true;
+		return;
+	}
+	size_t oldFileSize = fileSize;
+	fileSize = 0;
+
+	for(size_t ii = history->size(); ii-- > 0; ) {
+		SerialCommandHistory::Entry entry = history->get(ii);
+		size_t len = entry.length();
+
+		uint16_t crc = 0xffff;
+		for(size_t jj = 0; jj < len; jj++) {
+			uint8_t c = (uint8_t) entry.charAt(jj);
+			crc = crc16(&c, 1, crc);
+		}
+		uint8_t header[RECORD_HEADER_SIZE] = { (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)crc, (uint8_t)(crc >> 8) };
+		bufferBytes(header, sizeof(header));
+		for(size_t jj = 0; jj < len; jj++) {
+			uint8_t c = (uint8_t) entry.charAt(jj);
+			bufferBytes(&c, 1);
+		}
+	}
+	writeBuffer();
+	close(writeFd);
+	writeFd = -1;
+
+	if (needCompact || rename(tempPath.c_str(), path.c_str()) != 0) {
+		// Keep the old file and try again on the next flush
+		unlink(tempPath.c_str());
+		fileSize = oldFileSize;
+		needCompact = true;
+		return;
+	}
+	compactedSize = fileSize;
+	DEBUG_HIGH(("compacted history file %s to %u bytes", path.c_str(), fileSize));
+}
+
+// [static]
+uint16_t SerialCommandHistoryFileStore::crc16(const uint8_t *data, size_t len, uint16_t crc) {
+	for(size_t ii = 0; ii < len; ii++) {
+		crc ^= (uint16_t)data[ii] << 8;
+		for(int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+#endif /* SERIAL_COMMAND_HAS_FILESYSTEM */
+
+#if SERIAL_COMMAND_HAS_TCP_SERVER
+
+// Round up so each part of a session slot is aligned for any type
+static size_t slabAlign(size_t size) {
+	const size_t align = alignof(std::max_align_t);
+	return (size + align - 1) & ~(align - 1);
+}
+
+// Size of a history buffer followed by its index
+static size_t historyStorageSize(size_t bufSize) {
+	return bufSize ? slabAlign(bufSize) + SerialCommandHistory::indexSize(bufSize) * sizeof(SerialCommandHistory::IndexEntry) : 0;
+}
+
+#if SERIAL_COMMAND_TCP_EPOLL
+// Non-blocking socket listening on all interfaces, or -1 on error
+static int openListener(uint16_t port, bool reusePort, int backlog) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		DEBUG_NORMAL(("socket failed errno=%d", errno));
+		return -1;
+	}
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (reusePort) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, backlog) < 0) {
+		DEBUG_NORMAL(("failed to listen on port %u errno=%d", port, errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Port a socket is bound to, or 0 if it isn't
+static uint16_t listenerPort(int fd) {
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	if (fd < 0 || getsockname(fd, (struct sockaddr *)&addr, &addrLen) < 0) {
+		return 0;
+	}
+	return ntohs(addr.sin_port);
+}
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
+SerialCommandTCPEditor::SerialCommandTCPEditor(SerialCommandTCPServer *server, bool growHistory, char *historyBuffer, size_t historyBufferSize, SerialCommandHistory::IndexEntry *historyIndex, size_t historyIndexSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize) :
+		SerialCommandEditorBase(historyBuffer, historyBufferSize, historyIndex, historyIndexSize, buffer, bufferSize, argsBuffer, argsBufferSize),
+		server(server), initialBuffer(buffer), initialBufferSize(bufferSize), growableHistory(growHistory) {
+
+	// With growable history, the history has no storage until growHistory() allocates it for the first line
+}
+
+SerialCommandTCPEditor::~SerialCommandTCPEditor() {
+	releaseBuffers();
+}
+
+void SerialCommandTCPEditor::releaseBuffers() {
+	if (buffer != initialBuffer) {
+		server->releaseGrowable(buffer, bufferSize);
+		buffer = initialBuffer;
+		bufferSize = initialBufferSize;
+		bufferOffset = 0;
+	}
+	if (historyStorage) {
+		server->releaseGrowable(historyStorage, historyStorageSize(ownHistory.getBufferSize()));
+		ownHistory.setStorage(NULL, 0, NULL, 0);
+		historyStorage = 0;
+	}
+}
+
+void SerialCommandTCPEditor::growBuffer(size_t size) {
+	size_t newSize = bufferSize;
+	while(newSize < size && newSize < server->bufferSize) {
+		newSize *= 2;
+	}
+	if (newSize > server->bufferSize) {
+		newSize = server->bufferSize;
+	}
+	if (newSize <= bufferSize) {
+		return;
+	}
+
+	char *newBuffer = server->allocateGrowable(newSize);
+	if (!newBuffer) {
+		return;
+	}
+	memcpy(newBuffer, buffer, bufferOffset);
+	if (buffer != initialBuffer) {
+		server->releaseGrowable(buffer, bufferSize);
+	}
+	buffer = newBuffer;
+	bufferSize = newSize;
+}
+
+void SerialCommandTCPEditor::growHistory(size_t len) {
+	// When the index is full there's no space either, and it grows with the buffer
+	if (!growableHistory || history != &ownHistory || history->hasSpace(len)) {
+		return;
+	}
+
+	size_t oldSize = history->getBufferSize();
+	size_t newSize = oldSize ? oldSize * 2 : SerialCommandTCPServer::INITIAL_HISTORY_SIZE;
+	while(newSize < len) {
+		newSize *= 2;
+	}
+	if (newSize > server->historyBufSize) {
+		newSize = server->historyBufSize;
+	}
+	if (newSize <= oldSize) {
+		return;
+	}
+
+	// The buffer and its index are allocated together
+	char *newStorage = server->allocateGrowable(historyStorageSize(newSize));
+	if (!newStorage) {
+		return;
+	}
+	history->growStorage(newStorage, newSize, (SerialCommandHistory::IndexEntry *)(newStorage + slabAlign(newSize)), SerialCommandHistory::indexSize(newSize));
+	if (historyStorage) {
+		server->releaseGrowable(historyStorage, historyStorageSize(oldSize));
+	}
+	historyStorage = newStorage;
+}
+
+SerialCommandTCPClient::SerialCommandTCPClient(SerialCommandTCPServer *server, char *block) : server(server), block(block) {
+}
+
+SerialCommandTCPClient::~SerialCommandTCPClient() {
+	stop();
+
+	// The editor and its initial buffers are part of the server's session pool, so they're not freed here
+	if (editor) {
+		editor->~SerialCommandTCPEditor();
+	}
+	if (mirror) {
+		delete[] mirror->data;
+		delete mirror;
+	}
+}
+
+// Size of the line buffer in each session's pool slot
+static size_t sessionLineBufferSize(bool growable, size_t bufferSize) {
+	return growable ? std::min(bufferSize, (size_t)SerialCommandTCPServer::INITIAL_BUFFER_SIZE) : bufferSize;
+}
+
+void SerialCommandTCPClient::setup() {
+	// Slot layout after this object: editor, argsBuffer, buffer, historyBuffer, history index
+	bool growHistory = server->growable && !server->historyStore;
+	size_t historyBufSize = (server->sharedHistory || growHistory) ? 0 : server->historyBufSize;
+	size_t bufferSize = sessionLineBufferSize(server->growable, server->bufferSize);
+	char *next = block + slabAlign(sizeof(SerialCommandTCPEditor));
+
+	argsBuffer = (char **)next;
+	next += slabAlign(server->maxArgs * sizeof(char *));
+
+	buffer = next;
+	next += slabAlign(bufferSize);
+
+	SerialCommandHistory::IndexEntry *historyIndex = NULL;
+	if (historyBufSize) {
+		historyBuffer = next;
+		historyIndex = (SerialCommandHistory::IndexEntry *)(next + slabAlign(historyBufSize));
+	}
+
+	editor = new(block) SerialCommandTCPEditor(server, growHistory && !server->sharedHistory, historyBuffer, historyBufSize,
+			historyIndex, SerialCommandHistory::indexSize(historyBufSize), buffer, bufferSize, argsBuffer, server->maxArgs);
+	if (editor) {
+		editor->withConfig(server->commandConfig ? server->commandConfig : server);
+		if (server->keymap) {
+			editor->withKeymap(server->keymap);
+		}
+		editor->withUsageTable(server->usageTable);
+		if (server->sharedHistory) {
+			editor->withHistory(server->sharedHistory, server->historyStore);
+		}
+		else
+		if (server->historyStore) {
+			editor->withHistoryStore(server->historyStore);
+		}
+		editor->setup();
+	}
+}
+
+bool SerialCommandTCPClient::isAllocated() const {
+	return editor && buffer && argsBuffer;
+}
+
+void SerialCommandTCPClient::loop() {
+	if (isConnected() && muted) {
+		// Observers only watch; their input is discarded, even after they're detached
+		while(available() > 0) {
+			read();
+		}
+	}
+	else
+	if (isConnected()) {
+		if (inputPaused) {
+			// Backpressure: input waits until the output queue has been sent down to OUT_BUFFER_SIZE
+			return;
+		}
+		if (available() > 0) {
+			// The timeout timer checks this when it fires, so input doesn't need to reschedule it
+			lastInputMillis = millis();
+			timeoutWarned = false;
+		}
+		editor->loop();
+	}
+	else {
+		// Not connected
+		if (wasConnected) {
+			// Was previously connected, mark as not connected
+			editor->handleConnected(false);
+			editor->releaseBuffers();
+			wasConnected = false;
+		}
+	}
+}
+
+unsigned long SerialCommandTCPClient::nextDeadline() {
+	if (editor && isConnected() && !inputPaused) {
+		return editor->nextDeadline();
+	}
+	return 0;
+}
+
+bool SerialCommandTCPClient::hasPendingInput() {
+	if (isConnected()) {
+		return editor && !inputPaused && editor->hasPendingInput();
+	}
+	else {
+		// A disconnection still needs to be processed from loop()
+		return wasConnected;
+	}
+}
+
+#if SERIAL_COMMAND_TCP_EPOLL
+
+void SerialCommandTCPClient::setClient(int fd) {
+	this->fd = fd;
+	connectedMillis = lastInputMillis = millis();
+	timeoutWarned = false;
+	inOffset = inLen = 0;
+	waitingToWrite = false;
+	muted = false;
+	resetOutput();
+	startTelnet();
+
+	editor->withStream(this);
+	editor->handleConnected(true);
+
+	wasConnected = true;
+}
+
+void SerialCommandTCPClient::stop() {
+	inputPaused = false;
+	if (fd >= 0) {
+		// Anything the socket can take right away, like a goodbye message, is still sent
+		sendQueued(outLen);
+
+		epoll_ctl(server->epollFd, EPOLL_CTL_DEL, fd, NULL);
+		close(fd);
+		fd = -1;
+	}
+	inOffset = inLen = 0;
+	outStart = outLen = 0;
+	shrinkOutput();
+	waitingToWrite = false;
+}
+
+void SerialCommandTCPClient::handleEvents(uint32_t events) {
+	if (fd < 0) {
+		return;
+	}
+	if ((events & EPOLLOUT) && waitingToWrite) {
+		// Writable again; the server sends the queue on its next turn
+		waitingToWrite = false;
+		isStalled = false;
+		updateEvents();
+	}
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && inLen == 0) {
+		// Only read when the previous input has been processed. Since the socket is level-triggered,
+		// epoll reports it again on the next loop if there's more.
+		ssize_t count = recv(fd, inData, sizeof(inData), 0);
+		if (count > 0) {
+			inOffset = 0;
+			inLen = (size_t) count;
+			if (server->telnet) {
+				// Remove telnet commands in place
+				inLen = 0;
+				for(ssize_t ii = 0; ii < count; ii++) {
+					int c = telnet.process((uint8_t) inData[ii]);
+					if (c >= 0) {
+						inData[inLen++] = (char) c;
+					}
+					handleTelnet();
+				}
+			}
+		}
+		else
+		if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			DEBUG_HIGH(("connection closed session=%u", index));
+			stop();
+		}
+	}
+}
+
+int SerialCommandTCPClient::available() {
+	return (int)(inLen - inOffset);
+}
+
+int SerialCommandTCPClient::read() {
+	if (inOffset >= inLen) {
+		return -1;
+	}
+	int c = (uint8_t) inData[inOffset++];
+	if (inOffset >= inLen) {
+		inOffset = inLen = 0;
+	}
+	return c;
+}
+
+int SerialCommandTCPClient::peek() {
+	if (inOffset >= inLen) {
+		return -1;
+	}
+	return (uint8_t) inData[inOffset];
+}
+
+size_t SerialCommandTCPClient::sendRaw(const uint8_t *buf, size_t size) {
+	if (fd < 0 || size == 0) {
+		return 0;
+	}
+	ssize_t count = send(fd, buf, size, MSG_NOSIGNAL);
+	size_t sent = (count > 0) ? (size_t) count : 0;
+	if (sent < size && !isStalled) {
+		stalled();
+
+		// Have epoll report when the socket can take more
+		waitingToWrite = true;
+		updateEvents();
+	}
+	bytesSent += sent;
+	return sent;
+}
+
+void SerialCommandTCPClient::updateEvents() {
+	if (fd < 0) {
+		return;
+	}
+	// While input is paused the socket isn't read, so it isn't reported either, or the level-triggered
+	// event would wake the loop continuously
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	if (!inputPaused) {
+		event.events |= EPOLLIN;
+	}
+	if (waitingToWrite) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.u32 = (uint32_t)(index + 1);
+	epoll_ctl(server->epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+bool SerialCommandTCPClient::canSend() const {
+	// A stalled session waits for epoll to report the socket writable
+	return getQueueDepth() > 0 && !isStalled;
+}
+
+#else
+
+void SerialCommandTCPClient::setClient(TCPClient client) {
+	this->client = client;
+	connectedMillis = lastInputMillis = millis();
+	timeoutWarned = false;
+	muted = false;
+	resetOutput();
+	telnetLookahead = -1;
+	startTelnet();
+
+	editor->withStream(this);
+	editor->handleConnected(true);
+
+	wasConnected = true;
+}
+
+void SerialCommandTCPClient::stop() {
+	inputPaused = false;
+	if (client.connected()) {
+		// Anything the client can take right away, like a goodbye message, is still sent
+		sendQueued(outLen);
+	}
+	client.stop();
+	outStart = outLen = 0;
+	shrinkOutput();
+}
+
+int SerialCommandTCPClient::available() {
+	if (!server->telnet) {
+		return client.available();
+	}
+
+	// Telnet commands are removed as they're read, so only one byte of data is known to be available
+	while(telnetLookahead < 0 && client.available() > 0) {
+		int c = client.read();
+		if (c < 0) {
+			break;
+		}
+		telnetLookahead = telnet.process((uint8_t) c);
+		handleTelnet();
+	}
+	return (telnetLookahead >= 0) ? 1 : 0;
+}
+
+int SerialCommandTCPClient::read() {
+	if (!server->telnet) {
+		return client.read();
+	}
+	int c = peek();
+	telnetLookahead = -1;
+	return c;
+}
+
+int SerialCommandTCPClient::peek() {
+	if (!server->telnet) {
+		return client.peek();
+	}
+	available();
+	return telnetLookahead;
+}
+
+size_t SerialCommandTCPClient::sendRaw(const uint8_t *buf, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+	lastSendMillis = millis();
+
+	// Timeout of 0 so a slow client can't block the loop. Errors are returned as negative values.
+	int count = (int) client.write(buf, size, 0);
+	size_t sent = (count > 0) ? (size_t) count : 0;
+	if (sent < size) {
+		if (!isStalled) {
+			stalled();
+		}
+	}
+	else {
+		isStalled = false;
+	}
+	bytesSent += sent;
+	return sent;
+}
+
+bool SerialCommandTCPClient::canSend() const {
+	// TCPClient can't report when it's writable, so a stalled session is retried after a short delay
+	return getQueueDepth() > 0 && (!isStalled || (long)(millis() - lastSendMillis) >= (long)OUTPUT_RETRY_MS);
+}
+
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
+void SerialCommandTCPClient::flush() {
+}
+
+size_t SerialCommandTCPClient::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t SerialCommandTCPClient::write(const uint8_t *buf, size_t size) {
+	if (!server->telnet) {
+		return queueData(buf, size);
+	}
+
+	if (!isConnected()) {
+		return 0;
+	}
+
+	// A data byte of 255 is sent as IAC IAC
+	static const uint8_t escapedIac[2] = { TelnetFilter::IAC, TelnetFilter::IAC };
+	size_t offset = 0;
+	while(offset < size) {
+		const uint8_t *iac = (const uint8_t *) memchr(&buf[offset], TelnetFilter::IAC, size - offset);
+		size_t len = iac ? (size_t)(iac - &buf[offset]) : (size - offset);
+		if (len) {
+			queueData(&buf[offset], len);
+		}
+		if (iac) {
+			// Queued whole or not at all, as a lone IAC would start a telnet command
+			if (reserveOutput(sizeof(escapedIac))) {
+				queueData(escapedIac, sizeof(escapedIac));
+			}
+			else {
+				bytesDropped += sizeof(escapedIac);
+				DEBUG_HIGH(("output discarded session=%u", index));
+			}
+			len++;
+		}
+		offset += len;
+	}
+	return size;
+}
+
+size_t SerialCommandTCPClient::queueData(const uint8_t *buf, size_t size) {
+	size_t result = queueBytes(buf, size);
+	if (mirror && result) {
+		writeMirror(buf, size);
+	}
+	return result;
+}
+
+void SerialCommandTCPClient::writeMirror(const uint8_t *buf, size_t size) {
+	if (size > mirror->size) {
+		// Only the end fits
+		mirror->head += (uint32_t)(size - mirror->size);
+		buf += size - mirror->size;
+		size = mirror->size;
+	}
+	while(size > 0) {
+		size_t offset = mirror->head % mirror->size;
+		size_t count = std::min(size, mirror->size - offset);
+		memcpy(&mirror->data[offset], buf, count);
+		mirror->head += (uint32_t) count;
+		buf += count;
+		size -= count;
+	}
+
+	for(size_t ii = mirror->firstObserver; ii != NO_SESSION; ii = server->clients[ii]->nextObserver) {
+		SerialCommandTCPClient *observer = server->clients[ii];
+		uint32_t behind = mirror->head - observer->mirrorCursor;
+		if (behind > mirror->size) {
+			// Overwritten before the observer sent it
+			observer->bytesDropped += behind - (uint32_t) mirror->size;
+			observer->mirrorCursor = mirror->head - (uint32_t) mirror->size;
+		}
+		if (!observer->outputPending) {
+			observer->outputPending = true;
+			server->queueOutput(ii);
+		}
+	}
+}
+
+size_t SerialCommandTCPClient::mirrorPending() const {
+	if (observing == NO_SESSION) {
+		return 0;
+	}
+	return (size_t)(server->clients[observing]->mirror->head - mirrorCursor);
+}
+
+size_t SerialCommandTCPClient::sendMirror(size_t maxBytes) {
+	const Mirror *source = server->clients[observing]->mirror;
+	size_t total = 0;
+	while(total < maxBytes) {
+		size_t pending = (size_t)(source->head - mirrorCursor);
+		size_t offset = mirrorCursor % source->size;
+		size_t count = std::min(std::min(pending, source->size - offset), maxBytes - total);
+		if (count == 0) {
+			break;
+		}
+		size_t sent = sendRaw((const uint8_t *)&source->data[offset], count);
+		mirrorCursor += (uint32_t) sent;
+		total += sent;
+		if (sent < count) {
+			break;
+		}
+	}
+	return total;
+}
+
+size_t SerialCommandTCPClient::queueBytes(const uint8_t *buf, size_t size) {
+	if (!isConnected()) {
+		return 0;
+	}
+	size_t result = size;
+
+	// Only the server's drainOutput() sends, so output that doesn't fit is held in a larger queue rather
+	// than sent here, which would go around the per-loop budget
+	reserveOutput(size);
+	size_t count = size;
+	if (count > outSize - outLen) {
+		count = outSize - outLen;
+		bytesDropped += (uint32_t)(size - count);
+		DEBUG_HIGH(("output discarded session=%u", index));
+	}
+	if (count) {
+		if (outStart + outLen + count > outSize) {
+			memmove(outBuf, &outBuf[outStart], outLen);
+			outStart = 0;
+		}
+		memcpy(&outBuf[outStart + outLen], buf, count);
+		outLen += count;
+		if (outLen > maxQueueDepth) {
+			maxQueueDepth = outLen;
+		}
+		if (!outputPending) {
+			outputPending = true;
+			server->queueOutput(index);
+		}
+		if (outLen > OUT_BUFFER_SIZE && !inputPaused) {
+			pauseInput(true);
+		}
+	}
+	return result;
+}
+
+bool SerialCommandTCPClient::reserveOutput(size_t size) {
+	if (outLen + size > outSize) {
+		growOutput(outLen + size);
+	}
+	return outLen + size <= outSize;
+}
+
+void SerialCommandTCPClient::growOutput(size_t needed) {
+	size_t newSize = outSize;
+	while(newSize < needed && newSize < server->outputQueueLimit) {
+		newSize *= 2;
+	}
+	if (newSize > server->outputQueueLimit) {
+		newSize = server->outputQueueLimit;
+	}
+	if (newSize <= outSize) {
+		return;
+	}
+	char *newBuf = server->allocateGrowable(newSize);
+	if (!newBuf) {
+		return;
+	}
+	memcpy(newBuf, &outBuf[outStart], outLen);
+	if (outBuf != outData) {
+		server->releaseGrowable(outBuf, outSize);
+	}
+	outBuf = newBuf;
+	outSize = newSize;
+	outStart = 0;
+}
+
+void SerialCommandTCPClient::shrinkOutput() {
+	if (outBuf == outData || outLen > OUT_BUFFER_SIZE) {
+		return;
+	}
+	memcpy(outData, &outBuf[outStart], outLen);
+	server->releaseGrowable(outBuf, outSize);
+	outBuf = outData;
+	outSize = OUT_BUFFER_SIZE;
+	outStart = 0;
+}
+
+void SerialCommandTCPClient::pauseInput(bool pause) {
+	inputPaused = pause;
+#if SERIAL_COMMAND_TCP_EPOLL
+	updateEvents();
+#endif
+	if (!pause) {
+		// Input that was read before pausing is processed on the next loop
+		server->markActive(index);
+	}
+}
+
+void SerialCommandTCPClient::startTelnet() {
+	bool lineMode = server->telnet && server->lineMode;
+	if (server->telnet) {
+		uint8_t negotiation[TelnetFilter::START_SIZE];
+		queueBytes(negotiation, telnet.start(negotiation, lineMode));
+	}
+
+	// With telnet the screen size comes from NAWS, unless the client refuses it
+	editor->withScreenSizeProbe(!server->telnet);
+	editor->withLineInput(lineMode);
+}
+
+void SerialCommandTCPClient::handleTelnet() {
+	if (telnet.getReplyLength()) {
+		queueBytes(telnet.getReply(), telnet.getReplyLength());
+		telnet.clearReply();
+	}
+
+	uint8_t events = telnet.takeEvents();
+	if (events & TelnetFilter::EVENT_WINDOW_SIZE) {
+		editor->setScreenSize(telnet.getWindowRows(), telnet.getWindowCols());
+	}
+	if (events & TelnetFilter::EVENT_NAWS_REFUSED) {
+		DEBUG_HIGH(("telnet client refused NAWS session=%u", index));
+		editor->withScreenSizeProbe(true);
+	}
+	if (events & TelnetFilter::EVENT_LINEMODE_REFUSED) {
+		// Fall back to character at a time mode with the full editor
+		DEBUG_HIGH(("telnet client refused LINEMODE session=%u", index));
+		uint8_t negotiation[TelnetFilter::START_SIZE];
+		queueBytes(negotiation, telnet.startCharacterMode(negotiation));
+		editor->withLineInput(false);
+		editor->getScreenSize();
+	}
+}
+
+size_t SerialCommandTCPClient::sendQueued(size_t maxBytes) {
+	size_t count = (outLen < maxBytes) ? outLen : maxBytes;
+	size_t sent = sendRaw((const uint8_t *)&outBuf[outStart], count);
+	outStart += sent;
+	outLen -= sent;
+	if (outLen <= OUT_BUFFER_SIZE) {
+		shrinkOutput();
+		if (inputPaused) {
+			pauseInput(false);
+		}
+	}
+	if (outLen == 0) {
+		outStart = 0;
+		if (observing != NO_SESSION && sent < maxBytes) {
+			// The session's own output, like telnet replies, goes first, then what it's observing
+			sent += sendMirror(maxBytes - sent);
+		}
+	}
+	return sent;
+}
+
+void SerialCommandTCPClient::stalled() {
+	isStalled = true;
+	stallCount++;
+	stallStart = millis();
+}
+
+void SerialCommandTCPClient::resetOutput() {
+	outStart = outLen = 0;
+	shrinkOutput();
+	inputPaused = false;
+	maxQueueDepth = 0;
+	bytesSent = bytesDropped = stallCount = 0;
+	isStalled = false;
+}
+
+void SerialCommandTCPClient::getOutputStats(OutputStats &stats) const {
+	stats.queueDepth = getQueueDepth();
+	stats.maxQueueDepth = maxQueueDepth;
+	stats.bytesSent = bytesSent;
+	stats.bytesDropped = bytesDropped;
+	stats.stallCount = stallCount;
+	stats.stalledMs = isStalled ? (millis() - stallStart) : 0;
+}
+
+unsigned long SerialCommandTCPClient::outputDeadline() const {
+	if (getQueueDepth() == 0) {
+		return 0;
+	}
+#if SERIAL_COMMAND_TCP_EPOLL
+	// epoll reports when a stalled socket is writable
+	return isStalled ? 0 : millis();
+#else
+	return isStalled ? SerialCommandParserBase::deadlineAfter(lastSendMillis, OUTPUT_RETRY_MS) : millis();
+#endif
+}
+
+
+SerialCommandTCPServer::SerialCommandTCPServer(size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t maxSessions, bool preallocate, uint16_t port) :
+		historyBufSize(historyBufSize), bufferSize(bufferSize), maxArgs(maxArgs), maxSessions(maxSessions), preallocate(preallocate),
+#if SERIAL_COMMAND_TCP_EPOLL
+		port(port) {
+#else
+		server(port) {
+#endif
+
+}
+
+SerialCommandTCPServer::~SerialCommandTCPServer() {
+
+	if (clients) {
+		for(size_t ii = 0; ii < maxSessions; ii++) {
+			if (clients[ii]) {
+				clients[ii]->~SerialCommandTCPClient();
+			}
+		}
+		delete[] clients;
+	}
+	delete[] sessionPool;
+	delete[] activeSessions;
+	delete[] freeSessions;
+	delete[] outputSessions;
+	delete[] timerNodes;
+	if (historyStore && sharedHistory) {
+		historyStore->detach(sharedHistory);
+	}
+	delete sharedHistory;
+	delete[] sharedHistoryBuffer;
+	delete[] sharedHistoryIndex;
+
+#if SERIAL_COMMAND_TCP_EPOLL
+	if (listenFd >= 0) {
+		close(listenFd);
+	}
+	if (epollFd >= 0) {
+		close(epollFd);
+	}
+#endif
+}
+
+void SerialCommandTCPServer::setup() {
+	if (useSharedHistory && historyBufSize) {
+		sharedHistoryBuffer = new char[historyBufSize];
+		sharedHistoryIndex = new SerialCommandHistory::IndexEntry[SerialCommandHistory::indexSize(historyBufSize)];
+		if (sharedHistoryBuffer && sharedHistoryIndex) {
+			sharedHistory = new SerialCommandHistory(sharedHistoryBuffer, historyBufSize, sharedHistoryIndex, SerialCommandHistory::indexSize(historyBufSize));
+			if (sharedHistory && historyStore) {
+				historyStore->load(*sharedHistory);
+			}
+		}
+		if (!sharedHistory) {
+			DEBUG_NORMAL(("failed to allocate shared history, not enough RAM"));
+		}
+	}
+
+	clients = new SerialCommandTCPClient*[maxSessions];
+	activeSessions = new size_t[maxSessions];
+	activeCount = 0;
+	freeSessions = new size_t[maxSessions];
+	freeCount = 0;
+	outputSessions = new size_t[maxSessions];
+	outputCount = 0;
+	if (idleTimeoutMs || sessionTimeoutMs) {
+		timerNodes = new TimerWheel::Node[maxSessions];
+		if (timerNodes) {
+			timers.setStorage(timerSlots, TIMER_WHEEL_SLOTS, timerNodes, maxSessions, TIMER_TICK_MS, millis());
+		}
+	}
+
+	// All sessions come from one block, so connecting and disconnecting never fragments the heap. Growable
+	// buffers start in the block and only their grown copies are allocated separately.
+	size_t historySize = (sharedHistory || (growable && !historyStore)) ? 0 : historyBufSize;
+	sessionSize = slabAlign(sizeof(SerialCommandTCPClient)) + slabAlign(sizeof(SerialCommandTCPEditor)) +
+			slabAlign(maxArgs * sizeof(char *)) + slabAlign(sessionLineBufferSize(growable, bufferSize)) + slabAlign(historyStorageSize(historySize));
+	sessionPool = new char[sessionSize * maxSessions];
+	if (!sessionPool) {
+		DEBUG_NORMAL(("failed to allocate %u sessions, not enough RAM", maxSessions));
+	}
+
+	for(size_t ii = 0; ii < maxSessions; ii++) {
+		clients[ii] = 0;
+		if (preallocate && sessionPool) {
+			constructSession(ii);
+		}
+	}
+
+	// Free list is a stack; push in reverse so the lowest numbered session is used first
+	if (sessionPool) {
+		for(size_t ii = maxSessions; ii-- > 0; ) {
+			freeSessions[freeCount++] = ii;
+		}
+	}
+
+#if SERIAL_COMMAND_TCP_EPOLL
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0) {
+		DEBUG_NORMAL(("epoll_create1 failed errno=%d", errno));
+		return;
+	}
+
+	if (!listener) {
+		// Connections come from addConnection()
+		networkWasConnected = true;
+		return;
+	}
+
+	listenFd = openListener(port, reusePort, (int)maxSessions);
+	if (listenFd < 0) {
+		return;
+	}
+
+	// The listener is event 0 and session n is event n + 1
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = 0;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+	networkWasConnected = true;
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+}
+
+SerialCommandTCPClient *SerialCommandTCPServer::allocateSession(size_t &index) {
+	if (freeCount == 0) {
+		return 0;
+	}
+	index = freeSessions[--freeCount];
+
+	if (!clients[index]) {
+		constructSession(index);
+	}
+	sessionCount++;
+	return clients[index];
+}
+
+SerialCommandTCPClient *SerialCommandTCPServer::constructSession(size_t index) {
+	char *slot = &sessionPool[index * sessionSize];
+	clients[index] = new(slot) SerialCommandTCPClient(this, slot + slabAlign(sizeof(SerialCommandTCPClient)));
+	clients[index]->index = index;
+	clients[index]->setup();
+	return clients[index];
+}
+
+void SerialCommandTCPServer::releaseSession(size_t index) {
+	timers.cancel(index);
+	if (clients[index]->observing != SerialCommandTCPClient::NO_SESSION) {
+		detachObserver(index);
+	}
+	while(clients[index]->mirror) {
+		// Observers of a session that's gone are disconnected
+		size_t observer = clients[index]->mirror->firstObserver;
+		detachObserver(observer);
+		clients[observer]->stop();
+		markActive(observer);
+	}
+	if (clients[index]->outputPending) {
+		for(size_t ii = 0; ii < outputCount; ii++) {
+			if (outputSessions[ii] == index) {
+				outputSessions[ii] = outputSessions[--outputCount];
+				break;
+			}
+		}
+		clients[index]->outputPending = false;
+	}
+	if (!preallocate) {
+		clients[index]->~SerialCommandTCPClient();
+		clients[index] = 0;
+		DEBUG_HIGH(("freed session=%u", index));
+	}
+	freeSessions[freeCount++] = index;
+	sessionCount--;
+}
+
+bool SerialCommandTCPServer::attachObserver(size_t observer, size_t primary) {
+	if (observer >= maxSessions || primary >= maxSessions || observer == primary) {
+		return false;
+	}
+	SerialCommandTCPClient *obs = clients[observer];
+	SerialCommandTCPClient *prim = clients[primary];
+	if (!obs || !prim || !obs->isConnected() || !prim->isConnected()) {
+		return false;
+	}
+	if (prim->isObserving() || obs->mirror) {
+		// Observers can't be chained
+		return false;
+	}
+	if (obs->isObserving()) {
+		detachObserver(observer);
+	}
+
+	if (!prim->mirror) {
+		char *data = new char[mirrorBufferSize];
+		if (!data) {
+			return false;
+		}
+		prim->mirror = new SerialCommandTCPClient::Mirror();
+		if (!prim->mirror) {
+			delete[] data;
+			return false;
+		}
+		prim->mirror->data = data;
+		prim->mirror->size = mirrorBufferSize;
+		prim->mirror->head = 0;
+		prim->mirror->firstObserver = SerialCommandTCPClient::NO_SESSION;
+	}
+
+	// Only output from now on is mirrored
+	obs->observing = primary;
+	obs->muted = true;
+	obs->mirrorCursor = prim->mirror->head;
+	obs->nextObserver = prim->mirror->firstObserver;
+	prim->mirror->firstObserver = observer;
+	DEBUG_NORMAL(("session %u observing session %u", observer, primary));
+	return true;
+}
+
+void SerialCommandTCPServer::detachObserver(size_t observer) {
+	if (observer >= maxSessions || !clients[observer] || !clients[observer]->isObserving()) {
+		return;
+	}
+	SerialCommandTCPClient *obs = clients[observer];
+	SerialCommandTCPClient *prim = clients[obs->observing];
+
+	size_t *link = &prim->mirror->firstObserver;
+	while(*link != observer) {
+		link = &clients[*link]->nextObserver;
+	}
+	*link = obs->nextObserver;
+
+	// Output from the mirror that hasn't been sent is discarded
+	obs->observing = SerialCommandTCPClient::NO_SESSION;
+	obs->nextObserver = SerialCommandTCPClient::NO_SESSION;
+
+	if (prim->mirror->firstObserver == SerialCommandTCPClient::NO_SESSION) {
+		delete[] prim->mirror->data;
+		delete prim->mirror;
+		prim->mirror = 0;
+	}
+}
+
+size_t SerialCommandTCPServer::getObserverCount(size_t primary) const {
+	if (primary >= maxSessions || !clients[primary] || !clients[primary]->mirror) {
+		return 0;
+	}
+	size_t count = 0;
+	for(size_t ii = clients[primary]->mirror->firstObserver; ii != SerialCommandTCPClient::NO_SESSION; ii = clients[ii]->nextObserver) {
+		count++;
+	}
+	return count;
+}
+
+int SerialCommandTCPServer::getSessionIndex(const SerialCommandParserBase *parser) const {
+	for(size_t ii = 0; ii < maxSessions; ii++) {
+		if (clients[ii] && clients[ii]->getParser() == parser) {
+			return (int) ii;
+		}
+	}
+	return -1;
+}
+
+char *SerialCommandTCPServer::allocateGrowable(size_t size) {
+	if (growBudget && growUsed + size > growBudget) {
+		DEBUG_HIGH(("memory budget used, can't grow buffer to %u", size));
+		return 0;
+	}
+	char *buf = new char[size];
+	if (buf) {
+		growUsed += size;
+	}
+	return buf;
+}
+
+void SerialCommandTCPServer::releaseGrowable(char *buf, size_t size) {
+	delete[] buf;
+	growUsed -= size;
+}
+
+void SerialCommandTCPServer::queueOutput(size_t index) {
+	outputSessions[outputCount++] = index;
+}
+
+void SerialCommandTCPServer::drainOutput() {
+	if (outputCount == 0) {
+		return;
+	}
+
+	// Take turns, starting with a different session each loop so none is always first
+	size_t budget = outputBudget ? outputBudget : (size_t)-1;
+	bool progress = true;
+	while(budget > 0 && progress) {
+		progress = false;
+		for(size_t ii = 0; ii < outputCount && budget > 0; ii++) {
+			SerialCommandTCPClient *client = clients[outputSessions[(outputNext + ii) % outputCount]];
+			if (client->canSend()) {
+				size_t sent = client->sendQueued((budget < OUTPUT_QUANTUM) ? budget : OUTPUT_QUANTUM);
+				if (sent) {
+					budget -= sent;
+					progress = true;
+				}
+			}
+		}
+	}
+	outputNext++;
+
+	// Drop the sessions that have sent everything
+	size_t keep = 0;
+	for(size_t ii = 0; ii < outputCount; ii++) {
+		SerialCommandTCPClient *client = clients[outputSessions[ii]];
+		if (client->getQueueDepth() > 0) {
+			outputSessions[keep++] = outputSessions[ii];
+		}
+		else {
+			client->outputPending = false;
+		}
+	}
+	outputCount = keep;
+	if (outputNext >= outputCount) {
+		outputNext = 0;
+	}
+}
+
+void SerialCommandTCPServer::scheduleTimeout(size_t index) {
+	if (!timerNodes) {
+		return;
+	}
+	SerialCommandTCPClient *client = clients[index];
+
+	unsigned long closeAt = 0;
+	if (idleTimeoutMs) {
+		closeAt = SerialCommandParserBase::deadlineAfter(client->lastInputMillis, idleTimeoutMs);
+	}
+	if (sessionTimeoutMs) {
+		closeAt = SerialCommandParserBase::earliestDeadline(closeAt, SerialCommandParserBase::deadlineAfter(client->connectedMillis, sessionTimeoutMs));
+	}
+
+	unsigned long expiry = closeAt;
+	if (timeoutWarning && !client->timeoutWarned) {
+		expiry = closeAt - timeoutWarningMs;
+	}
+	timers.schedule(index, expiry);
+}
+
+void SerialCommandTCPServer::handleTimeout(size_t index) {
+	SerialCommandTCPClient *client = clients[index];
+	if (!client || !client->isConnected()) {
+		return;
+	}
+
+	unsigned long now = millis();
+	bool idle = idleTimeoutMs && (now - client->lastInputMillis) >= idleTimeoutMs;
+	bool expired = sessionTimeoutMs && (now - client->connectedMillis) >= sessionTimeoutMs;
+	if (idle || expired) {
+		DEBUG_NORMAL(("session %u timed out", index));
+		client->stop();
+		markActive(index);
+		return;
+	}
+
+	if (timeoutWarning && !client->timeoutWarned) {
+		bool warnIdle = idleTimeoutMs && (now - client->lastInputMillis) + timeoutWarningMs >= idleTimeoutMs;
+		bool warnExpired = sessionTimeoutMs && (now - client->connectedMillis) + timeoutWarningMs >= sessionTimeoutMs;
+		if (warnIdle || warnExpired) {
+			client->getEditor()->printMessage("%s", timeoutWarning);
+			client->timeoutWarned = true;
+		}
+	}
+
+	// Not timed out yet, usually because there was input since this was scheduled
+	scheduleTimeout(index);
+}
+
+bool SerialCommandTCPServer::evictIdleSession() {
+	size_t oldest = maxSessions;
+	for(size_t ii = 0; ii < maxSessions; ii++) {
+		if (clients[ii] && clients[ii]->isConnected()) {
+			if (oldest == maxSessions || (long)(clients[ii]->lastInputMillis - clients[oldest]->lastInputMillis) < 0) {
+				oldest = ii;
+			}
+		}
+	}
+	if (oldest == maxSessions) {
+		return false;
+	}
+
+	DEBUG_NORMAL(("closing session %u, idle longest, for a new connection", oldest));
+	clients[oldest]->stop();
+
+	// Handle the disconnection now so the session is freed for the new connection
+	markActive(oldest);
+	serviceActive();
+	return true;
+}
+
+bool SerialCommandTCPServer::getOutputStats(size_t index, SerialCommandTCPClient::OutputStats &stats) {
+	if (!clients || index >= maxSessions || !clients[index] || !clients[index]->isConnected()) {
+		return false;
+	}
+	clients[index]->getOutputStats(stats);
+	return true;
+}
+
+void SerialCommandTCPServer::markActive(size_t index) {
+	if (clients[index] && !clients[index]->active) {
+		clients[index]->active = true;
+		activeSessions[activeCount++] = index;
+	}
+}
+
+void SerialCommandTCPServer::serviceActive() {
+	size_t keep = 0;
+	for(size_t ii = 0; ii < activeCount; ii++) {
+		size_t index = activeSessions[ii];
+		SerialCommandTCPClient *client = clients[index];
+
+		unsigned long deadline = client->nextDeadline();
+		if (client->hasPendingInput() || (deadline != 0 && (long)(millis() - deadline) >= 0)) {
+			client->loop();
+		}
+
+		if (!client->isConnected() && !client->wasConnected) {
+			// Disconnection has been handled
+			client->active = false;
+			releaseSession(index);
+		}
+		else
+		if (client->hasPendingInput() || client->nextDeadline() != 0) {
+			activeSessions[keep++] = index;
+		}
+		else {
+			client->active = false;
+		}
+	}
+	activeCount = keep;
+}
+
+#if SERIAL_COMMAND_TCP_EPOLL
+
+void SerialCommandTCPServer::loop() {
+	if (!clients || epollFd < 0) {
+		return;
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	int count = epoll_wait(epollFd, events, MAX_EVENTS, 0);
+	for(int ii = 0; ii < count; ii++) {
+		uint32_t index = events[ii].data.u32;
+		if (index == 0) {
+			acceptConnections();
+		}
+		else
+		if (index <= maxSessions && clients[index - 1]) {
+			clients[index - 1]->handleEvents(events[ii].events);
+			markActive(index - 1);
+		}
+	}
+
+	timers.advance(millis(), [this](size_t index) { handleTimeout(index); });
+
+	serviceActive();
+	drainOutput();
+}
+
+void SerialCommandTCPServer::acceptConnections() {
+	// Anything left over when the budget is used up keeps the listener readable for the next loop
+	for(size_t accepted = 0; accepted < acceptBudget; ) {
+		int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// EAGAIN when there are no more pending connections
+			break;
+		}
+		accepted++;
+		addConnection(fd);
+	}
+}
+
+bool SerialCommandTCPServer::addConnection(int fd) {
+	if (!clients || epollFd < 0) {
+		close(fd);
+		return false;
+	}
+
+	size_t index;
+	SerialCommandTCPClient *client = allocateSession(index);
+	if (!client && evictIdle && evictIdleSession()) {
+		client = allocateSession(index);
+	}
+	if (!client) {
+		DEBUG_NORMAL(("connection rejected, too many sessions"));
+		if (rejectMessage) {
+			// The socket is non-blocking, so this never waits
+			send(fd, rejectMessage, strlen(rejectMessage), MSG_NOSIGNAL);
+		}
+		close(fd);
+		return false;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = (uint32_t)(index + 1);
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		DEBUG_NORMAL(("epoll_ctl failed errno=%d", errno));
+		close(fd);
+		releaseSession(index);
+		return false;
+	}
+
+	client->setClient(fd);
+	markActive(index);
+	scheduleTimeout(index);
+	DEBUG_HIGH(("connection started session=%u", index));
+	return true;
+}
+
+bool SerialCommandTCPServer::isNetworkConnected() {
+	return true;
+}
+
+unsigned long SerialCommandTCPServer::nextDeadline() {
+	if (!clients) {
+		return 0;
+	}
+
+	// New connections are reported by epoll, so there's no accept poll interval
+	unsigned long deadline = 0;
+	for(size_t ii = 0; ii < activeCount; ii++) {
+		deadline = SerialCommandParserBase::earliestDeadline(deadline, clients[activeSessions[ii]]->nextDeadline());
+	}
+	for(size_t ii = 0; ii < outputCount; ii++) {
+		deadline = SerialCommandParserBase::earliestDeadline(deadline, clients[outputSessions[ii]]->outputDeadline());
+	}
+	deadline = SerialCommandParserBase::earliestDeadline(deadline, timers.nextDeadline());
+	return deadline;
+}
+
+bool SerialCommandTCPServer::hasPendingInput() {
+	if (!clients) {
+		return false;
+	}
+	if (epollFd >= 0) {
+		struct pollfd pfd;
+		pfd.fd = epollFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0) {
+			return true;
+		}
+	}
+	for(size_t ii = 0; ii < activeCount; ii++) {
+		if (clients[activeSessions[ii]]->hasPendingInput()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint16_t SerialCommandTCPServer::getPort() const {
+	return listenerPort(listenFd);
+}
+
+#else
+
+void SerialCommandTCPServer::loop() {
+	if (!clients) {
+		return;
+	}
+
+	bool connected = isNetworkConnected();
+	if (networkWasConnected != connected) {
+		DEBUG_NORMAL(("networkConnected=%d", connected));
+		if (connected) {
+			// Network connected, initialize listener
+#if Wiring_WiFi
+			DEBUG_NORMAL(("IP address %s", WiFi.localIP().toString().c_str()));
+#endif
+			server.begin();
+		}
+		else {
+			// Network disconnected, release all clients
+			if (!preallocate) {
+				freeCount = 0;
+				outputCount = 0;
+				for(size_t ii = maxSessions; ii-- > 0; ) {
+					timers.cancel(ii);
+					if (clients[ii]) {
+						clients[ii]->~SerialCommandTCPClient();
+						clients[ii] = 0;
+					}
+					if (sessionPool) {
+						freeSessions[freeCount++] = ii;
+					}
 				}
+				activeCount = 0;
+				sessionCount = 0;
 			}
 		}
-		if (foundFree) {
+		networkWasConnected = connected;
+	}
+
+	// TCPClient can't report when data arrives, so check each session for input. This is much
+	// cheaper than running the editor, which only happens for the active sessions.
+	for(size_t ii = 0; ii < maxSessions; ii++) {
+		if (clients[ii] && !clients[ii]->active && clients[ii]->hasPendingInput()) {
+			markActive(ii);
+		}
+	}
+	timers.advance(millis(), [this](size_t index) { handleTimeout(index); });
+	serviceActive();
+
+	// Check for connections, accepting up to acceptBudget of them
+	lastAcceptMillis = millis();
+	for(size_t accepted = 0; accepted < acceptBudget; accepted++) {
+		TCPClient client = server.available();
+		if (!client.connected()) {
+			break;
+		}
+
+		size_t index;
+		SerialCommandTCPClient *session = allocateSession(index);
+		if (!session && evictIdle && evictIdleSession()) {
+			session = allocateSession(index);
+		}
+		if (session) {
+			session->setClient(client);
+			markActive(index);
+			scheduleTimeout(index);
+			DEBUG_HIGH(("connection started session=%u", index));
 			DEBUG_NORMAL(("connection from %s", client.remoteIP().toString().c_str()));
 		}
 		else {
 			DEBUG_NORMAL(("connection from %s rejected, too many sessions", client.remoteIP().toString().c_str()));
+			if (rejectMessage) {
+				// Timeout of 0 so a slow client can't block the loop
+				client.write((const uint8_t *)rejectMessage, strlen(rejectMessage), 0);
+			}
 			client.stop();
 		}
 	}
+
+	drainOutput();
 }
 
 bool SerialCommandTCPServer::isNetworkConnected() {
@@ -1784,20 +5081,237 @@ bool SerialCommandTCPServer::isNetworkConnected() {
 #endif
 }
 
+unsigned long SerialCommandTCPServer::nextDeadline() {
+	if (!clients) {
+		return 0;
+	}
+
+	unsigned long deadline = 0;
+	if (networkWasConnected) {
+		// There's no way to find out about a pending connection without accepting it
+		deadline = SerialCommandParserBase::deadlineAfter(lastAcceptMillis, acceptPollMs);
+	}
+
+	for(size_t ii = 0; ii < activeCount; ii++) {
+		deadline = SerialCommandParserBase::earliestDeadline(deadline, clients[activeSessions[ii]]->nextDeadline());
+	}
+	for(size_t ii = 0; ii < outputCount; ii++) {
+		deadline = SerialCommandParserBase::earliestDeadline(deadline, clients[outputSessions[ii]]->outputDeadline());
+	}
+	deadline = SerialCommandParserBase::earliestDeadline(deadline, timers.nextDeadline());
+	return deadline;
+}
+
+bool SerialCommandTCPServer::hasPendingInput() {
+	if (!clients) {
+		return false;
+	}
+	if (isNetworkConnected() != networkWasConnected) {
+		return true;
+	}
+	for(size_t ii = 0; ii < maxSessions; ii++) {
+		if (clients[ii] && clients[ii]->hasPendingInput()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
 void SerialCommandTCPServer::stop(SerialCommandParserBase *parser) {
 	for(size_t ii = 0; ii < maxSessions; ii++) {
 		if (clients[ii]) {
 			if (clients[ii]->getParser() == parser) {
 				clients[ii]->stop();
+				if (clients[ii]->wasConnected) {
+					// Disconnection is handled and the session freed from loop(), not here
+					markActive(ii);
+				}
 				DEBUG_HIGH(("stop session=%u", ii));
-				// Delete client from loop, not here
 				break;
 			}
 		}
 	}
 }
 
-#endif /* UNITTEST */
+#if SERIAL_COMMAND_HAS_THREADS
+
+SerialCommandTCPExecutor::SerialCommandTCPExecutor(SerialCommandConfig *config, size_t numThreads, size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t sessionsPerThread, uint16_t port) :
+		config(config), numThreads(numThreads), historyBufSize(historyBufSize), bufferSize(bufferSize), maxArgs(maxArgs),
+		sessionsPerThread(sessionsPerThread), port(port), running(false) {
+}
+
+SerialCommandTCPExecutor::~SerialCommandTCPExecutor() {
+	stop();
+	releaseShards();
+}
+
+bool SerialCommandTCPExecutor::start() {
+	if (shards || numThreads == 0) {
+		return false;
+	}
+
+	listenFd = openListener(port, false, (int)(numThreads * sessionsPerThread));
+	listenPort = listenerPort(listenFd);
+	if (listenPort == 0) {
+		releaseShards();
+		return false;
+	}
+
+	shards = new Shard[numThreads];
+	for(size_t ii = 0; ii < numThreads; ii++) {
+		// Shards don't listen; they get their connections from acceptConnections()
+		SerialCommandTCPServer *server = new SerialCommandTCPServer(historyBufSize, bufferSize, maxArgs, sessionsPerThread, false, 0);
+		shards[ii].server = server;
+		server->withConfig(config).withListener(false);
+		if (shardSetup) {
+			shardSetup(server);
+		}
+		server->setup();
+
+		shards[ii].wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (server->getEpollFd() < 0 || shards[ii].wakeFd < 0) {
+			DEBUG_NORMAL(("executor failed to start shard %u", ii));
+			releaseShards();
+			return false;
+		}
+	}
+
+	// From here on the configuration is read by every worker thread
+	config->freeze();
+
+	running = true;
+	for(size_t ii = 0; ii < numThreads; ii++) {
+		shards[ii].thread = std::thread(&SerialCommandTCPExecutor::run, this, ii);
+	}
+	DEBUG_NORMAL(("executor started %u threads on port %u", numThreads, listenPort));
+	return true;
+}
+
+void SerialCommandTCPExecutor::stop() {
+	if (!running) {
+		return;
+	}
+	running = false;
+
+	for(size_t ii = 0; ii < numThreads; ii++) {
+		uint64_t value = 1;
+		if (write(shards[ii].wakeFd, &value, sizeof(value)) < 0) {
+			DEBUG_NORMAL(("executor wake failed errno=%d", errno));
+		}
+	}
+	for(size_t ii = 0; ii < numThreads; ii++) {
+		if (shards[ii].thread.joinable()) {
+			shards[ii].thread.join();
+		}
+	}
+}
+
+void SerialCommandTCPExecutor::releaseShards() {
+	if (shards) {
+		for(size_t ii = 0; ii < numThreads; ii++) {
+			delete shards[ii].server;
+			if (shards[ii].wakeFd >= 0) {
+				close(shards[ii].wakeFd);
+			}
+			for(int fd : shards[ii].pending) {
+				close(fd);
+			}
+		}
+		delete[] shards;
+		shards = 0;
+	}
+	if (listenFd >= 0) {
+		close(listenFd);
+		listenFd = -1;
+	}
+	listenPort = 0;
+}
+
+void SerialCommandTCPExecutor::acceptConnections() {
+	// Every worker waits on the listener, so a busy worker doesn't hold up new connections
+	for(size_t accepted = 0; accepted < numThreads * sessionsPerThread; accepted++) {
+		int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			// EAGAIN when there are no more pending connections, or another worker took them
+			break;
+		}
+
+		// The load only goes down in the shard's own loop, so it's never less than the real number of
+		// sessions. When every shard is full, the shard's own eviction or reject message is used.
+		size_t target = 0;
+		{
+			std::lock_guard<std::mutex> lock(handoffMutex);
+			for(size_t ii = 1; ii < numThreads; ii++) {
+				if (shards[ii].load < shards[target].load) {
+					target = ii;
+				}
+			}
+			shards[target].pending.push_back(fd);
+			shards[target].load++;
+		}
+
+		uint64_t value = 1;
+		if (write(shards[target].wakeFd, &value, sizeof(value)) < 0) {
+			DEBUG_NORMAL(("executor wake failed errno=%d", errno));
+		}
+	}
+}
+
+void SerialCommandTCPExecutor::run(size_t index) {
+	Shard &shard = shards[index];
+	std::vector<int> added;
+
+	while(running) {
+		{
+			std::lock_guard<std::mutex> lock(handoffMutex);
+			added.swap(shard.pending);
+		}
+		for(int fd : added) {
+			shard.server->addConnection(fd);
+		}
+		added.clear();
+
+		shard.server->loop();
+		{
+			std::lock_guard<std::mutex> lock(handoffMutex);
+			shard.load = shard.server->getSessionCount() + shard.pending.size();
+		}
+
+		int timeout = MAX_WAIT_MS;
+		if (shard.server->hasPendingInput()) {
+			timeout = 0;
+		}
+		else {
+			unsigned long deadline = shard.server->nextDeadline();
+			if (deadline != 0) {
+				long remaining = (long)(deadline - millis());
+				timeout = (remaining <= 0) ? 0 : (int)std::min(remaining, (long)MAX_WAIT_MS);
+			}
+		}
+
+		struct pollfd fds[3] = {
+			{ shard.server->getEpollFd(), POLLIN, 0 },
+			{ shard.wakeFd, POLLIN, 0 },
+			{ listenFd, POLLIN, 0 }
+		};
+		poll(fds, 3, timeout);
+		if (fds[1].revents & POLLIN) {
+			uint64_t value;
+			if (read(shard.wakeFd, &value, sizeof(value)) < 0) {
+				DEBUG_HIGH(("executor wake read failed errno=%d", errno));
+			}
+		}
+		if (fds[2].revents & POLLIN) {
+			acceptConnections();
+		}
+	}
+}
+
+#endif /* SERIAL_COMMAND_HAS_THREADS */
+
+#endif /* SERIAL_COMMAND_HAS_TCP_SERVER */
 
 #ifndef UNITTEST
 
@@ -3,11 +3,58 @@
 
 #include "Particle.h"
 #include "RingBuffer.h"
+#include "RecordRing.h"
+#include "TimerWheel.h"
+#include "TelnetFilter.h"
 
 #include <vector>
 
+// File-based history storage is available on devices with a file system and on Linux
+#if defined(UNITTEST) || defined(__linux__) || HAL_PLATFORM_FILESYSTEM
+#define SERIAL_COMMAND_HAS_FILESYSTEM 1
+#else
+#define SERIAL_COMMAND_HAS_FILESYSTEM 0
+#endif
+
+// SerialCommandTCPServer uses TCPServer on Particle devices, and non-blocking sockets and epoll on Linux
+#if defined(__linux__) && (defined(UNITTEST) || !defined(PLATFORM_ID))
+#define SERIAL_COMMAND_TCP_EPOLL 1
+#else
+#define SERIAL_COMMAND_TCP_EPOLL 0
+#endif
+
+#if !defined(UNITTEST) || SERIAL_COMMAND_TCP_EPOLL
+#define SERIAL_COMMAND_HAS_TCP_SERVER 1
+#else
+#define SERIAL_COMMAND_HAS_TCP_SERVER 0
+#endif
+
+// Running sessions on several threads (SerialCommandTCPExecutor) is only supported on Linux
+#if SERIAL_COMMAND_TCP_EPOLL
+#define SERIAL_COMMAND_HAS_THREADS 1
+#include <atomic>
+#include <mutex>
+#include <thread>
+#else
+#define SERIAL_COMMAND_HAS_THREADS 0
+#endif
+
 class SerialCommandParserBase; // Forward declaration
 
+/**
+ * @brief Function to generate the possible values of a command argument for Tab completion
+ *
+ * @param prefix The part of the argument typed so far, with quotes and backslash escapes removed
+ *
+ * @param argIndex Which argument is being completed. For a command, 0 is the first argument that is not
+ * an option or option argument. For an option, 0 is the first argument after the option.
+ *
+ * @param candidate Call this once for each possible value. Values that don't start with prefix are ignored,
+ * so a completer that only has a few values can pass them all. The value is not saved, so it can be a
+ * temporary buffer.
+ */
+typedef std::function<void(const char *prefix, size_t argIndex, const std::function<void(const char *candidate)> &candidate)> CommandCompleter;
+
 /**
  * @brief Specifies information about a single option for a command
  * 
@@ -91,6 +138,11 @@ public:
 	 * Default is 0 (no options). These are different than optional extra arguments to a command.
 	 */
 	size_t requiredArgs = 0;
+
+	/**
+	 * @brief Function to complete the arguments of this option (optional)
+	 */
+	CommandCompleter completer = 0;
 };
 
 
@@ -157,6 +209,30 @@ public:
 	 */
 	CommandHandlerInfo &withRawArgs(bool value = true) { rawArgs = true; return *this; };
 
+	/**
+	 * @brief Mark this handler as safe to run on several threads at the same time (default: false)
+	 *
+	 * Only matters when the configuration is frozen and shared by SerialCommandTCPExecutor. Handlers that
+	 * are not thread safe are run one at a time, so they can use global state without locking.
+	 */
+	CommandHandlerInfo &withThreadSafe(bool value = true) { threadSafe = value; return *this; };
+
+	/**
+	 * @brief Set a function to complete the arguments of this command when Tab is pressed (optional)
+	 *
+	 * Options that start with -- are completed from the options of the command without a completer.
+	 */
+	CommandHandlerInfo &withCompleter(CommandCompleter completer) { this->completer = completer; return *this; };
+
+	/**
+	 * @brief Set a function to complete the arguments of an option that has required arguments
+	 *
+	 * @param shortOpt The short option character of an option that was already added using addCommandOption()
+	 *
+	 * @param completer The function to generate the possible values
+	 */
+	CommandHandlerInfo &withOptionCompleter(char shortOpt, CommandCompleter completer);
+
 	/**
 	 * @brief Get the CommandOption by shortOpt
 	 * 
@@ -200,6 +276,11 @@ public:
 	 */
 	bool rawArgs = false;
 
+	/**
+	 * @brief The handler can run on several threads at once, see withThreadSafe()
+	 */
+	bool threadSafe = false;
+
 	/**
 	 * @brief Vector of CommandOption objects for the objects for this command
 	 * 
@@ -208,6 +289,11 @@ public:
 	 */
 	std::vector<CommandOption*> cmdOptions;
 
+	/**
+	 * @brief Function to complete the arguments of this command (optional)
+	 */
+	CommandCompleter completer = 0;
+
 	/**
 	 * @brief The handler function to handle when this command is issued
 	 */
@@ -552,14 +638,33 @@ public:
 	SerialCommandConfig();
 	virtual ~SerialCommandConfig();
 
-	SerialCommandConfig &withPrompt(const char *prompt) { this->prompt = prompt; return *this; };
+	SerialCommandConfig &withPrompt(const char *prompt) { if (!frozen) { this->prompt = prompt; } return *this; };
 
 	/**
 	 * @brief Set the welcome message upon connection (USB serial only) (optional)
 	 *
 	 * Since the hardware UART doesn't have connection detection, this is not used.
 	 */
-	SerialCommandConfig &withWelcome(const char *welcome) { this->welcome = welcome; return *this; };
+	SerialCommandConfig &withWelcome(const char *welcome) { if (!frozen) { this->welcome = welcome; } return *this; };
+
+	/**
+	 * @brief Make the configuration read-only so it can be shared by sessions on several threads
+	 *
+	 * Afterwards, withPrompt(), withWelcome() and adding commands are ignored, so the commands, prompt and
+	 * welcome message can be read from any thread without locking. Handlers not marked with
+	 * CommandHandlerInfo::withThreadSafe() are run one at a time. This can't be undone.
+	 */
+	void freeze() { frozen = true; };
+
+	/**
+	 * @brief Returns true if freeze() has been called
+	 */
+	bool isFrozen() const { return frozen; };
+
+	/**
+	 * @brief Call the handler for a command, one at a time if the configuration is frozen and the handler is not thread safe
+	 */
+	void callHandler(CommandHandlerInfo *chi, SerialCommandParserBase *parser);
 
 	/**
 	 * @brief Add a command handler
@@ -570,6 +675,8 @@ public:
 	 * are added automatically.
 	 *
 	 * @param handler The function or lambda to call when the command is entered.
+	 *
+	 * After freeze() the command is not added and an error is logged. The returned object is never used.
 	 */
 	CommandHandlerInfo &addCommandHandler(const char *cmdName, const char *helpStr, std::function<void(SerialCommandParserBase *parser)> handler);
 
@@ -587,15 +694,69 @@ public:
 	 */
 	CommandHandlerInfo *getCommandHandlerInfo(const char *cmd) const;
 
+	/**
+	 * @brief Find the command names and aliases that start with a prefix
+	 *
+	 * @param prefix The prefix. Does not need to be null terminated.
+	 *
+	 * @param len The length of prefix. 0 matches all names.
+	 *
+	 * @param count Filled in with the number of matching names
+	 *
+	 * @return The index of the first match for getCommandName(). Names are kept in sorted order, so the
+	 * matches are getCommandName(index) to getCommandName(index + count - 1).
+	 */
+	size_t findCommandPrefix(const char *prefix, size_t len, size_t &count) const;
+
+	/**
+	 * @brief Get a command name or alias by its position in sorted order
+	 *
+	 * @param index 0 <= index < getCommandNameCount()
+	 */
+	const char *getCommandName(size_t index) const { return commandIndex[index].name; };
+
+	/**
+	 * @brief Returns the number of command names, including aliases
+	 */
+	size_t getCommandNameCount() const { return commandIndex.size(); };
+
 	const String &getPrompt() const { return prompt; };
 	const String &getWelcome() const { return welcome; };
 
-	std::vector<CommandHandlerInfo*> &getCommandHandlers() { return commandHandlers; };
+	const std::vector<CommandHandlerInfo*> &getCommandHandlers() const { return commandHandlers; };
 
 protected:
+	/**
+	 * @brief Binary search of the sorted command names
+	 *
+	 * @return The index of the first name whose first len characters compare greater than or equal
+	 * to str, or greater than if upper is true
+	 */
+	size_t findCommandIndex(const char *str, size_t len, bool upper) const;
+
+	/**
+	 * @brief Entry in the sorted index of command names used for dispatch and completion
+	 */
+	struct CommandIndexEntry {
+		const char *name;
+		CommandHandlerInfo *chi;
+	};
+
 	std::vector<CommandHandlerInfo*> commandHandlers;
+	std::vector<CommandIndexEntry> commandIndex;
 	String prompt;
 	String welcome;
+	bool frozen = false;
+
+	/**
+	 * @brief Handlers added after freeze(). They're never called, but are kept so the reference returned
+	 * by addCommandHandler() stays valid.
+	 */
+	std::vector<CommandHandlerInfo*> ignoredHandlers;
+#if SERIAL_COMMAND_HAS_THREADS
+	std::mutex handlerMutex; // Held while calling a handler that isn't thread safe
+	std::mutex ignoredMutex; // Guards ignoredHandlers, which any thread can add to
+#endif
 };
 
 /**
@@ -644,6 +805,40 @@ public:
 	 */
 	void loop();
 
+	/**
+	 * @brief Returns the millis() value at which loop() next needs to be called, or 0 if there is no timer pending
+	 *
+	 * Use this along with hasPendingInput() to avoid calling loop() continuously. If hasPendingInput()
+	 * returns false, the application can wait for its own events (or sleep) until the deadline
+	 * without missing anything. A return value of 0 means that loop() only needs to be called when
+	 * there is new input.
+	 */
+	virtual unsigned long nextDeadline();
+
+	/**
+	 * @brief Returns true if there is input waiting to be processed by loop()
+	 *
+	 * For USB serial, this also returns true when the connection state has changed and
+	 * handleConnected() needs to be called.
+	 */
+	virtual bool hasPendingInput();
+
+	/**
+	 * @brief Returns the earlier of two deadlines, as returned from nextDeadline()
+	 *
+	 * A deadline of 0 means no deadline. The comparison works correctly when millis() rolls over.
+	 */
+	static unsigned long earliestDeadline(unsigned long a, unsigned long b);
+
+	/**
+	 * @brief Returns a deadline ms milliseconds after start, never 0 so it's not confused with no deadline
+	 */
+	static unsigned long deadlineAfter(unsigned long start, unsigned long ms);
+
+	/**
+	 * @brief Returns the number of milliseconds until deadline, 0 if it has passed, or maxWait if there is no deadline
+	 */
+	static unsigned long millisUntilDeadline(unsigned long deadline, unsigned long maxWait);
 
 	/**
 	 * @brief Clear the data in the processor
@@ -691,6 +886,13 @@ public:
 	 */
     virtual size_t write(uint8_t);
 
+	/**
+	 * @brief Virtual override class Print. Writes a block of bytes to the stream in a single call.
+	 */
+    virtual size_t write(const uint8_t *buf, size_t size);
+
+    using Print::write;
+
     /**
      * @brief Override to change the default behavior of generating a command prompt
      */
@@ -743,6 +945,18 @@ public:
 	 */
     void insertCharacterAt(size_t index, char c);
 
+	/**
+	 * @brief Insert len characters from str at index
+	 *
+	 * @return The number of characters inserted, which may be less than len if the buffer is full
+	 */
+    size_t insertCharactersAt(size_t index, const char *str, size_t len);
+
+	/**
+	 * @brief Delete len characters starting at index
+	 */
+    void deleteCharactersAt(size_t index, size_t len);
+
 	/**
 	 * @brief Append character c to the end of the line
 	 */
@@ -763,6 +977,7 @@ public:
 	 * This overload is used for USB serial ports: Serial, USBSerial1.
 	 */
 	SerialCommandParserBase &withSerial(USBSerial *serial) { this->streamType = StreamType::USBSerial; this->stream = serial; return *this; };
+#endif /* UNITTEST */
 
 	/**
 	 * @brief Sets a Stream to read/write to. This is used for TCPClient.
@@ -770,8 +985,6 @@ public:
 	 */
 	SerialCommandParserBase &withStream(Stream *stream) { this->streamType = StreamType::Stream; this->stream = stream; return *this; };
 
-#endif /* UNITTEST */
-
 	SerialCommandParserBase &withConfig(SerialCommandConfig *config) { this->config = config; return *this; };
 
 	/**
@@ -792,6 +1005,21 @@ public:
 	 */
 	size_t printWithNewLine(const char *str, bool endWithNewLine);
 
+	/**
+	 * @brief Scan one space-separated token of a command line, handling backslash escapes and quotes
+	 *
+	 * @param src The start of the token. Leading white space must already be skipped.
+	 *
+	 * @param dst Where to copy the token with the quotes and backslashes removed, which can be the same as
+	 * src, or NULL to only find the end of the token. Updated to point after the last character copied. Not
+	 * null terminated.
+	 *
+	 * @return A pointer to the white space or null terminator that ended the token
+	 *
+	 * This is used to split the line into arguments and to find the word to complete when Tab is pressed.
+	 */
+	static char *scanToken(char *src, char *&dst);
+
 	/**
 	 * @brief Get a pointer to the buffer where the line being typed is stored
 	 */
@@ -818,15 +1046,29 @@ public:
 	CommandParsingState *getParsingState() { return parsingState; };
 
 protected:
+	/**
+	 * @brief Override to let the line buffer grow. Called when an edit needs a buffer of at least size bytes.
+	 *
+	 * The default does nothing, so lines are limited to bufferSize - 1 characters. An override replaces
+	 * buffer and bufferSize with a larger buffer holding the same contents. It may grow the buffer by less
+	 * than requested, or not at all.
+	 */
+	virtual void growBuffer(size_t) {};
+
+	/**
+	 * @brief Returns true if the buffer is at least size bytes, calling growBuffer() if it's not
+	 */
+	bool reserveBuffer(size_t size);
+
 	char *buffer;
 	size_t bufferSize;
 	char **argsBuffer;
 	size_t argsBufferSize;
 	size_t argsCount = 0;
 	size_t bufferOffset = 0;
-#ifndef UNITTEST
 	StreamType streamType = StreamType::NONE;
 	Stream *stream = 0;
+#ifndef UNITTEST
 	bool usbWasConnected = false;
 #endif /* UNITTEST */
 	SerialCommandConfig *config = 0;
@@ -848,236 +1090,2061 @@ protected:
 
 };
 
-class SerialCommandEditorBase : public SerialCommandParserBase {
+class SerialCommandEditorBase; // Forward declaration
+
+/**
+ * @brief Table that maps keys to line editor actions
+ *
+ * The table is indexed by key code and modifiers, so looking up the action for a key is O(1). Key codes
+ * are the control characters (KEY_CTRL_A, KEY_TAB, ...), the negative special key codes (KEY_HOME, KEY_UP, ...),
+ * or, with MOD_ALT, any character (Alt-B is sent by the terminal as ESC b). Printable characters without
+ * a modifier are always inserted into the line and are not looked up.
+ *
+ * The editor only keeps a pointer to the keymap, so a single keymap can be shared by any number of
+ * editors, such as all of the sessions of a SerialCommandTCPServer. By default, all editors share the
+ * keymap returned by getDefault(), so changes to it affect all editors that have not been given their
+ * own keymap using SerialCommandEditorBase::withKeymap().
+ */
+class SerialCommandKeymap {
 public:
-	enum class ScrollView {
-		HOME,
-		LEFT_EDGE,
-		VISIBLE,
-		RIGHT_EDGE,
-		END
-	};
-	enum class TerminalType {
-		UNKNOWN,
-		DUMB,
-		ANSI
+	/**
+	 * @brief Actions that can be bound to keys
+	 *
+	 * Values from CUSTOM up are custom actions added using addCustomAction().
+	 */
+	enum class Action : uint8_t {
+		NONE = 0,				//!< Key is ignored
+		BEGINNING_OF_LINE,		//!< Move cursor to start of line (Ctrl-A, Home)
+		END_OF_LINE,			//!< Move cursor to end of line (Ctrl-E, End)
+		BACKWARD_CHAR,			//!< Move cursor left (Ctrl-B, Left)
+		FORWARD_CHAR,			//!< Move cursor right (Ctrl-F, Right)
+		BACKWARD_DELETE_CHAR,	//!< Delete character left of cursor (Backspace, Delete)
+		DELETE_CHAR,			//!< Delete character at the cursor (Forward Delete)
+		KILL_LINE,				//!< Kill from cursor to end of line (Ctrl-K)
+		COMPLETE,				//!< Command completion (Tab)
+		CLEAR_SCREEN,			//!< Clear screen and redraw line (Ctrl-L)
+		PREVIOUS_HISTORY,		//!< Previous command in history (Ctrl-P, Up)
+		NEXT_HISTORY,			//!< Next command in history (Ctrl-N, Down)
+		ACCEPT_LINE,			//!< Process the line (Return)
+		UNDO,					//!< Undo the last edit (Ctrl-_)
+		REDO,					//!< Redo the last undone edit (Ctrl-^)
+		BACKWARD_WORD,			//!< Move cursor to start of word (Alt-B, Ctrl-Left)
+		FORWARD_WORD,			//!< Move cursor to end of word (Alt-F, Ctrl-Right)
+		KILL_WORD,				//!< Kill from cursor to end of word (Alt-D)
+		BACKWARD_KILL_WORD,		//!< Kill from start of word to cursor (Alt-Backspace)
+		UNIX_WORD_RUBOUT,		//!< Kill from previous whitespace to cursor (Ctrl-W)
+		UNIX_LINE_DISCARD,		//!< Kill from start of line to cursor (Ctrl-U)
+		YANK,					//!< Insert the most recently killed text (Ctrl-Y)
+		YANK_POP,				//!< Replace the text just yanked with the previous kill (Alt-Y)
+		REVERSE_SEARCH_HISTORY,	//!< Incremental search back through history (Ctrl-R)
+		PREVIOUS_MOST_USED_HISTORY,	//!< Next less used command in history (Page Up)
+		NEXT_MOST_USED_HISTORY,	//!< Next more used command in history (Page Down)
+		CUSTOM = 128			//!< First custom action
 	};
 
-	SerialCommandEditorBase(char *historyBuffer, size_t historyBufferSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize);
-	virtual ~SerialCommandEditorBase();
-
 	/**
-	 * @brief Clear the data in the processor
+	 * @brief Handler for a custom action
 	 *
-	 * You normal don't need to call this as it's cleared after processing a command. This is
-	 * used during unit testing.
+	 * @param editor The editor the key was pressed in
+	 *
+	 * @param key The key code that was pressed
 	 */
-	virtual void clear();
-
-	void cursorUp(int n = 1) { printTerminalOutputSequence(n, 'A'); };
+	typedef std::function<void(SerialCommandEditorBase *editor, char key)> CustomActionHandler;
 
-	void cursorDown(int n = 1) { printTerminalOutputSequence(n, 'B'); };
-
-	void cursorForward(int n = 1) { printTerminalOutputSequence(n, 'C'); };
+	static const uint8_t MOD_NONE = 0x00; 	//!< No modifier
+	static const uint8_t MOD_ALT = 0x01;	//!< Alt (Meta), sent as an ESC prefix or xterm modifier
+	static const uint8_t MOD_CTRL = 0x02;	//!< Ctrl with a special key, like Ctrl-Right (xterm modifier)
+	static const size_t NUM_MODIFIERS = 4;	//!< Number of combinations of modifiers
 
-	void cursorBack(int n = 1) { printTerminalOutputSequence(n, 'D'); };
+	/**
+	 * @brief Constructor
+	 *
+	 * @param withDefaults true (default) to start with the default bindings, false to start with no keys bound.
+	 */
+	explicit SerialCommandKeymap(bool withDefaults = true);
 
-	void eraseScreen(int n = 2) { printTerminalOutputSequence(n, 'J'); };
+	/**
+	 * @brief Destructor
+	 */
+	virtual ~SerialCommandKeymap();
 
-	void eraseToBeginningOfScreen() { eraseScreen(1); };
+	/**
+	 * @brief Bind a key to an action, replacing any existing binding
+	 *
+	 * @param key Key code, for example SerialCommandEditorBase::KEY_CTRL_W or SerialCommandEditorBase::KEY_LEFT.
+	 *
+	 * @param action The action to perform, either a built-in action or one returned by addCustomAction().
+	 *
+	 * @param modifiers MOD_NONE (default), MOD_ALT, MOD_CTRL, or MOD_ALT | MOD_CTRL.
+	 */
+	SerialCommandKeymap &bind(char key, Action action, uint8_t modifiers = MOD_NONE);
 
-	void eraseToEndOfScreen() { eraseScreen(0); };
+	/**
+	 * @brief Remove the binding for a key so it's ignored
+	 */
+	SerialCommandKeymap &unbind(char key, uint8_t modifiers = MOD_NONE) { return bind(key, Action::NONE, modifiers); };
 
-	void eraseLine(int n = 2) { printTerminalOutputSequence(n, 'K'); };
+	/**
+	 * @brief Get the action for a key
+	 */
+	Action getAction(char key, uint8_t modifiers = MOD_NONE) const { return (Action) actions[modifiers % NUM_MODIFIERS][(uint8_t)key]; };
 
-	void eraseToBeginningOfLine() { eraseLine(1); };
+	/**
+	 * @brief Add a custom action that can be bound to keys using bind()
+	 *
+	 * @param handler Function to call when a key bound to this action is pressed
+	 *
+	 * @return The action to pass to bind(), or Action::NONE if the maximum of 127 custom actions have
+	 * already been added.
+	 */
+	Action addCustomAction(CustomActionHandler handler);
 
-	void eraseToEndOfLine() { eraseLine(0); };
+	/**
+	 * @brief Run a custom action. Used by SerialCommandEditorBase::performAction().
+	 *
+	 * @return true if the action is a custom action and the handler was called
+	 */
+	bool runCustomAction(Action action, SerialCommandEditorBase *editor, char key) const;
 
+	/**
+	 * @brief Remove all bindings and restore the default bindings. Custom actions are kept, but not bound.
+	 */
+	void setDefaults();
 
 	/**
-	 * @brief Gets the cursor position using the Device Status Report (DSR)
+	 * @brief Remove all bindings
 	 */
-	void getCursorPosition(std::function<void(int row, int col)> callback = 0);
+	void clear();
 
 	/**
-	 * @brief Set cursor position (1 based, upper left is 1, 1)
+	 * @brief Get the keymap shared by all editors that have not been given their own keymap
 	 */
-	void setCursorPosition(int row, int col);
+	static SerialCommandKeymap *getDefault();
 
-	void printTerminalOutputSequence(int n, char c);
+protected:
+	uint8_t actions[NUM_MODIFIERS][256];
+	std::vector<CustomActionHandler> customActions;
+};
 
-	void getScreenSize();
+/**
+ * @brief Command history for the line editor
+ *
+ * Lines are stored in a RecordRing in the caller's history buffer, with an index array also provided by
+ * the caller. Adding a line, getting a line by index, and getting the number of lines are all O(1). When
+ * the buffer or index is full, the oldest lines are discarded without moving the other lines.
+ *
+ * A line that is the same as the newest line is not added again. Lines are front-coded: when a line
+ * starts with the same characters as the line before it, only the rest of the line is stored and the
+ * start is read from the older line. The number of lines that must be read to get a line is limited to
+ * MAX_PREFIX_DEPTH + 1, so getting a line is still O(1).
+ */
+class SerialCommandHistory {
+public:
+	/**
+	 * @brief Maximum number of older lines a front-coded line can depend on
+	 */
+	static const size_t MAX_PREFIX_DEPTH = 3;
 
-	virtual void startEditing();
+	/**
+	 * @brief Shortest shared prefix that is front-coded
+	 */
+	static const size_t MIN_PREFIX_LENGTH = 3;
 
-	void handleConnected(bool isConnected);
+	/**
+	 * @brief A view of a line in history
+	 *
+	 * Because of front-coding, a line can be in up to MAX_PREFIX_DEPTH + 1 separate pieces in the history
+	 * buffer. The bytes are not copied and are not null terminated. The view is only valid until the
+	 * next change to the history.
+	 */
+	class Entry {
+	public:
+		/**
+		 * @brief Construct an empty entry
+		 */
+		Entry() {};
+
+		/**
+		 * @brief Construct an entry for len bytes at data
+		 */
+		Entry(const char *data, size_t len) { addSegment(data, len); };
+
+		/**
+		 * @brief Returns the number of bytes in the line
+		 */
+		size_t length() const { return len; };
+
+		/**
+		 * @brief Returns the character at index, which must be < length()
+		 */
+		char charAt(size_t index) const;
+
+		/**
+		 * @brief Copy the line to buf, truncating it if necessary
+		 *
+		 * @param buf Buffer to copy to. It's always null terminated.
+		 *
+		 * @param bufSize Size of buf in bytes. Must be at least 1.
+		 *
+		 * @return The number of characters copied, not including the null terminator
+		 */
+		size_t copyTo(char *buf, size_t bufSize) const;
+
+		/**
+		 * @brief Returns true if the line starts with the len bytes at str
+		 */
+		bool startsWith(const char *str, size_t len) const;
+
+		/**
+		 * @brief Returns true if the line is exactly the len bytes at str
+		 */
+		bool equals(const char *str, size_t len) const { return len == this->len && startsWith(str, len); };
+
+		/**
+		 * @brief Returns the index of the first occurrence of the len bytes at str, or -1 if not found
+		 */
+		int indexOf(const char *str, size_t len) const;
+
+		/**
+		 * @brief Maximum number of separate pieces in an entry
+		 */
+		static const size_t MAX_SEGMENTS = MAX_PREFIX_DEPTH + 1;
+
+	protected:
+		/**
+		 * @brief Add a piece to the end of the line
+		 */
+		void addSegment(const char *data, size_t len);
+
+		/**
+		 * @brief Returns true if the len bytes at str are in the line at pos
+		 */
+		bool matchAt(size_t pos, const char *str, size_t len) const;
+
+		struct Segment {
+			const char *data;
+			size_t len;
+		};
+		Segment segments[MAX_SEGMENTS];
+		size_t numSegments = 0;
+		size_t len = 0;
+
+		friend class SerialCommandHistory;
+	};
 
-	void loop();
+	/**
+	 * @brief Index entry for one line
+	 */
+	struct IndexEntry {
+		RecordRing::Record record; //!< Where the line is stored. Must be first.
+		uint32_t mask; //!< Characters in the line, from charMask()
+		uint32_t seq; //!< Sequence number, see getSeq()
+	};
 
-	virtual void filterChar(char c);
+	/**
+	 * @brief Buffer bytes per index entry for indexSize()
+	 *
+	 * Lines are usually longer than this, and a line that starts like the one before it only stores the
+	 * rest of the line, so the buffer usually fills before the index.
+	 */
+	static const size_t BYTES_PER_ENTRY = 8;
 
-	void handleSpecialKey(char key);
+	/**
+	 * @brief Returns the number of index entries for a history buffer of bufSize bytes
+	 *
+	 * This is the maximum number of lines in history. Each entry is sizeof(IndexEntry) (16) bytes.
+	 */
+	static constexpr size_t indexSize(size_t bufSize) { return (bufSize + BYTES_PER_ENTRY - 1) / BYTES_PER_ENTRY; };
 
-	virtual void handlePrompt();
+	/**
+	 * @brief Construct a history object with no storage. Call setStorage() or growStorage() before use.
+	 */
+	SerialCommandHistory() { setStorage(NULL, 0, NULL, 0); };
 
-	virtual void handlePromptWithCallback(std::function<void()> handlePromptCallback);
+	/**
+	 * @brief Construct a history object
+	 *
+	 * @param buf Buffer to hold the lines. It's not copied and must remain valid for the life of this object.
+	 *
+	 * @param bufSize Size of buf in bytes
+	 *
+	 * @param index Array to hold the index. It must remain valid for the life of this object.
+	 *
+	 * @param maxEntries Number of entries in index, which is the maximum number of lines. Usually indexSize(bufSize).
+	 */
+	SerialCommandHistory(char *buf, size_t bufSize, IndexEntry *index, size_t maxEntries) { setStorage(buf, bufSize, index, maxEntries); };
 
-	virtual void handleCompletion();
+	/**
+	 * @brief Set the buffer and index. Any existing history is discarded.
+	 */
+	void setStorage(char *buf, size_t bufSize, IndexEntry *index, size_t maxEntries) {
+		ring.setStorage(buf, bufSize, (RecordRing::Record *)index, maxEntries, sizeof(IndexEntry));
+	};
 
-	void setBuffer(const char *str, bool atEnd = false);
+	/**
+	 * @brief Move to a larger buffer and index, keeping all of the lines. The old ones are no longer used.
+	 */
+	void growStorage(char *buf, size_t bufSize, IndexEntry *index, size_t maxEntries) {
+		ring.growStorage(buf, bufSize, (RecordRing::Record *)index, maxEntries);
+	};
 
-	virtual void processChar(char c);
+	/**
+	 * @brief Returns true if a line of len bytes can be added without discarding older lines
+	 */
+	bool hasSpace(size_t len) const { return ring.findSpace(len) >= 0; };
 
-	void scrollToView(ScrollView which, bool forceRedraw);
+	/**
+	 * @brief Move a line to the front instead of adding it again if it's already in history
+	 *
+	 * @param value true to move existing lines (default is false, only consecutive duplicates are skipped)
+	 */
+	SerialCommandHistory &withMoveToFront(bool value = true) { moveToFront = value; return *this; };
 
-	void redraw(int fromPos = 0);
+	/**
+	 * @brief Add a line as the newest entry, discarding the oldest entries if necessary
+	 *
+	 * @return true if added, false if the line is empty, larger than the history buffer, or the same
+	 * as the newest line
+	 */
+	bool add(const char *line, size_t len);
 
-	void setCursor();
+	/**
+	 * @brief Get a line by index
+	 *
+	 * @param index 0 = the newest line, 1 = the one before that, ...
+	 *
+	 * @return The line, or an empty entry if index >= size()
+	 */
+	Entry get(size_t index) const;
 
-	void printMessage(const char *fmt, ...);
+	/**
+	 * @brief Returns the number of lines in history
+	 */
+	size_t size() const { return ring.size(); };
 
-	void printMessageNoPrompt(const char *fmt, ...);
+	/**
+	 * @brief Returns the size of the history buffer, which is the longest line that can be stored
+	 */
+	size_t getBufferSize() const { return ring.getDataSize(); };
 
-	void vprintMessage(bool prompt, const char *fmt, va_list ap);
+	/**
+	 * @brief Returns the number of index entries, which is the maximum number of lines
+	 */
+	size_t getMaxEntries() const { return ring.getMaxRecords(); };
 
-	void printMessagePrompt();
+	/**
+	 * @brief Returns the sequence number of a line
+	 *
+	 * @param index 0 = the newest line. Must be < size().
+	 *
+	 * Each line added gets a higher sequence number than the lines before it, and a line keeps its
+	 * sequence number as lines are added and removed. Editors that share a history use the sequence
+	 * number to keep their place instead of an index, which changes when any editor adds a line.
+	 */
+	uint32_t getSeq(size_t index) const { return getIndexEntry(index)->seq; };
 
-	void setTerminalType(TerminalType terminalType) { this->terminalType = terminalType; }
+	/**
+	 * @brief Returns the index of the newest line older than seq, or -1 if there isn't one
+	 *
+	 * Lines are ordered by sequence number so this is a binary search.
+	 */
+	int findOlder(uint32_t seq) const;
+
+	/**
+	 * @brief Returns the index of the oldest line newer than seq, or -1 if there isn't one
+	 */
+	int findNewer(uint32_t seq) const;
+
+	/**
+	 * @brief Remove all lines
+	 */
+	void clear() { ring.clear(); };
+
+	/**
+	 * @brief Remove the newest line. Does nothing if empty.
+	 */
+	void removeNewest() { ring.removeNewest(); };
+
+	/**
+	 * @brief Remove the oldest line. Does nothing if empty.
+	 */
+	void removeOldest();
+
+	/**
+	 * @brief Remove a line by index
+	 *
+	 * @param index 0 = the newest line, 1 = the one before that, ... Does nothing if index >= size().
+	 *
+	 * The newer lines are moved down to reuse the space when they're stored after the removed line,
+	 * otherwise the space is reused when the lines before it are discarded.
+	 */
+	void remove(size_t index);
+
+	/**
+	 * @brief Find the newest line that contains a string, starting at an index
+	 *
+	 * @param str The string to search for. It does not need to be null terminated.
+	 *
+	 * @param len The length of str
+	 *
+	 * @param fromIndex The index to start at. 0 = newest line.
+	 *
+	 * @return The index of the line (for get()), or -1 if no line at or after fromIndex contains str
+	 *
+	 * Each line has a mask of the characters it contains, so most lines that don't match are skipped
+	 * without comparing the line.
+	 */
+	int find(const char *str, size_t len, size_t fromIndex = 0) const;
+
+	/**
+	 * @brief Returns a bit mask of the characters in a string, ignoring case
+	 */
+	static uint32_t charMask(const char *str, size_t len);
+
+protected:
+	/**
+	 * @brief Get the index entry for a line. index must be < size().
+	 */
+	IndexEntry *getIndexEntry(size_t index) { return (IndexEntry *)ring.get(index); };
+	const IndexEntry *getIndexEntry(size_t index) const { return (const IndexEntry *)ring.get(index); };
+
+	/**
+	 * @brief Add the first n characters of the line at index to entry
+	 */
+	void decode(Entry &entry, size_t index, size_t n) const;
+
+	/**
+	 * @brief Store the shared prefix of a front-coded line in its own record
+	 *
+	 * @param rec The front-coded record
+	 *
+	 * @param prefixFrom The first bytes of the line that rec shares its prefix with. The bytes just
+	 * before rec in the buffer must be unused and at least rec->aux long.
+	 */
+	void expandPrefix(RecordRing::Record *rec, const char *prefixFrom);
+
+	RecordRing ring;
+	uint32_t nextSeq = 1;
+	bool moveToFront = false;
+};
+
+/**
+ * @brief Small table that counts how often commands and lines are used
+ *
+ * Strings are stored as a 32-bit hash and a count, so the table is a fixed MAX_ENTRIES * 8 bytes no
+ * matter how long the lines are. When the table is full, the least used string is replaced. Every
+ * DECAY_INTERVAL uses all of the counts are halved, so what was used recently counts for more than
+ * what was used a long time ago, and strings that are no longer used drop out of the table.
+ *
+ * A hash collision only makes two strings share a count, which just affects their order.
+ *
+ * Attach a table to an editor using SerialCommandEditorBase::withUsageTable(). A table can be shared
+ * by more than one editor. This class is not thread safe.
+ */
+class SerialCommandUsageTable {
+public:
+	/**
+	 * @brief Maximum number of different strings counted
+	 */
+	static const size_t MAX_ENTRIES = 32;
+
+	/**
+	 * @brief Number of uses between halving all of the counts
+	 */
+	static const uint16_t DECAY_INTERVAL = 64;
+
+	/**
+	 * @brief Count a use of a string
+	 */
+	void record(const char *str, size_t len) { recordHash(hash(str, len)); };
+
+	/**
+	 * @brief Count a use of a string by its hash
+	 */
+	void recordHash(uint32_t hash);
+
+	/**
+	 * @brief Returns the count for a string, which is 0 if it has not been used recently
+	 */
+	uint16_t getScore(const char *str, size_t len) const { return getScoreHash(hash(str, len)); };
+
+	/**
+	 * @brief Returns the count for a string by its hash
+	 */
+	uint16_t getScoreHash(uint32_t hash) const;
+
+	/**
+	 * @brief Halve all of the counts. This is done automatically every DECAY_INTERVAL uses.
+	 */
+	void decay();
+
+	/**
+	 * @brief Remove all counts
+	 */
+	void clear();
+
+	/**
+	 * @brief Hash a string (FNV-1a)
+	 */
+	static uint32_t hash(const char *str, size_t len);
+
+	/**
+	 * @brief Add one character to a hash, starting from HASH_INIT, for strings that are not contiguous
+	 */
+	static uint32_t hashAdd(uint32_t hash, char c) { return (hash ^ (uint8_t)c) * 16777619; };
+
+	static const uint32_t HASH_INIT = 2166136261;
+
+protected:
+	struct Entry {
+		uint32_t hash;
+		uint16_t count;
+	};
+	Entry entries[MAX_ENTRIES] = {};
+	uint16_t usesUntilDecay = DECAY_INTERVAL;
+};
+
+/**
+ * @brief Interface for saving command history so it survives reconnects and restarts
+ *
+ * Attach a store to an editor using SerialCommandEditorBase::withHistoryStore().
+ */
+class SerialCommandHistoryStore {
+public:
+	virtual ~SerialCommandHistoryStore() {};
+
+	/**
+	 * @brief Add the saved lines to history, oldest first
+	 *
+	 * The store keeps a pointer to history, which it may use later to compact the saved lines, until
+	 * detach() is called for it or another history is loaded.
+	 */
+	virtual void load(SerialCommandHistory &history) = 0;
+
+	/**
+	 * @brief Stop using a history passed to load(), which is about to be destroyed
+	 *
+	 * Does nothing if the store is not using history. The editor calls this for its own history when it's
+	 * destroyed, and the TCP server for its shared history.
+	 */
+	virtual void detach(SerialCommandHistory *) {};
+
+	/**
+	 * @brief Save a line that was just added to history
+	 */
+	virtual void append(const char *line, size_t len) = 0;
+
+	/**
+	 * @brief Remove all saved lines
+	 */
+	virtual void clear() = 0;
+
+	/**
+	 * @brief Save any lines that are waiting to be written
+	 */
+	virtual void flush() {};
+
+	/**
+	 * @brief Called from the editor loop to write lines in the background
+	 */
+	virtual void loop() {};
+
+	/**
+	 * @brief Returns the millis() value when loop() next needs to be called, or 0 if not needed
+	 */
+	virtual unsigned long nextDeadline() { return 0; };
+};
+
+#if SERIAL_COMMAND_HAS_FILESYSTEM
+/**
+ * @brief History store that appends lines to a log file
+ *
+ * Each line is a record with a 2-byte length, a CRC-16 of the line, and the line. Lines are buffered and
+ * written together after the flush delay, so typing several commands in a row causes one write. When the
+ * file would grow past the maximum size, it's rewritten with just the lines currently in history. It's not
+ * rewritten again until it's twice that size, even if the maximum size is smaller.
+ *
+ * When loading, reading stops at the first record with a bad length or CRC, such as a record that was
+ * only partially written when the device reset, and the file is rewritten on the next flush.
+ *
+ * This uses the POSIX file API, which is available on Gen 3 and later devices and on Linux.
+ */
+class SerialCommandHistoryFileStore : public SerialCommandHistoryStore {
+public:
+	/**
+	 * @brief Construct a store
+	 *
+	 * @param path Path to the log file. A temporary file with .tmp appended is used when compacting.
+	 */
+	SerialCommandHistoryFileStore(const char *path);
+
+	/**
+	 * @brief Destructor. Lines waiting to be written are appended to the file, but it's not compacted.
+	 */
+	virtual ~SerialCommandHistoryFileStore();
+
+	/**
+	 * @brief How long to wait after a line is added before writing it (default 2000)
+	 */
+	SerialCommandHistoryFileStore &withFlushDelay(unsigned long ms) { flushDelayMs = ms; return *this; };
+
+	/**
+	 * @brief File size that causes the file to be compacted (default 4096)
+	 */
+	SerialCommandHistoryFileStore &withMaxFileSize(size_t size) { maxFileSize = size; return *this; };
+
+	virtual void load(SerialCommandHistory &history);
+
+	virtual void detach(SerialCommandHistory *history);
+
+	virtual void append(const char *line, size_t len);
+
+	virtual void clear();
+
+	virtual void flush();
+
+	virtual void loop();
+
+	virtual unsigned long nextDeadline() { return flushDeadline; };
+
+	/**
+	 * @brief Returns the size of the log file in bytes
+	 */
+	size_t getFileSize() const { return fileSize; };
+
+	/**
+	 * @brief Calculate a CRC-16 (CCITT)
+	 */
+	static uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0xffff);
+
+	/**
+	 * @brief Size of the buffer used to combine lines into one write
+	 */
+	static const size_t WRITE_BUFFER_SIZE = 128;
+
+	/**
+	 * @brief Size of the record header (length and CRC)
+	 */
+	static const size_t RECORD_HEADER_SIZE = 4;
+
+protected:
+	/**
+	 * @brief Add bytes to the write buffer, writing it first if it's full
+	 */
+	void bufferBytes(const uint8_t *data, size_t len);
+
+	/**
+	 * @brief Append the write buffer to the file
+	 *
+	 * @return false if the file could not be written, in which case it will be rewritten from history
+	 * on the next flush
+	 */
+	bool writeBuffer();
+
+	/**
+	 * @brief Replace the file with the lines currently in history
+	 *
+	 * If there's no history (see detach()), the lines waiting to be written are appended instead.
+	 */
+	void compact();
+
+	String path;
+	SerialCommandHistory *history = NULL;
+	unsigned long flushDelayMs = 2000;
+	size_t maxFileSize = 4096;
+	size_t fileSize = 0;
+	size_t compactedSize = 0;
+	bool needCompact = false;
+	unsigned long flushDeadline = 0;
+	uint8_t writeBuf[WRITE_BUFFER_SIZE];
+	size_t writeOffset = 0;
+	int writeFd = -1;
+};
+#endif /* SERIAL_COMMAND_HAS_FILESYSTEM */
+
+class SerialCommandEditorBase : public SerialCommandParserBase {
+public:
+	enum class ScrollView {
+		HOME,
+		LEFT_EDGE,
+		VISIBLE,
+		RIGHT_EDGE,
+		END
+	};
+	enum class TerminalType {
+		UNKNOWN,
+		DUMB,
+		ANSI
+	};
+
+	SerialCommandEditorBase(char *historyBuffer, size_t historyBufferSize, SerialCommandHistory::IndexEntry *historyIndex, size_t historyIndexSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize);
+	virtual ~SerialCommandEditorBase();
+
+	/**
+	 * @brief Clear the data in the processor
+	 *
+	 * You normal don't need to call this as it's cleared after processing a command. This is
+	 * used during unit testing.
+	 */
+	virtual void clear();
+
+	void cursorUp(int n = 1) { printTerminalOutputSequence(n, 'A'); };
+
+	void cursorDown(int n = 1) { printTerminalOutputSequence(n, 'B'); };
+
+	void cursorForward(int n = 1) { printTerminalOutputSequence(n, 'C'); };
+
+	void cursorBack(int n = 1) { printTerminalOutputSequence(n, 'D'); };
+
+	void eraseScreen(int n = 2) { printTerminalOutputSequence(n, 'J'); if (n != 1) { suggestDrawn = 0; } };
+
+	void eraseToBeginningOfScreen() { eraseScreen(1); };
+
+	void eraseToEndOfScreen() { eraseScreen(0); };
+
+	void eraseLine(int n = 2) { printTerminalOutputSequence(n, 'K'); if (n != 1) { suggestDrawn = 0; } };
+
+	void eraseToBeginningOfLine() { eraseLine(1); };
+
+	void eraseToEndOfLine() { eraseLine(0); };
+
+	/**
+	 * @brief Set text attributes (SGR), such as 0 = normal, 2 = dim, 7 = reverse
+	 */
+	void setGraphicRendition(int n = 0) { printTerminalOutputSequence(n, 'm'); };
+
+
+	/**
+	 * @brief Gets the cursor position using the Device Status Report (DSR)
+	 */
+	void getCursorPosition(std::function<void(int row, int col)> callback = 0);
+
+	/**
+	 * @brief Set cursor position (1 based, upper left is 1, 1)
+	 */
+	void setCursorPosition(int row, int col);
+
+	void printTerminalOutputSequence(int n, char c);
+
+	void getScreenSize();
+
+	/**
+	 * @brief Set the screen size when it's known from the connection, such as from telnet NAWS
+	 *
+	 * If the editor is waiting for the screen size, editing starts right away as an ANSI terminal. If editing
+	 * has already started, the line is redrawn for the new size.
+	 */
+	void setScreenSize(int rows, int cols);
+
+	/**
+	 * @brief Returns the number of rows on the screen, or 0 if not known
+	 */
+	int getScreenRows() const { return screenRows; };
+
+	/**
+	 * @brief Returns the number of columns on the screen, or 0 if not known
+	 */
+	int getScreenCols() const { return screenCols; };
+
+	/**
+	 * @brief Whether to ask the terminal for its screen size using escape sequences (default: true)
+	 *
+	 * When false, getScreenSize() only waits up to SCREEN_SIZE_TIMEOUT_MS for setScreenSize() to be called.
+	 * Setting it back to true while waiting sends the escape sequences and restarts the wait.
+	 */
+	SerialCommandEditorBase &withScreenSizeProbe(bool value);
+
+	/**
+	 * @brief Receive whole lines edited by the client instead of individual keys (default: false)
+	 *
+	 * For clients that edit and echo the line themselves, like telnet in LINEMODE. Characters are added to
+	 * the line without echo, key bindings or escape sequences, and the line is processed at CR or LF, the same
+	 * as a dumb terminal. This avoids a round trip per key on high-latency links.
+	 */
+	SerialCommandEditorBase &withLineInput(bool value = true);
+
+	virtual void startEditing();
+
+	void handleConnected(bool isConnected);
+
+	void loop();
+
+	/**
+	 * @brief Returns the millis() value at which loop() next needs to be called, or 0 if there is no timer pending
+	 *
+	 * In addition to the base class behavior, this includes the ESC key timeout and the screen size
+	 * detection timeout.
+	 */
+	virtual unsigned long nextDeadline();
+
+	virtual void filterChar(char c);
+
+	/**
+	 * @brief Handle a control character or special key
+	 *
+	 * @param key The key code (control character or one of the negative KEY_ codes)
+	 *
+	 * @param modifiers SerialCommandKeymap::MOD_NONE, MOD_ALT, MOD_CTRL, or both.
+	 *
+	 * The action is looked up in the keymap and passed to performAction().
+	 */
+	void handleSpecialKey(char key, uint8_t modifiers = SerialCommandKeymap::MOD_NONE);
+
+	/**
+	 * @brief Perform an editor action
+	 *
+	 * @param action The action to perform
+	 *
+	 * @param key The key that was pressed. Custom actions may use this.
+	 *
+	 * You can override this to add additional built-in actions.
+	 */
+	virtual void performAction(SerialCommandKeymap::Action action, char key);
+
+	/**
+	 * @brief Set the keymap to use instead of the default shared keymap
+	 *
+	 * @param keymap The keymap. It's not copied, so it must remain valid for the life of the editor.
+	 * It can be shared between editors.
+	 */
+	SerialCommandEditorBase &withKeymap(SerialCommandKeymap *keymap) { this->keymap = keymap; return *this; };
+
+	/**
+	 * @brief Get the keymap used by this editor
+	 */
+	SerialCommandKeymap *getKeymap() { return keymap; };
+
+	/**
+	 * @brief Wrap long lines onto multiple screen rows instead of scrolling horizontally
+	 *
+	 * @param value true to wrap (default is false, horizontal scrolling)
+	 *
+	 * In wrap mode the line flows onto as many rows as needed below the prompt and the screen
+	 * scrolls up if it reaches the bottom. The row and column of each character is calculated
+	 * from the prompt position and screen width, so only the rows from the first changed
+	 * character onward are rewritten after an edit.
+	 */
+	SerialCommandEditorBase &withWrapMode(bool value = true) { wrapMode = value; horizScroll = 0; return *this; };
+
+	/**
+	 * @brief Returns true if wrap mode is enabled
+	 */
+	bool getWrapMode() const { return wrapMode; };
+
+	/**
+	 * @brief Suggest the rest of a line from history as you type (default is false)
+	 *
+	 * @param value true to show suggestions
+	 *
+	 * When the cursor is at the end of the line, the rest of the newest history line that starts with
+	 * what's been typed is shown dimmed after the cursor. Right arrow or End accepts it. Suggestions
+	 * are not shown in wrap mode.
+	 */
+	SerialCommandEditorBase &withSuggestions(bool value = true) { suggestEnabled = value; return *this; };
+
+	/**
+	 * @brief Returns the suggested text after the cursor, or an empty string if there is no suggestion
+	 */
+	String getSuggestion();
+
+	virtual void handlePrompt();
+
+	virtual void handlePromptWithCallback(std::function<void()> handlePromptCallback);
+
+	virtual void handleCompletion();
+
+	void setBuffer(const char *str, bool atEnd = false);
+
+	/**
+	 * @brief Replace the line being edited with a line from history
+	 */
+	void setBuffer(const SerialCommandHistory::Entry &entry, bool atEnd = false);
+
+	virtual void processChar(char c);
+
+	void scrollToView(ScrollView which, bool forceRedraw);
+
+	void redraw(int fromPos = 0);
+
+	void setCursor();
+
+	void printMessage(const char *fmt, ...);
+
+	void printMessageNoPrompt(const char *fmt, ...);
+
+	void vprintMessage(bool prompt, const char *fmt, va_list ap);
+
+	void printMessagePrompt();
+
+	void setTerminalType(TerminalType terminalType) { this->terminalType = terminalType; }
+
+	/**
+	 * @brief Insert characters into the line being edited, saving the change in the undo log
+	 *
+	 * @param pos Position in buffer to insert at
+	 *
+	 * @param str Characters to insert (does not need to be null terminated)
+	 *
+	 * @param len Number of characters to insert
+	 *
+	 * @return The number of characters inserted, which may be less than len if the buffer is full.
+	 *
+	 * This only changes the buffer; the caller is responsible for updating cursorPos and the display.
+	 */
+	size_t editInsert(size_t pos, const char *str, size_t len);
+
+	/**
+	 * @brief Delete characters from the line being edited, saving the change in the undo log
+	 *
+	 * @param pos Position in buffer to delete from
+	 *
+	 * @param len Number of characters to delete
+	 *
+	 * This only changes the buffer; the caller is responsible for updating cursorPos and the display.
+	 */
+	void editDelete(size_t pos, size_t len);
+
+	/**
+	 * @brief Undo the most recent edit to the line
+	 *
+	 * @return true if an edit was undone, false if there was nothing to undo
+	 */
+	bool undo();
+
+	/**
+	 * @brief Redo the most recently undone edit
+	 *
+	 * @return true if an edit was redone, false if there was nothing to redo
+	 */
+	bool redo();
+
+	/**
+	 * @brief Discard the undo log. This is done automatically when a line is entered or replaced.
+	 */
+	void undoClear();
+
+	/**
+	 * @brief Delete characters from the line, saving them in the kill ring so they can be yanked
+	 *
+	 * @param pos Position in buffer to delete from
+	 *
+	 * @param len Number of characters to delete
+	 */
+	void killText(size_t pos, size_t len);
+
+	/**
+	 * @brief Insert the most recently killed text at the cursor (Ctrl-Y)
+	 *
+	 * @return true if text was inserted, false if the kill ring is empty
+	 */
+	bool yank();
+
+	/**
+	 * @brief Replace the text inserted by yank() with the next older kill ring entry (Alt-Y)
+	 *
+	 * @return true if text was replaced, false if the previous action was not a yank
+	 */
+	bool yankPop();
+
+	/**
+	 * @brief Find the start of the word at or before pos (letters and digits)
+	 *
+	 * Only the characters between the word and pos are examined.
+	 */
+	size_t findWordStart(size_t pos);
+
+	/**
+	 * @brief Find the end of the word at or after pos (letters and digits)
+	 */
+	size_t findWordEnd(size_t pos);
+
+	/**
+	 * @brief Start buffering output so it's written to the stream in a single write
+	 *
+	 * Calls can be nested; the output is written when the outermost endFrame() is called,
+	 * or when the frame buffer fills. filterChar() does this for each character of input.
+	 */
+	void beginFrame() { frameDepth++; };
+
+	/**
+	 * @brief End buffering output started with beginFrame()
+	 */
+	void endFrame();
+
+	/**
+	 * @brief Override Print. Output is buffered between beginFrame() and endFrame().
+	 */
+	virtual size_t write(uint8_t c);
+
+	/**
+	 * @brief Override Print. Output is buffered between beginFrame() and endFrame().
+	 */
+	virtual size_t write(const uint8_t *buf, size_t size);
+
+	using Print::write;
+
+	void historyAdd(const char *line, bool temporary = false);
+	String historyGet(int index);
+	int historySize();
+	void historyClear();
+	void historyRemoveFirst();
+	void historyRemoveLast();
+
+	/**
+	 * @brief Get the command history for this editor
+	 */
+	SerialCommandHistory &getHistory() { return *history; };
+
+	/**
+	 * @brief Use a history object that can be shared with other editors
+	 *
+	 * @param history The history. It's not copied and must remain valid for the life of the editor. Pass NULL
+	 * to go back to the history in the buffer passed to the constructor.
+	 *
+	 * @param store Optional store to save lines added by this editor. Unlike withHistoryStore(), this
+	 * does not load the saved lines, since that's done once for the shared history.
+	 *
+	 * Each editor keeps its own position when going through history with the up and down arrows, and
+	 * its own copy of the line that was being edited, so editors don't affect each other. Lines added by
+	 * any editor are seen by all of them. Shared history is not cleared when a connection opens.
+	 */
+	SerialCommandEditorBase &withHistory(SerialCommandHistory *history, SerialCommandHistoryStore *store = NULL);
+
+	/**
+	 * @brief Count how often commands and lines are used to rank completions and history (optional)
+	 *
+	 * @param table The table. It's not copied and must remain valid for the life of the editor. It can be
+	 * shared by more than one editor.
+	 *
+	 * When a line is entered, the line and its command name are counted. Listing completions with a
+	 * second Tab shows the most used first, and Page Up and Page Down go through history from the most
+	 * used line to the least used.
+	 */
+	SerialCommandEditorBase &withUsageTable(SerialCommandUsageTable *table) { usageTable = table; return *this; };
+
+	/**
+	 * @brief Returns the usage score of a history line, or 0 if there is no usage table
+	 *
+	 * @param index 0 = the newest line, 1 = the one before that, ...
+	 */
+	uint16_t historyScore(size_t index) const;
+
+	/**
+	 * @brief Save history using a store, and load the previously saved history now
+	 *
+	 * @param store The store. It's not copied and must remain valid for the life of the editor.
+	 *
+	 * When a store is used, history is kept when the connection is closed and reopened.
+	 */
+	SerialCommandEditorBase &withHistoryStore(SerialCommandHistoryStore *store);
+
+	/**
+	 * @brief Start an incremental reverse search of history (Ctrl-R)
+	 *
+	 * Typed characters are added to the search string and the newest matching line is shown in place of
+	 * the line being edited. Ctrl-R again finds the next older match and backspace removes the last search
+	 * character. Ctrl-G or ESC cancels the search. Any other key accepts the match as the line being edited
+	 * and then performs its usual action, so Enter runs the matched command.
+	 */
+	void searchStart();
+
+	/**
+	 * @brief Returns true if a reverse search is in progress
+	 */
+	bool isSearching() const { return searching; };
+
+	static const char KEY_CTRL_A = 1;
+	static const char KEY_CTRL_B = 2;
+	static const char KEY_CTRL_C = 3;
+	static const char KEY_CTRL_D = 4;
+	static const char KEY_CTRL_E = 5;
+	static const char KEY_CTRL_F = 6;
+	static const char KEY_CTRL_G = 7;
+	static const char KEY_CTRL_H = 8;
+	static const char KEY_BACKSPACE = 8; // ^H Mac uses KEY_DELETE not KEY_BACKSPACE
+	static const char KEY_CTRL_I = 9;
+	static const char KEY_TAB = 9; // ^I
+	static const char KEY_CTRL_J = 10;
+	static const char KEY_LF = 10; // ^J
+	static const char KEY_CTRL_K = 11;
+	static const char KEY_CTRL_L = 12;
+	static const char KEY_CTRL_M = 13;
+	static const char KEY_CR = 13; // ^M
+	static const char KEY_CTRL_N = 14;
+	static const char KEY_CTRL_O = 15;
+	static const char KEY_CTRL_P = 16;
+	static const char KEY_CTRL_Q = 17;
+	static const char KEY_CTRL_R = 18;
+	static const char KEY_CTRL_S = 19;
+	static const char KEY_CTRL_T = 20;
+	static const char KEY_CTRL_U = 21;
+	static const char KEY_CTRL_V = 22;
+	static const char KEY_CTRL_W = 23;
+	static const char KEY_CTRL_X = 24;
+	static const char KEY_CTRL_Y = 25;
+	static const char KEY_CTRL_Z = 26;
+	static const char KEY_ESC = 27; // 0x1b
+	static const char KEY_CTRL_CARET = 30; // ^^ (Ctrl-Shift-6 on most keyboards)
+	static const char KEY_CTRL_UNDERSCORE = 31; // ^_ (Ctrl-Shift-- on most keyboards)
+	static const char KEY_DELETE = 127; // Note: different than Forward Delete (
+
+	static const char KEY_HOME = -1;
+	static const char KEY_INSERT = -2;
+	static const char KEY_FORWARD_DELETE = -3; // Key in the cursor keypad near Home, End, etc.
+	static const char KEY_END = -4;
+	static const char KEY_PAGE_UP = -5;
+	static const char KEY_PAGE_DOWN = -6;
+	static const char KEY_UP = -50;
+	static const char KEY_DOWN = -51;
+	static const char KEY_LEFT = -52;
+	static const char KEY_RIGHT = -53;
+
+	/**
+	 * @brief How long to wait after an ESC for the rest of an escape sequence before treating it as the ESC key
+	 */
+	static const unsigned long ESCAPE_TIMEOUT_MS = 10;
+
+	/**
+	 * @brief How long to wait for the terminal to report the screen size before treating it as a dumb terminal
+	 */
+	static const unsigned long SCREEN_SIZE_TIMEOUT_MS = 500;
+
+	/**
+	 * @brief Number of bytes of inserted or deleted text kept in the undo log
+	 */
+	static const size_t UNDO_BUFFER_SIZE = 128;
+
+	/**
+	 * @brief Maximum number of edits kept in the undo log. Consecutive typing within a word is one edit.
+	 */
+	static const size_t UNDO_MAX_RECORDS = 16;
+
+	/**
+	 * @brief Number of bytes of killed text kept for yank
+	 */
+	static const size_t KILL_RING_SIZE = 128;
+
+	/**
+	 * @brief Maximum number of kills kept for yank and yank-pop
+	 */
+	static const size_t KILL_RING_MAX_RECORDS = 8;
+
+	/**
+	 * @brief Size of the buffer used to combine output into a single write
+	 */
+	static const size_t FRAME_BUFFER_SIZE = 64;
+
+	/**
+	 * @brief Maximum length of the reverse search string
+	 */
+	static const size_t SEARCH_STRING_SIZE = 32;
+
+protected:
+	/**
+	 * @brief Save an edit in the undo log, merging it with the previous edit when contiguous
+	 */
+	void undoRecord(bool isInsert, size_t pos, const char *data, size_t len);
+
+	/**
+	 * @brief Redraw after an edit at fromPos, only rewriting from fromPos when the line doesn't need to scroll
+	 */
+	void redrawFrom(int fromPos);
+
+	/**
+	 * @brief Called after the whole buffer is replaced to reset the undo log and redraw the line
+	 */
+	void bufferReplaced(bool atEnd);
+
+	/**
+	 * @brief Handle a key during reverse search
+	 *
+	 * @return true if the key was used by the search, false if the search ended and the key should be
+	 * handled normally
+	 */
+	bool searchKey(char key, SerialCommandKeymap::Action action);
+
+	/**
+	 * @brief Add a character to the search string, continuing from the current match
+	 */
+	void searchAddChar(char c);
+
+	/**
+	 * @brief Returns the index of the current match, or -1 if there isn't one or it's no longer in history
+	 */
+	int searchMatchIndex() const;
+
+	/**
+	 * @brief Returns the index of the newest line older than the current match, or 0 if there's no match
+	 */
+	size_t searchOlderIndex() const;
+
+	/**
+	 * @brief Find the next match starting at fromIndex and render the search line
+	 */
+	void searchFind(size_t fromIndex);
+
+	/**
+	 * @brief End the search, keeping the matched line if accept is true, and restore the prompt
+	 */
+	void searchEnd(bool accept);
+
+	/**
+	 * @brief Draw the search string and match in place of the prompt and line
+	 */
+	void searchRender();
+
+	/**
+	 * @brief The word before the cursor that Tab completes
+	 */
+	struct CompletionWord {
+		size_t tokenIndex = 0; //!< 0 = the command name
+		String prefix; //!< The word with quotes and backslash escapes removed
+		CommandHandlerInfo *chi = NULL; //!< The command, if tokenIndex > 0
+		const CommandOption *option = NULL; //!< If the word is an argument to an option, the option
+		size_t argIndex = 0; //!< Index of the argument to the command or option
+	};
+
+	/**
+	 * @brief Find the word to complete using the same token boundaries as when the line is parsed
+	 *
+	 * @return false if the word can't be completed, such as when the command is not known
+	 */
+	bool findCompletionWord(CompletionWord &word);
+
+	/**
+	 * @brief Call fn for each possible completion of a word
+	 *
+	 * Candidates are generated one at a time by the command index, the option list, or the completer,
+	 * so no list of them is kept.
+	 */
+	void completionCandidates(const CompletionWord &word, const std::function<void(const char *candidate)> &fn);
+
+	/**
+	 * @brief Insert completed text at the end of the line, escaping characters that would end the token
+	 */
+	void completionInsert(const char *str);
+
+	/**
+	 * @brief Go to the history line with the next lower (or higher) usage score, ties going to the newest
+	 *
+	 * @param lessUsed true to go to the next less used line (Page Up), false for the next more used line
+	 */
+	void historyMostUsed(bool lessUsed);
+
+	/**
+	 * @brief Count the use of a line and its command name in the usage table
+	 */
+	void usageRecord(char *line);
+
+	/**
+	 * @brief List the possible completions in columns, one screenful at a time, the most used first
+	 *
+	 * @param from Index of the first match to list. If there are more matches than fit on the screen,
+	 * --More-- is shown and completionMoreKey() handles the next key.
+	 */
+	void listCompletions(size_t from);
+
+	/**
+	 * @brief Handle a key at the --More-- prompt. Space or Tab shows the next page and any other key stops.
+	 */
+	void completionMoreKey(char key);
+
+	/**
+	 * @brief Record that the buffer changed starting at pos so the next wrapped redraw starts there
+	 *
+	 * This also tells the suggestion search whether characters were only added to the end.
+	 */
+	void markDirty(int pos) { if (dirtyPos < 0 || pos < dirtyPos) { dirtyPos = pos; } if (pos < (int)suggestFor) { suggestFor = 0; } };
+
+	/**
+	 * @brief Find and draw the history suggestion for the line after a key is handled
+	 *
+	 * If characters were only added to the end of the line since the last call, the search continues
+	 * from the last match, since newer lines didn't match the shorter line. The dimmed text is only
+	 * appended or erased, so the rest of the line is not redrawn.
+	 */
+	void suggestUpdate();
+
+	/**
+	 * @brief Insert the suggested text into the line
+	 *
+	 * @return true if there was a suggestion
+	 */
+	bool suggestAccept();
+
+	/**
+	 * @brief Erase the suggestion from the screen, if it's drawn
+	 */
+	void suggestErase();
+
+	/**
+	 * @brief Returns the history index of the current suggestion, or -1 if there is none
+	 */
+	int suggestIndex() const;
+
+	/**
+	 * @brief Screen row of a buffer position in wrap mode
+	 */
+	int wrapRow(int pos) const { return editRow + (editCol - 1 + pos) / screenCols; };
+
+	/**
+	 * @brief Screen column of a buffer position in wrap mode
+	 */
+	int wrapCol(int pos) const { return (editCol - 1 + pos) % screenCols + 1; };
+
+	/**
+	 * @brief Scroll the screen up if the wrapped line would extend past the bottom row
+	 */
+	void wrapEnsureRows();
+
+	/**
+	 * @brief Redraw in wrap mode, rewriting only the rows from the first changed character
+	 */
+	void redrawWrapped(int fromPos);
+
+	/**
+	 * @brief Write the frame buffer to the stream
+	 */
+	void flushFrame();
+
+	/**
+	 * @brief Override to let an owned history grow. Called before adding a line of len bytes to it.
+	 *
+	 * The default does nothing, so older lines are discarded once the history buffer is full.
+	 */
+	virtual void growHistory(size_t) {};
+
+	/**
+	 * @brief Flags stored in RecordRing::Record::flags for undo log records
+	 */
+	static const uint8_t UNDO_FLAG_INSERT = 0x01;
+	static const uint8_t UNDO_FLAG_BACKWARD = 0x02; // Deleted with backspace, bytes stored last to first
+
+	SerialCommandHistory ownHistory; // In the buffer passed to the constructor, with no storage if there is none
+	SerialCommandHistory *history = &ownHistory; // ownHistory, or the shared history from withHistory()
+	SerialCommandHistoryStore *historyStore = NULL;
+	SerialCommandUsageTable *usageTable = NULL;
+	uint32_t historyCursor = 0;
+	String savedLine;
+	char keyEscapeBuf[10];
+	size_t keyEscapeOffset = 0;
+	bool gettingScreenSize = false;
+	bool screenSizeProbe = true;
+	bool lineInput = false;
+	int screenRows = 0;
+	int screenCols = 0;
+	unsigned long lastKeyMillis = 0;
+	unsigned long startScreenSizeMillis = 0;
+	TerminalType terminalType = TerminalType::UNKNOWN;
+	int editRow = 0;
+	int editCol = 0;
+	int cursorPos = 0;
+	int horizScroll = 0;
+	bool wrapMode = false;
+	int wrapRowsDrawn = 1;
+	int dirtyPos = -1;
+	bool suggestEnabled = false;
+	uint32_t suggestSeq = 0;
+	size_t suggestFor = 0;
+	size_t suggestDrawn = 0;
+	uint32_t suggestDrawnSeq = 0;
+	bool searching = false;
+	bool searchFailed = false;
+	char searchString[SEARCH_STRING_SIZE];
+	size_t searchLen = 0;
+	uint32_t searchSeq = 0; // Sequence number of the match, 0 if none
+	uint32_t searchNewestSeq = 0; // Newest line when the search last started from the newest line
+	bool completionAmbiguous = false;
+	int completionListFrom = -1;
+	bool promptRendered = false;
+	SerialCommandKeymap *keymap = SerialCommandKeymap::getDefault();
+	char undoData[UNDO_BUFFER_SIZE];
+	RecordRing::Record undoRecords[UNDO_MAX_RECORDS];
+	RecordRing undoLog;
+	size_t undoRedoCount = 0;
+	bool undoSealed = true;
+	char killData[KILL_RING_SIZE];
+	RecordRing::Record killRecords[KILL_RING_MAX_RECORDS];
+	RecordRing killRing;
+	size_t yankIndex = 0;
+	size_t yankPos = 0;
+	size_t yankLen = 0;
+	SerialCommandKeymap::Action lastAction = SerialCommandKeymap::Action::NONE;
+	uint8_t frameBuffer[FRAME_BUFFER_SIZE];
+	size_t frameOffset = 0;
+	int frameDepth = 0;
+	std::function<void(int row, int col)> positionCallback = 0;
+	std::function<void()> handlePromptCallback = 0;
+};
+
+/**
+ * @brief Line editor with static buffers
+ *
+ * HISTORY_ENTRIES is the maximum number of lines in history. The default is one for every
+ * SerialCommandHistory::BYTES_PER_ENTRY bytes of history buffer, and each uses sizeof(SerialCommandHistory::IndexEntry)
+ * bytes of RAM, so use a smaller number to save RAM when the lines are long.
+ */
+template<size_t HISTORY_BUFFER_SIZE, size_t BUFFER_SIZE, size_t MAX_ARGS, size_t HISTORY_ENTRIES = SerialCommandHistory::indexSize(HISTORY_BUFFER_SIZE)>
+class SerialCommandEditor : public SerialCommandEditorBase, public SerialCommandConfig {
+public:
+	SerialCommandEditor() : SerialCommandEditorBase(staticHistoryBuffer, HISTORY_BUFFER_SIZE, staticHistoryIndex, HISTORY_ENTRIES, staticBuffer, BUFFER_SIZE, staticArgsBuffer, MAX_ARGS) {
+		staticHistoryBuffer[0] = 0;
+		withConfig(this);
+	};
+	virtual ~SerialCommandEditor() {};
+
+
+protected:
+	char staticHistoryBuffer[HISTORY_BUFFER_SIZE];
+	SerialCommandHistory::IndexEntry staticHistoryIndex[HISTORY_ENTRIES];
+	char staticBuffer[BUFFER_SIZE];
+	char *staticArgsBuffer[MAX_ARGS];
+};
+
+#if SERIAL_COMMAND_HAS_TCP_SERVER
 
-	void historyAdd(const char *line, bool temporary = false);
-	String historyGet(int index);
-	int historySize();
-	void historyClear();
-	void historyRemoveFirst();
-	void historyRemoveLast();
+class SerialCommandTCPServer; // Forward declaration
 
-	static const char KEY_CTRL_A = 1;
-	static const char KEY_CTRL_B = 2;
-	static const char KEY_CTRL_C = 3;
-	static const char KEY_CTRL_D = 4;
-	static const char KEY_CTRL_E = 5;
-	static const char KEY_CTRL_F = 6;
-	static const char KEY_CTRL_G = 7;
-	static const char KEY_CTRL_H = 8;
-	static const char KEY_BACKSPACE = 8; // ^H Mac uses KEY_DELETE not KEY_BACKSPACE
-	static const char KEY_CTRL_I = 9;
-	static const char KEY_TAB = 9; // ^I
-	static const char KEY_CTRL_J = 10;
-	static const char KEY_LF = 10; // ^J
-	static const char KEY_CTRL_K = 11;
-	static const char KEY_CTRL_L = 12;
-	static const char KEY_CTRL_M = 13;
-	static const char KEY_CR = 13; // ^M
-	static const char KEY_CTRL_N = 14;
-	static const char KEY_CTRL_O = 15;
-	static const char KEY_CTRL_P = 16;
-	static const char KEY_CTRL_Q = 17;
-	static const char KEY_CTRL_R = 18;
-	static const char KEY_CTRL_S = 19;
-	static const char KEY_CTRL_T = 20;
-	static const char KEY_CTRL_U = 21;
-	static const char KEY_CTRL_V = 22;
-	static const char KEY_CTRL_W = 23;
-	static const char KEY_CTRL_X = 24;
-	static const char KEY_CTRL_Y = 25;
-	static const char KEY_CTRL_Z = 26;
-	static const char KEY_ESC = 27; // 0x1b
-	static const char KEY_DELETE = 127; // Note: different than Forward Delete (
+/**
+ * @brief Editor used by SerialCommandTCPServer sessions
+ *
+ * When the server uses growable buffers, the line buffer starts small and doubles as needed, up to the
+ * server's bufferSize, and the history buffer is allocated when the first command is added and doubles
+ * up to historyBufSize. Grown buffers count against the server's memory budget and are freed by
+ * releaseBuffers().
+ */
+class SerialCommandTCPEditor : public SerialCommandEditorBase {
+public:
+	SerialCommandTCPEditor(SerialCommandTCPServer *server, bool growHistory, char *historyBuffer, size_t historyBufferSize, SerialCommandHistory::IndexEntry *historyIndex, size_t historyIndexSize, char *buffer, size_t bufferSize, char **argsBuffer, size_t argsBufferSize);
+	virtual ~SerialCommandTCPEditor();
+
+	/**
+	 * @brief Free grown buffers and go back to the initial line buffer and an empty history
+	 */
+	void releaseBuffers();
+
+protected:
+	virtual void growBuffer(size_t size);
+	virtual void growHistory(size_t len);
+
+	SerialCommandTCPServer *server;
+	char *initialBuffer;
+	size_t initialBufferSize;
+	char *historyStorage = 0;
+	bool growableHistory;
+};
+
+/**
+ * @brief One session of a SerialCommandTCPServer
+ *
+ * The session is the Stream its editor reads and writes. Output goes into a bounded queue for the session,
+ * and the server sends the queues of all sessions round-robin from loop() so a slow client can't hold up
+ * the others. On Linux, input is read from the socket when epoll reports it's readable, and a session whose
+ * socket is full waits until epoll reports it's writable.
+ */
+class SerialCommandTCPClient : public Stream {
+public:
+	/**
+	 * @brief Output queue statistics for a session
+	 */
+	struct OutputStats {
+		size_t queueDepth;			//!< Bytes waiting to be sent now
+		size_t maxQueueDepth;		//!< Most bytes waiting at once since the connection started
+		uint32_t bytesSent;			//!< Bytes sent since the connection started
+		uint32_t bytesDropped;		//!< Bytes discarded because the queue was full
+		uint32_t stallCount;		//!< Number of times the client could not take all of the queued output
+		unsigned long stalledMs;	//!< How long the session has been stalled, or 0 if it's not
+	};
+
+	/**
+	 * @brief Construct a session. Normally the server does this using placement new at the start of a pool slot.
+	 *
+	 * @param server The server this session belongs to
+	 *
+	 * @param block The memory after the session object in its slot, which setup() uses for the editor and
+	 * its buffers. Must be at least SerialCommandTCPServer::getSessionSize() - sizeof(SerialCommandTCPClient) bytes.
+	 */
+	SerialCommandTCPClient(SerialCommandTCPServer *server, char *block);
+	virtual ~SerialCommandTCPClient();
+
+	void setup();
+	void loop();
+
+#if SERIAL_COMMAND_TCP_EPOLL
+	/**
+	 * @brief Start a session on a connected, non-blocking socket. The session closes it when done.
+	 */
+	void setClient(int fd);
+
+	bool isConnected() { return fd >= 0; };
+
+	/**
+	 * @brief Handle the events epoll reported for the socket
+	 */
+	void handleEvents(uint32_t events);
+
+	/**
+	 * @brief Size of the buffer for data read from the socket and not yet processed
+	 */
+	static const size_t IN_BUFFER_SIZE = 128;
+#else
+	void setClient(TCPClient client);
+
+	bool isConnected() { return client.connected(); };
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
+	void stop();
+
+	// Stream
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual void flush();
+	virtual size_t write(uint8_t c);
+	virtual size_t write(const uint8_t *buf, size_t size);
+
+	using Print::write;
+
+	/**
+	 * @brief Size of the output queue a session starts with
+	 *
+	 * When a command writes more than fits, the queue grows up to SerialCommandTCPServer::withOutputQueueLimit().
+	 * While more than this is queued, the session's input isn't processed, so a client that reads slowly holds
+	 * back its own commands instead of queueing more output. Only output past the limit is discarded, and it's
+	 * counted in OutputStats::bytesDropped.
+	 */
+	static const size_t OUT_BUFFER_SIZE = 1024;
+
+	/**
+	 * @brief How long to wait before trying to send to a stalled client again, in milliseconds (Particle only)
+	 */
+	static const unsigned long OUTPUT_RETRY_MS = 10;
+
+	/**
+	 * @brief Send up to maxBytes of queued output without waiting
+	 *
+	 * @return The number of bytes sent
+	 */
+	size_t sendQueued(size_t maxBytes);
+
+	/**
+	 * @brief Returns true if there is output in the queue and the client may be able to take it
+	 */
+	bool canSend() const;
+
+	/**
+	 * @brief Returns the number of bytes of output waiting to be sent
+	 */
+	size_t getQueueDepth() const { return outLen + mirrorPending(); };
+
+	/**
+	 * @brief Get the output queue statistics
+	 */
+	void getOutputStats(OutputStats &stats) const;
+
+	/**
+	 * @brief Returns the millis() value at which queued output can next be sent, or 0 if there's nothing to send
+	 * or the session is waiting for epoll to report the socket writable
+	 */
+	unsigned long outputDeadline() const;
+
+	/**
+	 * @brief Returns the millis() value at which loop() next needs to be called, or 0 if there is no timer pending
+	 */
+	unsigned long nextDeadline();
+
+	/**
+	 * @brief Returns true if there is input waiting or a disconnection that needs to be handled
+	 */
+	bool hasPendingInput();
+
+	bool isAllocated() const;
+
+	SerialCommandEditorBase *getEditor() { return editor; };
+	SerialCommandParserBase *getParser() { return editor; };
+
+	/**
+	 * @brief Returns true if this session is an observer of another session, see SerialCommandTCPServer::attachObserver()
+	 */
+	bool isObserving() const { return observing != NO_SESSION; };
+
+protected:
+	/**
+	 * @brief Send bytes to the client without waiting
+	 *
+	 * @return The number of bytes the client took. If it's less than size, the session is stalled.
+	 */
+	size_t sendRaw(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Record that the client couldn't take all of the queued output
+	 */
+	void stalled();
+
+	/**
+	 * @brief Reset the output queue and statistics for a new connection
+	 */
+	void resetOutput();
+
+	/**
+	 * @brief Make room for size more bytes in the output queue, growing it if needed
+	 *
+	 * @return true if the bytes fit, false if the queue is at its limit
+	 */
+	bool reserveOutput(size_t size);
+
+	/**
+	 * @brief Move the output queue to a larger buffer so it can hold needed bytes, up to the server's limit
+	 */
+	void growOutput(size_t needed);
+
+	/**
+	 * @brief Move the output queue back to outData and free the grown buffer, if the queued output fits
+	 */
+	void shrinkOutput();
+
+	/**
+	 * @brief Stop or resume processing the session's input, for backpressure when the output queue is full
+	 */
+	void pauseInput(bool pause);
+
+	/**
+	 * @brief Output buffer shared by all observers of a session
+	 *
+	 * The session writes its output here as well as to its own queue, and each observer sends from it
+	 * using its own cursor. Positions are byte counts since the buffer was created, so they wrap at 2^32.
+	 */
+	struct Mirror {
+		char *data;
+		size_t size;
+		uint32_t head;			//!< Position after the last byte written
+		size_t firstObserver;	//!< Index of the first observer, linked through nextObserver
+	};
+
+	static const size_t NO_SESSION = (size_t)-1;
+
+	/**
+	 * @brief Add bytes to the output queue as-is, without telnet escaping
+	 */
+	size_t queueBytes(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Add output to the queue and, if the session has observers, to the mirror buffer
+	 */
+	size_t queueData(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Add bytes to the mirror buffer and queue the observers to send them
+	 */
+	void writeMirror(const uint8_t *buf, size_t size);
+
+	/**
+	 * @brief Returns the number of bytes in the observed session's mirror buffer that this observer hasn't sent
+	 */
+	size_t mirrorPending() const;
+
+	/**
+	 * @brief Send up to maxBytes from the observed session's mirror buffer
+	 */
+	size_t sendMirror(size_t maxBytes);
+
+	/**
+	 * @brief Start telnet negotiation for a new connection, if enabled
+	 */
+	void startTelnet();
+
+	/**
+	 * @brief Send the telnet reply and handle the telnet events after processing a received byte
+	 */
+	void handleTelnet();
+
+	SerialCommandTCPServer *server;
+	char *block;
+	SerialCommandTCPEditor *editor = 0;
+	char *historyBuffer = 0;
+	char *buffer = 0;
+	char **argsBuffer = 0;
+	size_t index = 0;
+#if SERIAL_COMMAND_TCP_EPOLL
+	/**
+	 * @brief Set which events epoll reports for the socket, from inputPaused and waitingToWrite
+	 */
+	void updateEvents();
+
+	int fd = -1;
+	bool waitingToWrite = false;
+	char inData[IN_BUFFER_SIZE];
+	size_t inOffset = 0;
+	size_t inLen = 0;
+#else
+	TCPClient client;
+	unsigned long lastSendMillis = 0;
+	int telnetLookahead = -1;
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+	TelnetFilter telnet;
+	Mirror *mirror = 0;
+	size_t observing = NO_SESSION;
+	size_t nextObserver = NO_SESSION;
+	bool muted = false; // Input is discarded; set when attached as an observer and kept until the session ends
+	uint32_t mirrorCursor = 0;
+	char outData[OUT_BUFFER_SIZE];
+	char *outBuf = outData; // outData, or a grown buffer from the server's growable memory
+	size_t outSize = OUT_BUFFER_SIZE;
+	size_t outStart = 0;
+	size_t outLen = 0;
+	bool inputPaused = false; // More than OUT_BUFFER_SIZE is queued
+	size_t maxQueueDepth = 0;
+	uint32_t bytesSent = 0;
+	uint32_t bytesDropped = 0;
+	uint32_t stallCount = 0;
+	unsigned long stallStart = 0;
+	bool isStalled = false;
+	bool outputPending = false;
+	bool wasConnected = false;
+	bool active = false;
+	unsigned long connectedMillis = 0;
+	unsigned long lastInputMillis = 0;
+	bool timeoutWarned = false;
+	friend class SerialCommandTCPServer;
+};
+
+class SerialCommandTCPServer : public SerialCommandConfig {
+public:
+	SerialCommandTCPServer(size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t maxSessions, bool preallocate, uint16_t port);
+	virtual ~SerialCommandTCPServer();
+
+	void setup();
+	void loop();
+
+	bool isNetworkConnected();
+
+	void stop(SerialCommandParserBase *parser);
+
+	/**
+	 * @brief Returns the millis() value at which loop() next needs to be called, or 0 if there is no timer pending
+	 *
+	 * This is the earliest deadline of the active sessions. Since TCPServer cannot report a pending
+	 * connection without accepting it, this also includes the accept poll interval while the
+	 * network is up. On Linux, new connections and input are reported by getEpollFd() instead.
+	 */
+	unsigned long nextDeadline();
+
+	/**
+	 * @brief Returns true if any session has input waiting or the network state has changed
+	 */
+	bool hasPendingInput();
+
+	/**
+	 * @brief Returns the number of sessions that loop() is currently servicing
+	 *
+	 * A session is active while it has input waiting, a timer pending, or a disconnection to handle.
+	 * Idle sessions are not visited by loop() until the socket reports input again.
+	 */
+	size_t getActiveCount() const { return activeCount; };
+
+	/**
+	 * @brief Returns the number of sessions that are in use by a connection
+	 */
+	size_t getSessionCount() const { return sessionCount; };
+
+	/**
+	 * @brief Returns the maximum number of sessions, passed to the constructor
+	 */
+	size_t getMaxSessions() const { return maxSessions; };
+
+	/**
+	 * @brief Get the output queue statistics for a session
+	 *
+	 * @param index The session, 0 <= index < getMaxSessions()
+	 *
+	 * @param stats Filled in with the statistics
+	 *
+	 * @return true if the session is connected, false if not (stats is not changed)
+	 */
+	bool getOutputStats(size_t index, SerialCommandTCPClient::OutputStats &stats);
+
+	/**
+	 * @brief Size of the buffer shared by the observers of a session (default: 2048)
+	 *
+	 * An observer that falls further behind than this skips ahead, and the skipped bytes are counted in
+	 * bytesDropped in its output statistics. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withMirrorBufferSize(size_t size) { mirrorBufferSize = size; return *this; };
+
+	/**
+	 * @brief Use a separate configuration for the commands, prompt and welcome message instead of the server's own
+	 *
+	 * This allows several servers to share the same commands, such as the shards of a SerialCommandTCPExecutor.
+	 * The configuration is not copied and must remain valid for the life of the server. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withConfig(SerialCommandConfig *config) { commandConfig = config; return *this; };
+
+	/**
+	 * @brief Make a session an observer of another session
+	 *
+	 * @param observer The session that will watch. Its input is ignored from now on.
+	 *
+	 * @param primary The session to watch. Its output from now on is also sent to the observer.
+	 *
+	 * @return true if attached. Fails if either session isn't connected, they're the same session, the
+	 * primary is itself an observer, the observer has observers of its own, or the mirror buffer can't be
+	 * allocated.
+	 *
+	 * The output is written once into a buffer shared by all observers of the primary, and each observer
+	 * sends from it at its own pace, so it's not formatted again for each observer. When the primary
+	 * disconnects, its observers are disconnected too. This can be called from a command handler, using
+	 * getSessionIndex() to find the session the command came from.
+	 */
+	bool attachObserver(size_t observer, size_t primary);
+
+	/**
+	 * @brief Stop a session from observing
+	 *
+	 * The session no longer receives the primary's output, but its input is still discarded until it disconnects.
+	 */
+	void detachObserver(size_t observer);
+
+	/**
+	 * @brief Returns the number of observers attached to a session
+	 */
+	size_t getObserverCount(size_t primary) const;
+
+	/**
+	 * @brief Returns the index of the session that uses a parser, or -1 if it's not one of this server's sessions
+	 *
+	 * Command handlers are passed the parser, so this finds the session a command came from.
+	 */
+	int getSessionIndex(const SerialCommandParserBase *parser) const;
+
+	/**
+	 * @brief Maximum bytes of output sent to all sessions combined in one call to loop() (default: 4096)
+	 *
+	 * Sessions with output waiting take turns sending up to OUTPUT_QUANTUM bytes each, starting with a
+	 * different session each loop, until the budget is used up or no session can send more. 0 means no limit.
+	 */
+	SerialCommandTCPServer &withOutputBudget(size_t bytes) { outputBudget = bytes; return *this; };
+
+	/**
+	 * @brief Largest a session's output queue can grow to, in bytes (default: 16384)
+	 *
+	 * Sessions start with a queue of SerialCommandTCPClient::OUT_BUFFER_SIZE bytes, and it grows when a command
+	 * writes more than fits, such as a long help listing. The grown queue is freed once it's sent, and counts
+	 * towards the memory budget of withGrowableBuffers(). Output that doesn't fit within the limit is discarded.
+	 */
+	SerialCommandTCPServer &withOutputQueueLimit(size_t bytes) { outputQueueLimit = bytes; return *this; };
+
+	/**
+	 * @brief Most bytes sent to one session in one turn
+	 */
+	static const size_t OUTPUT_QUANTUM = 256;
+
+	/**
+	 * @brief Returns the number of bytes used by each session, including the editor and its buffers
+	 *
+	 * All sessions are carved out of a single pool of maxSessions times this size, allocated in setup().
+	 * The editor, its history and its buffers are constructed in the session's slot, so setting up a session
+	 * on connect does not allocate heap memory. Memory is only allocated while connected for grown buffers
+	 * (withGrowableBuffers()), observers (attachObserver()), and by a history store loading saved lines when
+	 * history is not shared.
+	 */
+	size_t getSessionSize() const { return sessionSize; };
 
-	static const char KEY_HOME = -1;
-	static const char KEY_INSERT = -2;
-	static const char KEY_FORWARD_DELETE = -3; // Key in the cursor keypad near Home, End, etc.
-	static const char KEY_END = -4;
-	static const char KEY_PAGE_UP = -5;
-	static const char KEY_PAGE_DOWN = -6;
-	static const char KEY_UP = -50;
-	static const char KEY_DOWN = -51;
-	static const char KEY_LEFT = -52;
-	static const char KEY_RIGHT = -53;
+	/**
+	 * @brief Start each session with small buffers that grow as needed (default: off)
+	 *
+	 * @param memoryBudget Maximum bytes used by the grown buffers of all sessions combined, or 0 for no
+	 * limit. Once it's used up, buffers stop growing: lines can't get longer and history keeps fewer commands.
+	 *
+	 * The line buffer starts at INITIAL_BUFFER_SIZE bytes and history at INITIAL_HISTORY_SIZE bytes when the
+	 * first command is added. Both double when full, up to bufferSize and historyBufSize, and are freed when
+	 * the session disconnects. History saved with withHistoryStore() or shared with withSharedHistory() does
+	 * not grow. Since most sessions only type short commands, this allows more sessions in the same RAM.
+	 * Must be called before setup().
+	 */
+	SerialCommandTCPServer &withGrowableBuffers(size_t memoryBudget = 0) { growable = true; growBudget = memoryBudget; return *this; };
 
-protected:
-	char *historyBuffer;
-	size_t historyBufferSize;
-	char keyEscapeBuf[10];
-	size_t keyEscapeOffset = 0;
-	bool gettingScreenSize = false;
-	int screenRows = 0;
-	int screenCols = 0;
-	unsigned long lastKeyMillis = 0;
-	unsigned long startScreenSizeMillis = 0;
-	TerminalType terminalType = TerminalType::UNKNOWN;
-	int editRow = 0;
-	int editCol = 0;
-	int cursorPos = 0;
-	int horizScroll = 0;
-	int curHistory = -1;
-	bool firstHistoryIsTemporary = false;
-	bool promptRendered = false;
-	std::function<void(int row, int col)> positionCallback = 0;
-	std::function<void()> handlePromptCallback = 0;
-};
+	/**
+	 * @brief Returns the number of bytes currently used by grown buffers of all sessions, including output queues
+	 */
+	size_t getGrowableMemoryUsed() const { return growUsed; };
 
-template<size_t HISTORY_BUFFER_SIZE, size_t BUFFER_SIZE, size_t MAX_ARGS>
-class SerialCommandEditor : public SerialCommandEditorBase, public SerialCommandConfig {
-public:
-	SerialCommandEditor() : SerialCommandEditorBase(staticHistoryBuffer, HISTORY_BUFFER_SIZE, staticBuffer, BUFFER_SIZE, staticArgsBuffer, MAX_ARGS) {
-		staticHistoryBuffer[0] = 0;
-		withConfig(this);
-	};
-	virtual ~SerialCommandEditor() {};
+	/**
+	 * @brief Size of the line buffer a session starts with when using withGrowableBuffers()
+	 */
+	static const size_t INITIAL_BUFFER_SIZE = 32;
 
+	/**
+	 * @brief Size of the first history buffer a session allocates when using withGrowableBuffers()
+	 */
+	static const size_t INITIAL_HISTORY_SIZE = 128;
 
-protected:
-	char staticHistoryBuffer[HISTORY_BUFFER_SIZE];
-	char staticBuffer[BUFFER_SIZE];
-	char *staticArgsBuffer[MAX_ARGS];
-};
+#if SERIAL_COMMAND_TCP_EPOLL
+	/**
+	 * @brief Returns the epoll file descriptor, which is readable when loop() has connections or input to handle
+	 *
+	 * A daemon can wait for this using poll() or its own event loop, with a timeout from nextDeadline(),
+	 * instead of calling loop() continuously.
+	 */
+	int getEpollFd() const { return epollFd; };
 
-#ifndef UNITTEST
+	/**
+	 * @brief Returns the port being listened on, which is useful if the port passed to the constructor was 0
+	 */
+	uint16_t getPort() const;
 
-class SerialCommandTCPServer; // Forward declaration
+	/**
+	 * @brief Allow several servers to listen on the same port, with the kernel spreading connections between them (default: false)
+	 *
+	 * Uses SO_REUSEPORT. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withReusePort(bool value = true) { reusePort = value; return *this; };
 
-class SerialCommandTCPClient {
-public:
-	SerialCommandTCPClient(SerialCommandTCPServer *server);
-	virtual ~SerialCommandTCPClient();
+	/**
+	 * @brief Listen for connections on the port (default: true)
+	 *
+	 * Without a listener, connections accepted elsewhere are passed in with addConnection(). This is how
+	 * SerialCommandTCPExecutor spreads connections across its shards. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withListener(bool value = true) { listener = value; return *this; };
 
-	void setup();
-	void loop();
+	/**
+	 * @brief Start a session for a connection that was accepted elsewhere
+	 *
+	 * @param fd The connected socket, which must be non-blocking. The server takes ownership of it.
+	 *
+	 * @return true if a session was started. If all sessions are in use and none can be evicted, the
+	 * reject message is sent, the socket is closed and false is returned.
+	 *
+	 * Must be called from the thread that calls loop().
+	 */
+	bool addConnection(int fd);
 
-	void setClient(TCPClient client);
+	/**
+	 * @brief Maximum number of epoll events handled in one call to loop()
+	 */
+	static const int MAX_EVENTS = 16;
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
 
-	void stop() { client.stop(); };
+	/**
+	 * @brief Set the keymap shared by all sessions (optional)
+	 *
+	 * @param keymap The keymap. It's not copied, so it must remain valid for the life of the server.
+	 * If not set, sessions use SerialCommandKeymap::getDefault().
+	 */
+	SerialCommandTCPServer &withKeymap(SerialCommandKeymap *keymap) { this->keymap = keymap; return *this; };
 
-	bool isConnected() { return client.connected(); };
+	/**
+	 * @brief How often to check for new connections when using nextDeadline(), in milliseconds (default: 100)
+	 *
+	 * Not used on Linux, where epoll reports new connections.
+	 */
+	SerialCommandTCPServer &withAcceptPollInterval(unsigned long ms) { acceptPollMs = ms; return *this; };
 
-	bool isAllocated() const { return editor && historyBuffer && buffer && argsBuffer; };
+	/**
+	 * @brief Maximum number of connections accepted in one call to loop() (default: 8)
+	 *
+	 * Pending connections are accepted until there are none left or the budget is used up, so a burst
+	 * of reconnections is handled in a few loops without starving the sessions already connected.
+	 */
+	SerialCommandTCPServer &withAcceptBudget(size_t count) { acceptBudget = count; return *this; };
 
-	SerialCommandEditorBase *getEditor() { return editor; };
-	SerialCommandParserBase *getParser() { return editor; };
+	/**
+	 * @brief Message sent to a connection that's rejected because all sessions are in use (default: "too many sessions\r\n")
+	 *
+	 * @param msg The message. It's not copied, so it must remain valid for the life of the server. Pass
+	 * NULL to close the connection without sending anything.
+	 *
+	 * The message is sent without waiting. If the socket can't take it right away it's not sent.
+	 */
+	SerialCommandTCPServer &withRejectMessage(const char *msg) { rejectMessage = msg; return *this; };
 
-protected:
-	SerialCommandTCPServer *server;
-	SerialCommandEditorBase *editor = 0;
-	char *historyBuffer = 0;
-	char *buffer = 0;
-	char **argsBuffer = 0;
-	TCPClient client;
-	bool wasConnected = false;
-};
+	/**
+	 * @brief Close sessions that haven't sent any input for this long, in milliseconds (default: 0, never)
+	 *
+	 * This frees the sessions of peers that went away without closing the connection, such as when a NAT
+	 * mapping times out. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withIdleTimeout(unsigned long ms) { idleTimeoutMs = ms; return *this; };
 
-class SerialCommandTCPServer : public SerialCommandConfig {
-public:
-	SerialCommandTCPServer(size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t maxSessions, bool preallocate, uint16_t port);
-	virtual ~SerialCommandTCPServer();
+	/**
+	 * @brief Close sessions this long after they connected, whether or not they're in use, in milliseconds (default: 0, never)
+	 *
+	 * Must be called before setup().
+	 */
+	SerialCommandTCPServer &withSessionTimeout(unsigned long ms) { sessionTimeoutMs = ms; return *this; };
 
-	void setup();
-	void loop();
+	/**
+	 * @brief Warn a session before closing it for a timeout (optional)
+	 *
+	 * @param ms How long before the session is closed to print the warning, in milliseconds
+	 *
+	 * @param msg The message. It's not copied, so it must remain valid for the life of the server.
+	 *
+	 * For the idle timeout, any input after the warning keeps the session open.
+	 */
+	SerialCommandTCPServer &withTimeoutWarning(unsigned long ms, const char *msg = "session will be closed soon") { timeoutWarningMs = ms; timeoutWarning = msg; return *this; };
 
-	bool isNetworkConnected();
+	/**
+	 * @brief When a connection arrives and all sessions are in use, close the session that's been idle longest (default: false)
+	 *
+	 * Otherwise the new connection is rejected.
+	 */
+	SerialCommandTCPServer &withEvictIdle(bool value = true) { evictIdle = value; return *this; };
 
-	void stop(SerialCommandParserBase *parser);
+	/**
+	 * @brief Speak the telnet protocol with clients (default: false)
+	 *
+	 * Telnet commands are removed from the input, the client is put into character at a time mode with the
+	 * server echoing, and the screen size comes from the client's window size (NAWS) instead of probing the
+	 * terminal with escape sequences, including when the window is resized. Clients that refuse NAWS are
+	 * probed as usual. Don't enable this for clients that send raw bytes, like netcat.
+	 */
+	SerialCommandTCPServer &withTelnet(bool value = true) { telnet = value; return *this; };
+
+	/**
+	 * @brief With telnet, ask clients to edit lines locally using LINEMODE and send whole lines (default: false)
+	 *
+	 * For high-latency links such as satellite or cellular, where the full editor would take a round trip for
+	 * every key. The client echoes and edits the line, and the session processes each line as it arrives.
+	 * Clients that refuse LINEMODE get the full editor. Only used with withTelnet().
+	 */
+	SerialCommandTCPServer &withLineMode(bool value = true) { lineMode = value; return *this; };
+
+	/**
+	 * @brief Resolution of the session timeouts in milliseconds. Timeouts can fire up to this much late.
+	 */
+	static const unsigned long TIMER_TICK_MS = 250;
+
+	/**
+	 * @brief Number of slots in the timer wheel for session timeouts
+	 */
+	static const size_t TIMER_WHEEL_SLOTS = 64;
+
+	/**
+	 * @brief Share one history between all sessions instead of each session having its own (default: false)
+	 *
+	 * The history is allocated once in setup() using historyBufSize, instead of once per session, and
+	 * commands entered in any session can be recalled in all of them. Each session still has its own
+	 * position in history. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withSharedHistory(bool value = true) { useSharedHistory = value; return *this; };
+
+	/**
+	 * @brief Save history using a store (optional)
+	 *
+	 * @param store The store. It's not copied, so it must remain valid for the life of the server.
+	 *
+	 * This is normally used with withSharedHistory(), since all sessions writing their own history to
+	 * one store would mix lines from different sessions. Must be called before setup().
+	 */
+	SerialCommandTCPServer &withHistoryStore(SerialCommandHistoryStore *store) { historyStore = store; return *this; };
+
+	/**
+	 * @brief Rank completions and history by how often they're used in all sessions (optional)
+	 *
+	 * @param table The table. It's not copied, so it must remain valid for the life of the server.
+	 */
+	SerialCommandTCPServer &withUsageTable(SerialCommandUsageTable *table) { usageTable = table; return *this; };
 
 
 protected:
@@ -1087,12 +3154,267 @@ protected:
 	size_t maxSessions;
 	bool preallocate;
 	bool networkWasConnected = false;
+	unsigned long acceptPollMs = 100;
+	size_t acceptBudget = 8;
+	const char *rejectMessage = "too many sessions\r\n";
+	SerialCommandKeymap *keymap = 0;
+	bool useSharedHistory = false;
+	char *sharedHistoryBuffer = 0;
+	SerialCommandHistory::IndexEntry *sharedHistoryIndex = 0;
+	SerialCommandHistory *sharedHistory = 0;
+	SerialCommandHistoryStore *historyStore = 0;
+	SerialCommandUsageTable *usageTable = 0;
+	unsigned long lastAcceptMillis = 0;
 	SerialCommandTCPClient **clients = 0;
+
+	/**
+	 * @brief Take a free session for a new connection from the free list, constructing it if not preallocated
+	 *
+	 * @param index Filled in with the index of the session
+	 *
+	 * @return The session, or NULL if there are too many sessions or not enough memory
+	 */
+	SerialCommandTCPClient *allocateSession(size_t &index);
+
+	/**
+	 * @brief Construct the session for a pool slot in place
+	 */
+	SerialCommandTCPClient *constructSession(size_t index);
+
+	/**
+	 * @brief Return a session to the free list once its connection has ended
+	 */
+	void releaseSession(size_t index);
+
+	/**
+	 * @brief Add a session to the list of sessions with output waiting
+	 */
+	void queueOutput(size_t index);
+
+	/**
+	 * @brief Send queued output round-robin, up to the output budget
+	 */
+	void drainOutput();
+
+	/**
+	 * @brief Schedule the timeout timer for a session for its next warning or timeout
+	 */
+	void scheduleTimeout(size_t index);
+
+	/**
+	 * @brief Handle a session's timeout timer firing: warn it, close it, or reschedule if there was input since
+	 */
+	void handleTimeout(size_t index);
+
+	/**
+	 * @brief Close the connected session that's been idle longest to make room for a new connection
+	 *
+	 * @return true if a session was closed and freed
+	 */
+	bool evictIdleSession();
+
+	/**
+	 * @brief Allocate a grown buffer for a session
+	 *
+	 * @return The buffer, or NULL if it would exceed the memory budget or there's not enough RAM
+	 */
+	char *allocateGrowable(size_t size);
+
+	/**
+	 * @brief Free a buffer from allocateGrowable()
+	 */
+	void releaseGrowable(char *buf, size_t size);
+
+	/**
+	 * @brief Add a session to the active list if it's not already there
+	 */
+	void markActive(size_t index);
+
+	/**
+	 * @brief Run the active sessions that have input or an expired timer, then drop the ones that are idle
+	 *
+	 * Disconnected sessions are freed here when not preallocated.
+	 */
+	void serviceActive();
+
+	size_t *activeSessions = 0;
+	size_t activeCount = 0;
+	size_t *freeSessions = 0;
+	size_t freeCount = 0;
+	size_t sessionCount = 0;
+	char *sessionPool = 0;
+	size_t sessionSize = 0;
+	bool growable = false;
+	size_t growBudget = 0;
+	size_t growUsed = 0;
+	size_t *outputSessions = 0;
+	size_t outputCount = 0;
+	size_t outputNext = 0;
+	size_t outputBudget = 4096;
+	size_t outputQueueLimit = 16384;
+	unsigned long idleTimeoutMs = 0;
+	unsigned long sessionTimeoutMs = 0;
+	unsigned long timeoutWarningMs = 0;
+	const char *timeoutWarning = 0;
+	bool evictIdle = false;
+	bool telnet = false;
+	bool lineMode = false;
+	size_t mirrorBufferSize = 2048;
+	SerialCommandConfig *commandConfig = 0;
+#if SERIAL_COMMAND_TCP_EPOLL
+	bool reusePort = false;
+	bool listener = true;
+#endif
+	TimerWheel timers;
+	uint16_t timerSlots[TIMER_WHEEL_SLOTS];
+	TimerWheel::Node *timerNodes = 0;
+
+#if SERIAL_COMMAND_TCP_EPOLL
+	/**
+	 * @brief Accept all pending connections
+	 */
+	void acceptConnections();
+
+	uint16_t port;
+	int listenFd = -1;
+	int epollFd = -1;
+#else
 	TCPServer server;
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
 	friend class SerialCommandTCPClient;
+	friend class SerialCommandTCPEditor;
 };
 
-#endif /* UNITTEST */
+#if SERIAL_COMMAND_HAS_THREADS
+/**
+ * @brief Serve TCP command sessions on several threads (Linux only)
+ *
+ * Sessions are spread across a number of shards, each a SerialCommandTCPServer with its own sessions,
+ * epoll instance and worker thread, so no session is ever touched by more than one thread. The executor
+ * has one listening socket. Whichever worker is free accepts a new connection and hands it to the shard
+ * with the fewest sessions, so a connection is only rejected when every shard is full.
+ *
+ * The shards share one SerialCommandConfig, which is frozen by start() so the commands can be read from
+ * every thread without locking. Command handlers run one at a time unless they're marked with
+ * CommandHandlerInfo::withThreadSafe().
+ *
+ * Each shard's keymap, usage table and history settings belong to that shard; set them in the function
+ * passed to withShardSetup(). Shared history (withSharedHistory(), withHistoryStore()) must not be shared
+ * between shards.
+ */
+class SerialCommandTCPExecutor {
+public:
+	/**
+	 * @brief Constructor
+	 *
+	 * @param config The commands, prompt and welcome message for all sessions. Not copied; must remain
+	 * valid for the life of the executor.
+	 *
+	 * @param numThreads Number of worker threads, each with its own shard of sessions
+	 *
+	 * @param historyBufSize, bufferSize, maxArgs Passed to the SerialCommandTCPServer for each shard
+	 *
+	 * @param sessionsPerThread Maximum number of sessions for each shard
+	 *
+	 * @param port Port to listen on. If 0, an available port is chosen; see getPort().
+	 */
+	SerialCommandTCPExecutor(SerialCommandConfig *config, size_t numThreads, size_t historyBufSize, size_t bufferSize, size_t maxArgs, size_t sessionsPerThread, uint16_t port);
+
+	/**
+	 * @brief Destructor. Stops the threads and closes all sessions.
+	 */
+	virtual ~SerialCommandTCPExecutor();
+
+	/**
+	 * @brief Set a function to configure each shard before its setup() is called (optional)
+	 *
+	 * For example, to set timeouts or enable telnet with the withXXX() methods of SerialCommandTCPServer.
+	 */
+	SerialCommandTCPExecutor &withShardSetup(std::function<void(SerialCommandTCPServer *shard)> fn) { shardSetup = fn; return *this; };
+
+	/**
+	 * @brief Listen, set up the shards, freeze the configuration and start the worker threads
+	 *
+	 * @return true if started, false if it was already started or it could not listen or set up a shard.
+	 * After a failure the configuration is not frozen and nothing is left allocated, so start() can be
+	 * called again.
+	 */
+	bool start();
+
+	/**
+	 * @brief Stop the worker threads. The sessions stay open but are no longer serviced.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns true if the worker threads are running
+	 */
+	bool isRunning() const { return running; };
+
+	/**
+	 * @brief Returns the port being listened on, or 0 if not started
+	 */
+	uint16_t getPort() const { return listenPort; };
+
+	/**
+	 * @brief Returns the number of worker threads and shards
+	 */
+	size_t getThreadCount() const { return numThreads; };
+
+	/**
+	 * @brief Get a shard. Only safe to use from its worker thread (such as in a command handler) or when stopped.
+	 */
+	SerialCommandTCPServer *getShard(size_t index) { return (shards && index < numThreads) ? shards[index].server : 0; };
+
+	/**
+	 * @brief Longest a worker waits for events when there's no timer pending, in milliseconds
+	 */
+	static const int MAX_WAIT_MS = 1000;
+
+protected:
+	/**
+	 * @brief Worker thread: run the shard's loop and wait for its epoll events or next deadline
+	 */
+	void run(size_t index);
+
+	/**
+	 * @brief Accept pending connections and hand each to the shard with the fewest sessions
+	 */
+	void acceptConnections();
+
+	/**
+	 * @brief Free the shards and close the listening socket, after a failed start() or when destroyed
+	 */
+	void releaseShards();
+
+	/**
+	 * @brief A shard of sessions and the thread that runs it
+	 */
+	struct Shard {
+		SerialCommandTCPServer *server = 0;
+		std::thread thread;
+		int wakeFd = -1;		//!< eventfd used to wake the worker to stop or take new connections
+		std::vector<int> pending;	//!< Connections handed to the shard, not yet added. Protected by handoffMutex.
+		size_t load = 0;		//!< Sessions as of the shard's last loop plus pending connections. Protected by handoffMutex.
+	};
+
+	SerialCommandConfig *config;
+	size_t numThreads;
+	size_t historyBufSize;
+	size_t bufferSize;
+	size_t maxArgs;
+	size_t sessionsPerThread;
+	uint16_t port;
+	uint16_t listenPort = 0;
+	std::function<void(SerialCommandTCPServer *shard)> shardSetup = 0;
+	Shard *shards = 0;
+	int listenFd = -1;
+	std::mutex handoffMutex;
+	std::atomic<bool> running;
+};
+#endif /* SERIAL_COMMAND_HAS_THREADS */
+
+#endif /* SERIAL_COMMAND_HAS_TCP_SERVER */
 
 #ifndef UNITTEST
 
@@ -1143,6 +3465,16 @@ public:
      */
     size_t write(uint8_t c);
 
+    /**
+     * @brief Returns true if there is logged data waiting to be written from loop()
+     */
+    bool hasPendingInput() const { return ringBuffer.availableForRead() > 0; };
+
+    /**
+     * @brief The log handler has no timers, so this always returns 0 (no deadline)
+     */
+    unsigned long nextDeadline() const { return 0; };
+
     void close(SerialCommandParserBase *parser);
 
     /**
@@ -0,0 +1,391 @@
+#ifndef __TELNETFILTER_H
+#define __TELNETFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Streaming filter for the server side of the telnet protocol (RFC 854)
+ *
+ * Bytes received from the client are passed through process() one at a time. Telnet commands and
+ * option negotiation are removed, and the remaining bytes are returned as data. CR LF and CR NUL
+ * are turned into a single CR, so the Enter key is seen once regardless of how the client sends it.
+ *
+ * In character mode, the filter offers to echo and suppress go-ahead (so the client sends each character
+ * as it's typed instead of a line at a time) and asks the client for its window size (NAWS, RFC 1073).
+ * In line mode, it instead asks the client to edit lines locally (LINEMODE, RFC 1184) and send them
+ * whole. It answers the client's requests for these options and refuses all others, only replying when
+ * an option changes state so negotiation can't loop.
+ *
+ * Replies to the client are made available through getReply() and must be sent, then cleared with
+ * clearReply(), before processing the next byte. Changes the caller needs to act on, like a new window
+ * size, are reported by takeEvents().
+ *
+ * This class is not thread safe.
+ */
+class TelnetFilter {
+public:
+	static const uint8_t IAC = 255;		//!< Interpret as command
+	static const uint8_t DONT = 254;	//!< Ask the other side to stop using an option
+	static const uint8_t DO = 253;		//!< Ask the other side to use an option
+	static const uint8_t WONT = 252;	//!< Refuse or stop using an option
+	static const uint8_t WILL = 251;	//!< Offer or agree to use an option
+	static const uint8_t SB = 250;		//!< Start of subnegotiation
+	static const uint8_t SE = 240;		//!< End of subnegotiation
+
+	static const uint8_t OPTION_ECHO = 1;	//!< Server echoes the characters the client types
+	static const uint8_t OPTION_SGA = 3;	//!< Suppress go-ahead (character at a time mode)
+	static const uint8_t OPTION_NAWS = 31;	//!< Client reports its window size
+	static const uint8_t OPTION_LINEMODE = 34;	//!< Client edits lines locally (RFC 1184)
+
+	static const uint8_t LINEMODE_MODE = 1;	//!< LINEMODE subnegotiation to set the mode
+	static const uint8_t MODE_EDIT = 0x01;	//!< LINEMODE mode bit: the client edits the line
+
+	static const uint8_t EVENT_WINDOW_SIZE = 0x01;		//!< A new window size was received, see getWindowRows() and getWindowCols()
+	static const uint8_t EVENT_NAWS_REFUSED = 0x02;	//!< The client won't report its window size
+	static const uint8_t EVENT_LINEMODE_REFUSED = 0x04;	//!< The client won't edit lines locally, see startCharacterMode()
+
+	/**
+	 * @brief Size of the buffer that start() writes the initial negotiation to
+	 */
+	static const size_t START_SIZE = 12;
+
+	/**
+	 * @brief Reset the state for a new connection
+	 *
+	 * @param out Buffer of at least START_SIZE bytes for the initial negotiation to send to the client
+	 *
+	 * @param lineMode true to ask the client to use LINEMODE, false for character mode
+	 *
+	 * @return The number of bytes in out
+	 */
+	size_t start(uint8_t *out, bool lineMode = false) {
+		state = State::DATA;
+		lastCR = false;
+		subLen = 0;
+		replyLen = 0;
+		events = 0;
+		windowRows = windowCols = 0;
+		localEnabled = remoteEnabled = 0;
+		localRequested = remoteRequested = 0;
+
+		if (lineMode) {
+			remoteSupported = BIT_LINEMODE;
+			remoteRequested = BIT_LINEMODE;
+			out[0] = IAC;
+			out[1] = DO;
+			out[2] = OPTION_LINEMODE;
+			return 3;
+		}
+		return startCharacterMode(out);
+	}
+
+	/**
+	 * @brief Switch to character mode, such as when the client refuses LINEMODE
+	 *
+	 * @param out Buffer of at least START_SIZE bytes for the negotiation to send to the client
+	 *
+	 * @return The number of bytes in out
+	 */
+	size_t startCharacterMode(uint8_t *out) {
+		remoteSupported = BIT_SGA | BIT_NAWS;
+		localRequested = LOCAL_SUPPORTED & ~localEnabled;
+		remoteRequested = remoteSupported & ~remoteEnabled;
+
+		const uint8_t initial[START_SIZE] = {
+			IAC, WILL, OPTION_ECHO,
+			IAC, WILL, OPTION_SGA,
+			IAC, DO, OPTION_SGA,
+			IAC, DO, OPTION_NAWS
+		};
+		for(size_t ii = 0; ii < START_SIZE; ii++) {
+			out[ii] = initial[ii];
+		}
+		return START_SIZE;
+	}
+
+	/**
+	 * @brief Process one byte received from the client
+	 *
+	 * @return The byte if it's data, or -1 if it was part of a command or negotiation
+	 */
+	int process(uint8_t c) {
+		switch(state) {
+		case State::DATA:
+			if (c == IAC) {
+				state = State::COMMAND;
+				return -1;
+			}
+			if (lastCR && (c == 0 || c == '\n')) {
+				lastCR = false;
+				return -1;
+			}
+			lastCR = (c == '\r');
+			return c;
+
+		case State::COMMAND:
+			state = State::DATA;
+			if (c == IAC) {
+				// Escaped 255 data byte
+				lastCR = false;
+				return c;
+			}
+			if (c >= WILL && c <= DONT) {
+				command = c;
+				state = State::OPTION;
+			}
+			else
+			if (c == SB) {
+				state = State::SUB_OPTION;
+			}
+			// Other commands (NOP, GA, AYT, ...) are ignored
+			return -1;
+
+		case State::OPTION:
+			state = State::DATA;
+			negotiate(command, c);
+			return -1;
+
+		case State::SUB_OPTION:
+			subOption = c;
+			subLen = 0;
+			state = State::SUB_DATA;
+			return -1;
+
+		case State::SUB_DATA:
+			if (c == IAC) {
+				state = State::SUB_IAC;
+			}
+			else {
+				addSubData(c);
+			}
+			return -1;
+
+		case State::SUB_IAC:
+			if (c == IAC) {
+				addSubData(c);
+				state = State::SUB_DATA;
+			}
+			else {
+				// SE, or a malformed subnegotiation which is ended here
+				if (c == SE) {
+					subnegotiate();
+				}
+				state = State::DATA;
+			}
+			return -1;
+		}
+		return -1;
+	}
+
+	/**
+	 * @brief Returns the reply to send to the client from the last process() call
+	 */
+	const uint8_t *getReply() const {
+		return reply;
+	}
+
+	/**
+	 * @brief Returns the number of bytes in the reply, or 0 if there's nothing to send
+	 */
+	size_t getReplyLength() const {
+		return replyLen;
+	}
+
+	/**
+	 * @brief Call after sending the reply
+	 */
+	void clearReply() {
+		replyLen = 0;
+	}
+
+	/**
+	 * @brief Returns the EVENT_ flags for what's changed since the last call, and clears them
+	 */
+	uint8_t takeEvents() {
+		uint8_t result = events;
+		events = 0;
+		return result;
+	}
+
+	/**
+	 * @brief Returns the number of rows from the last window size, or 0 if the client hasn't sent one
+	 */
+	uint16_t getWindowRows() const {
+		return windowRows;
+	}
+
+	/**
+	 * @brief Returns the number of columns from the last window size, or 0 if the client hasn't sent one
+	 */
+	uint16_t getWindowCols() const {
+		return windowCols;
+	}
+
+	/**
+	 * @brief Returns true if the client has agreed to an option that the server uses (OPTION_ECHO or OPTION_SGA)
+	 */
+	bool isLocalEnabled(uint8_t option) const {
+		return (localEnabled & optionBit(option)) != 0;
+	}
+
+	/**
+	 * @brief Returns true if the client has agreed to an option that it uses (OPTION_SGA, OPTION_NAWS or OPTION_LINEMODE)
+	 */
+	bool isRemoteEnabled(uint8_t option) const {
+		return (remoteEnabled & optionBit(option)) != 0;
+	}
+
+protected:
+	enum class State : uint8_t {
+		DATA,
+		COMMAND,
+		OPTION,
+		SUB_OPTION,
+		SUB_DATA,
+		SUB_IAC
+	};
+
+	static const uint8_t BIT_ECHO = 0x01;
+	static const uint8_t BIT_SGA = 0x02;
+	static const uint8_t BIT_NAWS = 0x04;
+	static const uint8_t BIT_LINEMODE = 0x08;
+	static const uint8_t LOCAL_SUPPORTED = BIT_ECHO | BIT_SGA;
+
+	static uint8_t optionBit(uint8_t option) {
+		switch(option) {
+		case OPTION_ECHO:
+			return BIT_ECHO;
+		case OPTION_SGA:
+			return BIT_SGA;
+		case OPTION_NAWS:
+			return BIT_NAWS;
+		case OPTION_LINEMODE:
+			return BIT_LINEMODE;
+		default:
+			return 0;
+		}
+	}
+
+	void setReply(uint8_t cmd, uint8_t option) {
+		reply[0] = IAC;
+		reply[1] = cmd;
+		reply[2] = option;
+		replyLen = 3;
+	}
+
+	void appendReply(const uint8_t *data, size_t len) {
+		for(size_t ii = 0; ii < len && replyLen < sizeof(reply); ii++) {
+			reply[replyLen++] = data[ii];
+		}
+	}
+
+	void negotiate(uint8_t cmd, uint8_t option) {
+		uint8_t bit = optionBit(option);
+
+		switch(cmd) {
+		case DO:
+			bit &= LOCAL_SUPPORTED;
+			if (!bit) {
+				setReply(WONT, option);
+			}
+			else
+			if (localRequested & bit) {
+				// Agrees to our offer
+				localRequested &= ~bit;
+				localEnabled |= bit;
+			}
+			else
+			if (!(localEnabled & bit)) {
+				localEnabled |= bit;
+				setReply(WILL, option);
+			}
+			break;
+
+		case DONT:
+			if (localEnabled & bit) {
+				setReply(WONT, option);
+			}
+			localEnabled &= ~bit;
+			localRequested &= ~bit;
+			break;
+
+		case WILL:
+			bit &= remoteSupported;
+			if (!bit) {
+				setReply(DONT, option);
+				break;
+			}
+			if (remoteEnabled & bit) {
+				// Already enabled
+				break;
+			}
+			if (remoteRequested & bit) {
+				remoteRequested &= ~bit;
+			}
+			else {
+				setReply(DO, option);
+			}
+			remoteEnabled |= bit;
+			if (bit == BIT_LINEMODE) {
+				// Client edits the line. Signals like Ctrl-C are sent as characters.
+				const uint8_t mode[] = { IAC, SB, OPTION_LINEMODE, LINEMODE_MODE, MODE_EDIT, IAC, SE };
+				appendReply(mode, sizeof(mode));
+			}
+			break;
+
+		case WONT:
+			if ((remoteEnabled | remoteRequested) & bit) {
+				if (remoteEnabled & bit) {
+					setReply(DONT, option);
+				}
+				if (bit == BIT_NAWS) {
+					events |= EVENT_NAWS_REFUSED;
+				}
+				if (bit == BIT_LINEMODE) {
+					events |= EVENT_LINEMODE_REFUSED;
+				}
+			}
+			remoteEnabled &= ~bit;
+			remoteRequested &= ~bit;
+			break;
+		}
+	}
+
+	void addSubData(uint8_t c) {
+		// Only NAWS is used, which has 4 bytes, so anything longer (like LINEMODE SLC) is truncated and ignored
+		if (subLen < sizeof(subData)) {
+			subData[subLen] = c;
+		}
+		if (subLen < 255) {
+			subLen++;
+		}
+	}
+
+	void subnegotiate() {
+		if (subOption == OPTION_NAWS && subLen == 4) {
+			windowCols = (uint16_t)((subData[0] << 8) | subData[1]);
+			windowRows = (uint16_t)((subData[2] << 8) | subData[3]);
+			events |= EVENT_WINDOW_SIZE;
+		}
+	}
+
+	State state = State::DATA;
+	bool lastCR = false;
+	uint8_t command = 0;
+	uint8_t subOption = 0;
+	uint8_t subData[4];
+	uint8_t subLen = 0;
+	uint8_t reply[10];
+	uint8_t replyLen = 0;
+	uint8_t events = 0;
+	uint8_t localEnabled = 0;
+	uint8_t localRequested = 0;
+	uint8_t remoteEnabled = 0;
+	uint8_t remoteRequested = 0;
+	uint8_t remoteSupported = 0;
+	uint16_t windowRows = 0;
+	uint16_t windowCols = 0;
+};
+
+#endif /* __TELNETFILTER_H */
@@ -0,0 +1,203 @@
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Hashed timer wheel for a fixed set of timers identified by small integers
+ *
+ * Each timer is hashed into one of a fixed number of slots by its expiry time, rounded up to a tick.
+ * Advancing the wheel only looks at the slots for the ticks that have passed, so scheduling, cancelling
+ * and checking for expired timers are all O(1) amortized regardless of how many timers there are. Timers
+ * more than one revolution away stay in their slot until a later revolution reaches their expiry time.
+ *
+ * Times are millis() values and may wrap around. Timers fire at the first tick at or after their expiry,
+ * so they can be up to one tick late.
+ *
+ * Like RecordRing, the storage for the slots and the timers is passed in so the caller decides whether
+ * it's static, part of another object, or allocated on the heap.
+ *
+ * This class is not thread safe.
+ */
+class TimerWheel {
+public:
+	/**
+	 * @brief Marks the end of a slot's list of timers
+	 */
+	static const uint16_t NONE = 0xffff;
+
+	/**
+	 * @brief State for one timer. Timers in the same slot are in a doubly linked list.
+	 */
+	struct Node {
+		unsigned long expiry;
+		uint16_t next;
+		uint16_t prev;
+		uint16_t slot;
+	};
+
+	/**
+	 * @brief Construct an empty wheel with no storage. Call setStorage() before use.
+	 */
+	TimerWheel() {};
+
+	/**
+	 * @brief Set the storage to use. All timers are cancelled.
+	 *
+	 * @param slots Array of numSlots slot list heads
+	 *
+	 * @param numSlots Number of slots. One revolution of the wheel is numSlots * tickMs milliseconds.
+	 *
+	 * @param nodes Array of numNodes timers. Timer ids are 0 <= id < numNodes. Limited to 65535 timers.
+	 *
+	 * @param numNodes Number of timers
+	 *
+	 * @param tickMs Resolution of the wheel in milliseconds. Must be greater than 0.
+	 *
+	 * @param now The current millis() value
+	 */
+	void setStorage(uint16_t *slots, size_t numSlots, Node *nodes, size_t numNodes, unsigned long tickMs, unsigned long now) {
+		this->slots = slots;
+		this->numSlots = numSlots;
+		this->nodes = nodes;
+		this->numNodes = (numNodes < NONE) ? numNodes : NONE;
+		this->tickMs = tickMs;
+		for(size_t ii = 0; ii < numSlots; ii++) {
+			slots[ii] = NONE;
+		}
+		for(size_t ii = 0; ii < this->numNodes; ii++) {
+			nodes[ii].slot = NONE;
+		}
+		pos = 0;
+		nextTick = now + tickMs;
+		count = 0;
+	}
+
+	/**
+	 * @brief Returns the number of timers scheduled
+	 */
+	size_t size() const {
+		return count;
+	}
+
+	/**
+	 * @brief Returns true if a timer is scheduled
+	 */
+	bool isScheduled(size_t id) const {
+		return id < numNodes && nodes[id].slot != NONE;
+	}
+
+	/**
+	 * @brief Schedule a timer, replacing its previous expiry time if it was already scheduled
+	 *
+	 * @param id The timer, 0 <= id < numNodes
+	 *
+	 * @param expiry The millis() value at which it expires. A time that has already passed fires at the next tick.
+	 */
+	void schedule(size_t id, unsigned long expiry) {
+		if (id >= numNodes || numSlots == 0) {
+			return;
+		}
+		cancel(id);
+
+		long delta = (long)(expiry - nextTick);
+		size_t ticks = (delta <= 0) ? 0 : (size_t)((delta + tickMs - 1) / tickMs);
+		uint16_t slot = (uint16_t)((pos + ticks) % numSlots);
+
+		Node *node = &nodes[id];
+		node->expiry = expiry;
+		node->slot = slot;
+		node->prev = NONE;
+		node->next = slots[slot];
+		if (node->next != NONE) {
+			nodes[node->next].prev = (uint16_t) id;
+		}
+		slots[slot] = (uint16_t) id;
+		count++;
+	}
+
+	/**
+	 * @brief Cancel a timer. Does nothing if it's not scheduled.
+	 */
+	void cancel(size_t id) {
+		if (!isScheduled(id)) {
+			return;
+		}
+		Node *node = &nodes[id];
+		if (node->prev != NONE) {
+			nodes[node->prev].next = node->next;
+		}
+		else {
+			slots[node->slot] = node->next;
+		}
+		if (node->next != NONE) {
+			nodes[node->next].prev = node->prev;
+		}
+		node->slot = NONE;
+		count--;
+	}
+
+	/**
+	 * @brief Fire the timers that have expired
+	 *
+	 * @param now The current millis() value
+	 *
+	 * @param fn Called with the id of each expired timer. The timer is cancelled first, so fn can schedule it again.
+	 * It must not cancel other timers.
+	 *
+	 * If this hasn't been called for more than a revolution, each slot is only checked once.
+	 */
+	template<class Fn>
+	void advance(unsigned long now, Fn fn) {
+		for(size_t ticks = 0; (long)(now - nextTick) >= 0; ticks++) {
+			if (ticks >= numSlots) {
+				// Every slot has been checked, so skip ahead
+				nextTick = now + tickMs;
+				break;
+			}
+			uint16_t id = slots[pos];
+			while(id != NONE) {
+				uint16_t next = nodes[id].next;
+				if ((long)(now - nodes[id].expiry) >= 0) {
+					cancel(id);
+					fn((size_t)id);
+				}
+				id = next;
+			}
+			pos = (pos + 1) % numSlots;
+			nextTick += tickMs;
+		}
+	}
+
+	/**
+	 * @brief Returns the millis() value of the next tick that has a timer in its slot, or 0 if there are no timers
+	 *
+	 * A timer more than one revolution away makes this return a tick before it expires, which is harmless
+	 * since advance() leaves it scheduled.
+	 */
+	unsigned long nextDeadline() const {
+		if (count == 0) {
+			return 0;
+		}
+		for(size_t ii = 0; ii < numSlots; ii++) {
+			if (slots[(pos + ii) % numSlots] != NONE) {
+				unsigned long deadline = nextTick + ii * tickMs;
+				return (deadline != 0) ? deadline : 1;
+			}
+		}
+		return 0;
+	}
+
+protected:
+	uint16_t *slots = NULL;
+	size_t numSlots = 0;
+	Node *nodes = NULL;
+	size_t numNodes = 0;
+	unsigned long tickMs = 1;
+	size_t pos = 0;
+	unsigned long nextTick = 0;
+	size_t count = 0;
+};
+
+#endif /* __TIMERWHEEL_H */
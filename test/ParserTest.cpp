@@ -1,4 +1,10 @@
 #include <unistd.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
 
 #include "Particle.h"
 #include "SerialCommandParserRK.h"
@@ -54,6 +60,65 @@ void _assertFloat(float expected, float got, float margin, int line) {
 }
 #define assertFloat(e, g, m) _assertFloat(e, g, m, __LINE__)
 
+// Editor that captures its output instead of writing it to stdout
+class CaptureEditor : public SerialCommandEditor<50, 100, 10> {
+public:
+	virtual size_t write(uint8_t c) { output.concat((char)c); return 1; };
+	virtual size_t write(const uint8_t *buf, size_t size) { output.concat(String((const char *)buf, size)); return size; };
+
+	void filterString(const char *str) {
+		while(*str) {
+			filterChar(*str++);
+		}
+	}
+
+	String output;
+};
+
+#if SERIAL_COMMAND_TCP_EPOLL
+// Connect to a TCP server or executor on the loopback address and return the socket
+template<class Server>
+static int connectLoopback(const Server &server) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(server.getPort());
+	assertInt(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+	return fd;
+}
+
+// Check predicate every millisecond until it's true or maxMs has passed, and return its last result
+static bool waitUntil(std::function<bool()> predicate, int maxMs) {
+	for(int ms = 0; ms < maxMs; ms++) {
+		if (predicate()) {
+			return true;
+		}
+		usleep(1000);
+	}
+	return predicate();
+}
+
+// Run the server's loop until predicate is true or maxMs has passed, and return its last result
+static bool pumpUntil(SerialCommandTCPServer &server, std::function<bool()> predicate, int maxMs) {
+	return waitUntil([&server, &predicate]() {
+		server.loop();
+		return predicate();
+	}, maxMs);
+}
+
+// Append whatever has arrived on a socket without blocking. Returns false once the other end has closed it.
+static bool recvAvailable(int fd, std::string &received) {
+	char buf[256];
+	ssize_t count;
+	while((count = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		received.append(buf, count);
+	}
+	return count != 0;
+}
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
 void parserUnitTest();
 void interactiveTest();
 
@@ -376,6 +441,1538 @@ void parserUnitTest() {
 
 	}
 
+	{
+		SerialCommandEditor<50, 50, 10> parser;
+
+		// No ESC pending and no screen size request, so nothing to wake up for
+		assertInt(0, parser.nextDeadline());
+		assertInt(false, parser.hasPendingInput());
+
+		assertInt(5, SerialCommandParserBase::earliestDeadline(0, 5));
+		assertInt(5, SerialCommandParserBase::earliestDeadline(5, 0));
+		assertInt(5, SerialCommandParserBase::earliestDeadline(5, 10));
+		// ULONG_MAX - 15 is before 5 when millis() rolls over
+		assertInt(ULONG_MAX - 15, SerialCommandParserBase::earliestDeadline(ULONG_MAX - 15, 5));
+		assertInt(1, SerialCommandParserBase::deadlineAfter(ULONG_MAX, 1));
+		assertInt(1000, SerialCommandParserBase::millisUntilDeadline(0, 1000));
+	}
+
+	{
+		SerialCommandEditor<50, 50, 10> parser;
+
+		// Typing within a word is a single undo step
+		for(const char *cp = "set abc"; *cp; cp++) {
+			parser.editInsert(strlen(parser.getBuffer()), cp, 1);
+		}
+		assertString("set abc", parser.getBuffer());
+
+		assertInt(true, parser.undo());
+		assertString("set ", parser.getBuffer());
+		assertInt(true, parser.redo());
+		assertString("set abc", parser.getBuffer());
+
+		// Backspace twice, then forward delete twice
+		parser.editDelete(6, 1);
+		parser.editDelete(5, 1);
+		assertString("set a", parser.getBuffer());
+		parser.editDelete(0, 1);
+		parser.editDelete(0, 1);
+		assertString("t a", parser.getBuffer());
+
+		assertInt(true, parser.undo());
+		assertString("set a", parser.getBuffer());
+		assertInt(true, parser.undo());
+		assertString("set abc", parser.getBuffer());
+		assertInt(true, parser.redo());
+		assertString("set a", parser.getBuffer());
+
+		// A new edit discards the redo
+		parser.editInsert(0, "x", 1);
+		assertString("xset a", parser.getBuffer());
+		assertInt(false, parser.redo());
+
+		assertInt(true, parser.undo());
+		assertInt(true, parser.undo());
+		assertInt(true, parser.undo());
+		assertInt(true, parser.undo());
+		assertString("", parser.getBuffer());
+		assertInt(false, parser.undo());
+	}
+
+	{
+		// Edits larger than the undo log are dropped, along with everything before them
+		SerialCommandEditor<50, 300, 10> parser;
+		char big[SerialCommandEditorBase::UNDO_BUFFER_SIZE + 1];
+		memset(big, 'x', sizeof(big));
+
+		parser.editInsert(0, "a", 1);
+		parser.editInsert(1, big, sizeof(big));
+		assertInt(false, parser.undo());
+	}
+
+	{
+		char data[10];
+		RecordRing::Record records[3];
+		RecordRing ring(data, sizeof(data), records, 3);
+
+		assertInt(true, ring.add("abcd", 4));
+		assertInt(true, ring.add("ef", 2));
+		assertInt(true, ring.append("g", 1));
+		assertInt(2, ring.size());
+		assertInt(3, ring.get(0)->length);
+		assertInt(0, strncmp(ring.getData(ring.get(0)), "efg", 3));
+
+		// Doesn't fit at the end, so it wraps to the start and discards "abcd"
+		assertInt(true, ring.add("hijk", 4));
+		assertInt(2, ring.size());
+		assertInt(0, ring.get(0)->offset);
+		assertInt(0, strncmp(ring.getData(ring.get(1)), "efg", 3));
+
+		// Index is full
+		assertInt(true, ring.add("l", 1));
+		assertInt(true, ring.add("m", 1));
+		assertInt(3, ring.size());
+		assertInt(0, strncmp(ring.getData(ring.get(2)), "hijk", 4));
+
+		ring.removeNewest();
+		assertInt(2, ring.size());
+		assertInt(false, ring.add("01234567890", 11));
+	}
+
+	{
+		uint16_t slots[4];
+		TimerWheel::Node nodes[3];
+		TimerWheel wheel;
+		wheel.setStorage(slots, 4, nodes, 3, 10, 1000);
+
+		std::vector<size_t> fired;
+		auto fire = [&fired](size_t id) { fired.push_back(id); };
+
+		wheel.schedule(0, 1025);
+		wheel.schedule(1, 1005);
+		// More than one revolution away
+		wheel.schedule(2, 1100);
+		assertInt(3, wheel.size());
+		assertInt(1010, wheel.nextDeadline());
+
+		wheel.advance(1009, fire);
+		assertInt(0, fired.size());
+		wheel.advance(1010, fire);
+		assertInt(1, fired.size());
+		assertInt(1, fired[0]);
+		assertInt(false, wheel.isScheduled(1));
+
+		// Rescheduling replaces the expiry time
+		wheel.schedule(0, 1055);
+		wheel.advance(1050, fire);
+		assertInt(1, fired.size());
+		wheel.advance(1060, fire);
+		assertInt(2, fired.size());
+		assertInt(0, fired[1]);
+
+		// Timer 2 passes through its slot once before it expires
+		wheel.advance(1099, fire);
+		assertInt(2, fired.size());
+		wheel.cancel(2);
+		wheel.cancel(2);
+		assertInt(0, wheel.size());
+		assertInt(0, wheel.nextDeadline());
+
+		// Not advanced for several revolutions
+		wheel.schedule(1, 1200);
+		wheel.advance(5000, fire);
+		assertInt(3, fired.size());
+		assertInt(1, fired[2]);
+	}
+
+	{
+		TelnetFilter telnet;
+		uint8_t out[TelnetFilter::START_SIZE];
+		assertInt(12, telnet.start(out));
+		assertInt(TelnetFilter::IAC, out[9]);
+		assertInt(TelnetFilter::DO, out[10]);
+		assertInt(TelnetFilter::OPTION_NAWS, out[11]);
+
+		const uint8_t input[] = {
+			'a', TelnetFilter::IAC, TelnetFilter::IAC,
+			TelnetFilter::IAC, TelnetFilter::DO, TelnetFilter::OPTION_ECHO,
+			TelnetFilter::IAC, TelnetFilter::WILL, TelnetFilter::OPTION_NAWS,
+			TelnetFilter::IAC, TelnetFilter::SB, TelnetFilter::OPTION_NAWS, 0, 132, 0, 255, 255, TelnetFilter::IAC, TelnetFilter::SE,
+			'b', '\r', 0, 'c', '\r', '\n'
+		};
+		std::string data;
+		for(size_t ii = 0; ii < sizeof(input); ii++) {
+			int c = telnet.process(input[ii]);
+			if (c >= 0) {
+				data += (char) c;
+			}
+			// Agreeing to our offers needs no reply
+			assertInt(0, telnet.getReplyLength());
+		}
+		assertInt(0, data.compare("a\xff" "b\rc\r"));
+		assertInt(TelnetFilter::EVENT_WINDOW_SIZE, telnet.takeEvents());
+		assertInt(0, telnet.takeEvents());
+		assertInt(132, telnet.getWindowCols());
+		assertInt(255, telnet.getWindowRows());
+		assertInt(true, telnet.isLocalEnabled(TelnetFilter::OPTION_ECHO));
+		assertInt(true, telnet.isRemoteEnabled(TelnetFilter::OPTION_NAWS));
+
+		// Unsupported options are refused
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WILL);
+		telnet.process(24);
+		assertInt(3, telnet.getReplyLength());
+		assertInt(TelnetFilter::DONT, telnet.getReply()[1]);
+		telnet.clearReply();
+
+		// Turning off NAWS is acknowledged once
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WONT);
+		telnet.process(TelnetFilter::OPTION_NAWS);
+		assertInt(3, telnet.getReplyLength());
+		assertInt(TelnetFilter::DONT, telnet.getReply()[1]);
+		assertInt(TelnetFilter::EVENT_NAWS_REFUSED, telnet.takeEvents());
+		telnet.clearReply();
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WONT);
+		telnet.process(TelnetFilter::OPTION_NAWS);
+		assertInt(0, telnet.getReplyLength());
+	}
+
+	{
+		TelnetFilter telnet;
+		uint8_t out[TelnetFilter::START_SIZE];
+		assertInt(3, telnet.start(out, true));
+		assertInt(TelnetFilter::OPTION_LINEMODE, out[2]);
+
+		// Agreeing to LINEMODE is answered with the mode
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WILL);
+		telnet.process(TelnetFilter::OPTION_LINEMODE);
+		assertInt(7, telnet.getReplyLength());
+		assertInt(TelnetFilter::SB, telnet.getReply()[1]);
+		assertInt(TelnetFilter::MODE_EDIT, telnet.getReply()[4]);
+		assertInt(true, telnet.isRemoteEnabled(TelnetFilter::OPTION_LINEMODE));
+		telnet.clearReply();
+
+		// Repeating it doesn't restart negotiation
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WILL);
+		telnet.process(TelnetFilter::OPTION_LINEMODE);
+		assertInt(0, telnet.getReplyLength());
+
+		// Refusing it falls back to character mode
+		telnet.start(out, true);
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WONT);
+		telnet.process(TelnetFilter::OPTION_LINEMODE);
+		assertInt(0, telnet.getReplyLength());
+		assertInt(TelnetFilter::EVENT_LINEMODE_REFUSED, telnet.takeEvents());
+		assertInt(12, telnet.startCharacterMode(out));
+		telnet.process(TelnetFilter::IAC);
+		telnet.process(TelnetFilter::WILL);
+		telnet.process(TelnetFilter::OPTION_NAWS);
+		assertInt(0, telnet.getReplyLength());
+		assertInt(true, telnet.isRemoteEnabled(TelnetFilter::OPTION_NAWS));
+	}
+
+	{
+		SerialCommandKeymap keymap;
+		SerialCommandEditor<50, 50, 10> parser;
+		parser.withKeymap(&keymap);
+
+		assertInt((int)SerialCommandKeymap::Action::UNDO, (int)keymap.getAction(SerialCommandEditorBase::KEY_CTRL_UNDERSCORE));
+		assertInt((int)SerialCommandKeymap::Action::BACKWARD_CHAR, (int)keymap.getAction(SerialCommandEditorBase::KEY_LEFT));
+		assertInt((int)SerialCommandKeymap::Action::NONE, (int)keymap.getAction(SerialCommandEditorBase::KEY_UP, SerialCommandKeymap::MOD_CTRL));
+
+		int customCalled = 0;
+		SerialCommandKeymap::Action custom = keymap.addCustomAction([&customCalled](SerialCommandEditorBase *, char key) {
+			customCalled = key;
+		});
+		assertInt((int)SerialCommandKeymap::Action::CUSTOM, (int)custom);
+
+		keymap.bind('x', custom, SerialCommandKeymap::MOD_ALT);
+		keymap.unbind(SerialCommandEditorBase::KEY_LEFT);
+		assertInt((int)SerialCommandKeymap::Action::NONE, (int)keymap.getAction(SerialCommandEditorBase::KEY_LEFT));
+
+		parser.performAction(keymap.getAction('x', SerialCommandKeymap::MOD_ALT), 'x');
+		assertInt('x', customCalled);
+
+		// The default keymap is not affected
+		assertInt((int)SerialCommandKeymap::Action::BACKWARD_CHAR, (int)SerialCommandKeymap::getDefault()->getAction(SerialCommandEditorBase::KEY_LEFT));
+	}
+
+	{
+		// A sequence is parsed on its own, not with parameters left over from an earlier invalid one
+		CaptureEditor parser;
+		parser.handleConnected(true);
+		parser.filterString("\033[24;80R\033[24;3R");
+		parser.filterString("abc def");
+		parser.filterString("\033[1;5C");
+		parser.filterString("\033[1;5D");
+		parser.filterString("X");
+		assertString("abc Xdef", parser.getBuffer());
+
+		parser.clear();
+		parser.filterString("abc def");
+		parser.filterString("\033[1;5;5x\033[99D");
+		parser.filterString("X");
+		assertString("abc defX", parser.getBuffer());
+	}
+
+	{
+		SerialCommandEditor<50, 50, 10> parser;
+
+		parser.processString("get temp-1 now");
+		assertInt(11, parser.findWordStart(14));
+		assertInt(9, parser.findWordStart(11));
+		assertInt(4, parser.findWordStart(9));
+		assertInt(0, parser.findWordStart(3));
+		assertInt(8, parser.findWordEnd(3));
+		assertInt(10, parser.findWordEnd(8));
+		assertInt(14, parser.findWordEnd(10));
+
+		// Kill "get " and "now", then yank them back
+		parser.killText(0, 4);
+		assertString("temp-1 now", parser.getBuffer());
+		parser.killText(7, 3);
+		assertString("temp-1 ", parser.getBuffer());
+
+		assertInt(true, parser.yank());
+		assertString("nowtemp-1 ", parser.getBuffer());
+		assertInt(true, parser.yankPop());
+		assertString("get temp-1 ", parser.getBuffer());
+
+		// Kills can be undone
+		assertInt(true, parser.undo());
+		assertInt(true, parser.undo());
+		assertString("nowtemp-1 ", parser.getBuffer());
+	}
+
+	{
+		// The index is sized from the history buffer, so short lines are not limited by it
+		SerialCommandEditor<1024, 64, 10> parser;
+		char line[10];
+		assertInt(128, parser.getHistory().getMaxEntries());
+		for(int ii = 0; ii < 100; ii++) {
+			snprintf(line, sizeof(line), "c%d", ii);
+			parser.historyAdd(line);
+		}
+		assertInt(100, parser.historySize());
+		assertString("c0", parser.historyGet(99));
+	}
+
+	{
+		// An index of 32 entries fills up before the buffer, so the oldest lines are discarded
+		SerialCommandEditor<1000, 50, 10, 32> parser;
+		char line[10];
+		const size_t maxEntries = 32;
+		assertInt(maxEntries, parser.getHistory().getMaxEntries());
+		for(size_t ii = 0; ii < maxEntries + 3; ii++) {
+			snprintf(line, sizeof(line), "cmd %d", (int)ii);
+			parser.historyAdd(line);
+		}
+		assertInt(maxEntries, parser.historySize());
+		assertString("cmd 3", parser.historyGet(maxEntries - 1));
+		assertInt(0, parser.getHistory().get(maxEntries).length());
+
+		SerialCommandHistory::Entry entry = parser.getHistory().get(0);
+		assertInt(6, entry.length());
+		assertInt('4', entry.charAt(5));
+		assertInt(true, entry.equals("cmd 34", 6));
+		assertInt(true, entry.startsWith("cmd", 3));
+		assertInt(false, entry.startsWith("cmd 345", 7));
+
+		char buf[5];
+		assertInt(4, entry.copyTo(buf, sizeof(buf)));
+		assertString("cmd ", buf);
+
+		// Empty lines are not saved, and history is kept after a line is processed
+		parser.historyAdd("");
+		assertInt(maxEntries, parser.historySize());
+		parser.clear();
+		assertInt(maxEntries, parser.historySize());
+	}
+
+	{
+		// Wrap mode on a 5 row, 20 column terminal with a 2 character prompt on the bottom row
+		CaptureEditor parser;
+		parser.withWrapMode();
+		parser.handleConnected(true);
+		parser.filterString("\033[5;20R");
+		parser.filterString("\033[5;3R");
+
+		// 40 characters need 3 rows, so the screen scrolls up one row after the first 18 and again after 38
+		parser.output = "";
+		parser.filterString("0123456789012345678901234567890123456789");
+		assertString("0123456789012345678901234567890123456789", parser.getBuffer());
+		assertInt(18, parser.output.indexOf("\033[5;1H\n"));
+		assertInt(18 + 7 + 6 + 20, parser.output.indexOf("\033[5;1H\n", 20));
+
+		// Left moves up to the end of the previous row
+		parser.output = "";
+		parser.filterString("\033[D\033[D\033[D");
+		assertString("\033[5;2H\033[5;1H\033[4;20H", parser.output.c_str());
+
+		// Backspace only rewrites the row with the change
+		parser.filterString("\005");
+		parser.output = "";
+		parser.filterChar(SerialCommandEditorBase::KEY_BACKSPACE);
+		assertString("\033[5;2H\033[0K\033[5;2H", parser.output.c_str());
+
+		// Clearing the line erases the rows it no longer uses
+		parser.output = "";
+		parser.filterString("\025");
+		assertString("", parser.getBuffer());
+		assertInt(true, parser.output.indexOf("\033[0J") >= 0);
+	}
+
+	{
+		// A DSR reply without a column is ignored instead of setting a zero width, and a line taller than the
+		// screen doesn't move the cursor above the top row
+		CaptureEditor parser;
+		parser.withWrapMode();
+		parser.handleConnected(true);
+		int cols = parser.getScreenCols();
+		parser.filterString("\033[24R");
+		assertInt(cols, parser.getScreenCols());
+		parser.filterString("\033[3;10R");
+		assertInt(10, parser.getScreenCols());
+		parser.filterString("\033[3;3R");
+
+		parser.output = "";
+		parser.filterString("0123456789012345678901234567890123456789");
+		assertString("0123456789012345678901234567890123456789", parser.getBuffer());
+		assertInt(-1, parser.output.indexOf("\033[0;"));
+		assertInt(-1, parser.output.indexOf("\033[-"));
+	}
+
+	{
+		SerialCommandHistory history;
+		char historyBuf[100];
+		SerialCommandHistory::IndexEntry historyIndex[SerialCommandHistory::indexSize(sizeof(historyBuf))];
+		history.setStorage(historyBuf, sizeof(historyBuf), historyIndex, SerialCommandHistory::indexSize(sizeof(historyBuf)));
+		history.add("get temp", 8);
+		history.add("set led on", 10);
+		history.add("get humidity", 12);
+		history.add("status", 6);
+
+		assertInt(1, history.find("get", 3));
+		assertInt(3, history.find("get", 3, 2));
+		assertInt(-1, history.find("get", 3, 4));
+		assertInt(3, history.find("get t", 5));
+		assertInt(-1, history.find("get tx", 6));
+		assertInt(-1, history.find("LED", 3));
+
+		// Growing keeps the lines, their sequence numbers and their masks, and the larger index holds more lines
+		char largerBuf[200];
+		SerialCommandHistory::IndexEntry largerIndex[SerialCommandHistory::indexSize(sizeof(largerBuf))];
+		uint32_t seq = history.getSeq(3);
+		history.growStorage(largerBuf, sizeof(largerBuf), largerIndex, SerialCommandHistory::indexSize(sizeof(largerBuf)));
+		assertInt(4, history.size());
+		assertInt(25, history.getMaxEntries());
+		assertInt(seq, history.getSeq(3));
+		assertInt(3, history.find("get t", 5));
+		for(int ii = 0; ii < 20; ii++) {
+			history.add("a", 1);
+			history.add("b", 1);
+		}
+		assertInt(25, history.size());
+		assertInt(true, history.get(0).equals("b", 1));
+	}
+
+	{
+		// Lines that share a prefix with the previous line only store the rest of the line
+		SerialCommandEditor<50, 50, 10, 16> parser;
+		char line[32];
+		for(int ii = 0; ii < 8; ii++) {
+			snprintf(line, sizeof(line), "get temperature %d", ii);
+			parser.historyAdd(line);
+		}
+		assertInt(8, parser.historySize());
+		assertString("get temperature 7", parser.historyGet(0));
+		assertString("get temperature 4", parser.historyGet(3));
+		assertString("get temperature 0", parser.historyGet(7));
+
+		// Discarding old lines keeps the newer lines that shared their prefix
+		parser.historyAdd("set led on");
+		parser.historyAdd("set led off");
+		parser.historyAdd("status");
+		assertString("status", parser.historyGet(0));
+		assertString("set led off", parser.historyGet(1));
+		assertString("set led on", parser.historyGet(2));
+		assertString("get temperature 7", parser.historyGet(3));
+		assertString("get temperature 4", parser.historyGet(parser.historySize() - 1));
+
+		// Consecutive duplicates are not added
+		parser.historyAdd("status");
+		assertString("set led off", parser.historyGet(1));
+	}
+
+	{
+		SerialCommandEditor<50, 50, 10> parser;
+		parser.getHistory().withMoveToFront();
+		parser.historyAdd("status");
+		parser.historyAdd("set led on");
+		parser.historyAdd("get temp");
+
+		// An existing line is moved instead of being added again
+		parser.historyAdd("set led on");
+		assertInt(3, parser.historySize());
+		assertString("set led on", parser.historyGet(0));
+		assertString("get temp", parser.historyGet(1));
+		assertString("status", parser.historyGet(2));
+
+		// The space used by the old copy is reused
+		parser.historyAdd("abcdefghijklmnopqrstuvwxyz");
+		assertInt(4, parser.historySize());
+		assertString("status", parser.historyGet(3));
+	}
+
+	{
+		CaptureEditor parser;
+		parser.handleConnected(true);
+		parser.filterString("\033[24;80R");
+		parser.filterString("\033[24;3R");
+
+		parser.historyAdd("get temp");
+		parser.historyAdd("set led on");
+		parser.historyAdd("get humidity");
+		parser.historyAdd("status");
+		parser.filterString("xyz");
+
+		parser.output = "";
+		parser.filterString("\022get");
+		assertInt(true, parser.isSearching());
+		assertInt(true, parser.output.indexOf("(reverse-i-search)`get': get humidity") >= 0);
+
+		// Ctrl-R again finds the next older match
+		parser.output = "";
+		parser.filterString("\022");
+		assertInt(true, parser.output.indexOf("(reverse-i-search)`get': get temp") >= 0);
+
+		// No match keeps the previous line, backspace searches again from the newest line
+		parser.output = "";
+		parser.filterString("x");
+		assertInt(true, parser.output.indexOf("(failed reverse-i-search)`getx': get temp") >= 0);
+		parser.output = "";
+		parser.filterChar(SerialCommandEditorBase::KEY_BACKSPACE);
+		assertInt(true, parser.output.indexOf("(reverse-i-search)`get': get humidity") >= 0);
+
+		// Ctrl-E accepts the match and moves to the end of it
+		parser.filterString("\005");
+		assertInt(false, parser.isSearching());
+		assertString("get humidity", parser.getBuffer());
+
+		// Ctrl-G cancels and keeps the original line
+		parser.filterString("\022led\007");
+		assertInt(false, parser.isSearching());
+		assertString("get humidity", parser.getBuffer());
+	}
+
+	{
+		const char *path = "/tmp/SerialCommandParserHistoryTest.log";
+		unlink(path);
+
+		{
+			SerialCommandHistoryFileStore store(path);
+			CaptureEditor parser;
+			parser.withHistoryStore(&store);
+			assertInt(0, parser.historySize());
+
+			// Lines are not written until the flush delay
+			parser.historyAdd("get temp");
+			parser.historyAdd("set led on");
+			parser.historyAdd("status", true);
+			assertInt(0, store.getFileSize());
+			assertInt(true, store.nextDeadline() != 0);
+			store.flush();
+			assertInt(2 * SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 8 + 10, store.getFileSize());
+			assertInt(0, store.nextDeadline());
+
+			// Reconnecting does not clear saved history, and the temporary line was never added to it
+			parser.handleConnected(true);
+			assertInt(2, parser.historySize());
+		}
+		{
+			// The temporary line was not saved
+			SerialCommandHistoryFileStore store(path);
+			SerialCommandEditor<100, 50, 10> parser;
+			parser.withHistoryStore(&store);
+			assertInt(2, parser.historySize());
+			assertString("set led on", parser.historyGet(0));
+			assertString("get temp", parser.historyGet(1));
+		}
+
+		// A partially written record is discarded and the file is rewritten
+		FILE *fp = fopen(path, "a");
+		fwrite("\x20\x00\x12\x34xyz", 1, 7, fp);
+		fclose(fp);
+		{
+			SerialCommandHistoryFileStore store(path);
+			SerialCommandEditor<100, 50, 10> parser;
+			parser.withHistoryStore(&store);
+			assertInt(2, parser.historySize());
+			assertInt(2 * SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 8 + 10, store.getFileSize());
+		}
+		{
+			// When the file gets too large it's rewritten with only the lines in history
+			SerialCommandHistoryFileStore store(path);
+			store.withMaxFileSize(200);
+			SerialCommandEditor<100, 50, 10> parser;
+			parser.withHistoryStore(&store);
+			char line[32];
+			for(int ii = 0; ii < 40; ii++) {
+				snprintf(line, sizeof(line), "command number %d", ii);
+				parser.historyAdd(line);
+				store.flush();
+			}
+			assertInt(true, (store.getFileSize() < 40 * (SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 17)));
+			assertString("command number 39", parser.historyGet(0));
+		}
+		{
+			SerialCommandHistoryFileStore store(path);
+			SerialCommandEditor<100, 50, 10> parser;
+			parser.withHistoryStore(&store);
+			assertString("command number 39", parser.historyGet(0));
+			parser.historyClear();
+		}
+		assertInt(-1, access(path, F_OK));
+
+		{
+			SerialCommandHistoryFileStore store(path);
+			{
+				SerialCommandEditor<100, 50, 10> parser;
+				parser.withHistoryStore(&store);
+				parser.historyAdd("get temp");
+				assertInt(0, store.getFileSize());
+			}
+			// The editor's line is written when it's destroyed, and the store stops using its history
+			assertInt(SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 8, store.getFileSize());
+
+			// Without a history to rewrite the file from, lines are appended even when it's too large
+			store.withMaxFileSize(1);
+			store.append("status", 6);
+			store.flush();
+			assertInt(2 * SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 8 + 6, store.getFileSize());
+		}
+		unlink(path);
+
+		{
+			// Lines that can't be written are not counted in the file size
+			SerialCommandHistoryFileStore store("/nonexistent/SerialCommandParserHistoryTest.log");
+			store.append("status", 6);
+			store.flush();
+			assertInt(0, store.getFileSize());
+		}
+	}
+
+	{
+		// Two editors sharing one history
+		char sharedBuffer[200];
+		SerialCommandHistory::IndexEntry sharedIndex[16];
+		SerialCommandHistory shared(sharedBuffer, sizeof(sharedBuffer), sharedIndex, 16);
+		CaptureEditor parser1, parser2;
+		parser1.withHistory(&shared);
+		parser2.withHistory(&shared);
+		parser1.handleConnected(true);
+		parser1.filterString("\033[24;80R\033[24;1R");
+		parser2.handleConnected(true);
+		parser2.filterString("\033[24;80R\033[24;1R");
+
+		parser1.filterString("get temp\r");
+		parser2.filterString("set led on\r");
+		assertInt(2, parser1.historySize());
+		assertString("get temp", parser2.historyGet(1));
+
+		// Each editor has its own position and its own unfinished line
+		parser1.filterString("stat\033[A");
+		assertString("set led on", parser1.getBuffer());
+		parser2.filterString("\033[A\033[A");
+		assertString("get temp", parser2.getBuffer());
+
+		// A line added by the other editor does not move this editor's position
+		parser2.filterString("\r");
+		assertInt(3, shared.size());
+		parser1.filterString("\033[A");
+		assertString("get temp", parser1.getBuffer());
+		// Going down reaches the line the other editor added, then this editor's unfinished line
+		parser1.filterString("\033[B\033[B");
+		assertString("get temp", parser1.getBuffer());
+		parser1.filterString("\033[B");
+		assertString("stat", parser1.getBuffer());
+
+		// A search keeps its match when the other editor adds a line
+		parser1.filterString("\022set");
+		parser2.filterString("set mode 1\r");
+		parser1.output = "";
+		parser1.filterString("\022");
+		assertInt(true, parser1.output.indexOf("(failed reverse-i-search)`set': set led on") >= 0);
+		// The added line is searched when the search string changes
+		parser1.output = "";
+		parser1.filterString(" ");
+		assertInt(true, parser1.output.indexOf("(reverse-i-search)`set ': set mode 1") >= 0);
+		parser1.filterString("\007");
+		assertString("stat", parser1.getBuffer());
+
+		// Reconnecting does not clear shared history
+		parser2.handleConnected(true);
+		assertInt(4, parser1.historySize());
+	}
+
+	{
+		// Command completion and listing the matches on a 3 row, 40 column terminal
+		CaptureEditor parser;
+		int handled = 0;
+		parser.addCommandHandler("setup", "", [&handled](SerialCommandParserBase *) { handled = 1; });
+		parser.addCommandHandler("set|settings", "", [&handled](SerialCommandParserBase *) { handled = 2; });
+		parser.addCommandHandler("status", "", [&handled](SerialCommandParserBase *) { handled = 3; });
+		char name[16];
+		for(int ii = 0; ii < 20; ii++) {
+			snprintf(name, sizeof(name), "cmd%02d", ii);
+			parser.addCommandHandler(name, "", [](SerialCommandParserBase *) { });
+		}
+		assertInt(24, parser.getCommandNameCount());
+		assertString("cmd00", parser.getCommandName(0));
+		assertString("status", parser.getCommandName(23));
+
+		size_t count;
+		assertInt(20, parser.findCommandPrefix("se", 2, count));
+		assertInt(3, count);
+		parser.findCommandPrefix("x", 1, count);
+		assertInt(0, count);
+
+		parser.handleConnected(true);
+		parser.filterString("\033[3;40R\033[3;3R");
+
+		// The longest common prefix is filled in, then a second Tab lists the matches in columns
+		parser.filterString("se\t");
+		assertString("set", parser.getBuffer());
+		parser.output = "";
+		parser.filterString("\t");
+		assertInt(true, (parser.output.indexOf("set       settings  setup\r\n") >= 0));
+		assertString("set", parser.getBuffer());
+
+		// Dispatch uses the same index
+		parser.filterString("\r");
+		assertInt(2, handled);
+		parser.filterString("settings\r");
+		assertInt(2, handled);
+		parser.filterString("setup\r");
+		assertInt(1, handled);
+
+		// 20 matches in 5 columns need 4 rows, so they're shown 2 rows at a time
+		parser.filterString("cm\t");
+		assertString("cmd", parser.getBuffer());
+		parser.output = "";
+		parser.filterString("\t");
+		assertInt(true, (parser.output.indexOf("cmd00  cmd01  cmd02  cmd03  cmd04\r\n") >= 0));
+		assertInt(-1, parser.output.indexOf("cmd10"));
+		assertInt(true, (parser.output.indexOf("--More--") >= 0));
+		parser.output = "";
+		parser.filterString(" ");
+		assertInt(true, (parser.output.indexOf("cmd15  cmd16  cmd17  cmd18  cmd19\r\n") >= 0));
+		// The first page scrolled the 3 row screen, so the next one starts on the last row
+		assertInt(true, (parser.output.indexOf("\033[3;1H") >= 0));
+		assertInt(-1, parser.output.indexOf("\033[5;1H"));
+		assertInt(-1, parser.output.indexOf("--More--"));
+
+		// Any other key at --More-- stops listing and is not added to the line
+		parser.filterString("\t\tq");
+		assertString("cmd", parser.getBuffer());
+		parser.filterString("1");
+		assertString("cmd1", parser.getBuffer());
+	}
+
+	{
+		// Completing options and arguments
+		CaptureEditor parser;
+		String lastArg;
+		int completerCalls = 0;
+		parser.addCommandHandler("read", "", [&lastArg](SerialCommandParserBase *parser) {
+			lastArg = parser->getArgString(parser->getArgCount() - 1);
+		})
+			.addCommandOption('f', "file", "file to read", false, 1)
+			.addCommandOption('v', "verbose", "verbose output")
+			.withOptionCompleter('f', [](const char *, size_t, const std::function<void(const char *)> &candidate) {
+				candidate("data.txt");
+				candidate("data.csv");
+				candidate("log.txt");
+			})
+			.withCompleter([&completerCalls](const char *, size_t argIndex, const std::function<void(const char *)> &candidate) {
+				completerCalls++;
+				if (argIndex == 0) {
+					candidate("sensor1");
+					candidate("sensor2");
+					candidate("temp a");
+				}
+			});
+		parser.handleConnected(true);
+		parser.filterString("\033[24;80R\033[24;3R");
+
+		parser.filterString("read --v\t");
+		assertString("read --verbose", parser.getBuffer());
+		parser.filterString(" --file d\t");
+		assertString("read --verbose --file data.", parser.getBuffer());
+		parser.filterString("t\t");
+		assertString("read --verbose --file data.txt", parser.getBuffer());
+
+		// The argument after the option's argument is the first argument to the command
+		parser.filterString(" s\t");
+		assertString("read --verbose --file data.txt sensor", parser.getBuffer());
+		parser.output = "";
+		parser.filterString("\t");
+		assertInt(true, (parser.output.indexOf("sensor1  sensor2\r\n") >= 0));
+
+		// Completing runs the completer once, and listing the matches runs it once for the layout and once for the page
+		assertInt(3, completerCalls);
+
+		// Completions are escaped so they're one argument, and quoted words are completed
+		parser.filterString("\b\b\b\b\b\bte\t");
+		assertString("read --verbose --file data.txt temp\\ a", parser.getBuffer());
+		parser.filterString("\r");
+		assertString("temp a", lastArg);
+		parser.filterString("read \"se\t");
+		assertString("read \"sensor", parser.getBuffer());
+		parser.filterString("1\"\r");
+		assertString("sensor1", lastArg);
+
+		// The second argument has no completions, and an unknown command has no completion
+		parser.filterString("read sensor1 \t");
+		assertString("read sensor1 ", parser.getBuffer());
+		parser.clear();
+		parser.filterString("foo s\t");
+		assertString("foo s", parser.getBuffer());
+	}
+
+	{
+		// Suggestions from history
+		CaptureEditor parser;
+		parser.withSuggestions();
+		parser.handleConnected(true);
+		parser.filterString("\033[24;80R\033[24;3R");
+		parser.historyAdd("set led on");
+		parser.historyAdd("status");
+		parser.historyAdd("stop");
+
+		// The newest matching line is shown dimmed after the cursor
+		parser.output = "";
+		parser.filterString("s");
+		assertString("s\033[2mtop\033[0m\033[3D", parser.output.c_str());
+		assertString("top", parser.getSuggestion());
+
+		// Typing the next character of the suggestion only prints the character
+		parser.output = "";
+		parser.filterString("t");
+		assertString("t", parser.output.c_str());
+
+		// Otherwise the old suggestion is erased and an older line is suggested
+		parser.output = "";
+		parser.filterString("a");
+		assertString("a\033[0K\033[2mtus\033[0m\033[3D", parser.output.c_str());
+
+		// No match erases the suggestion
+		parser.output = "";
+		parser.filterString("x");
+		assertString("x\033[0K", parser.output.c_str());
+		assertString("", parser.getSuggestion());
+
+		// Backspace searches again from the newest line, and right arrow accepts the suggestion
+		parser.filterString("\b\b\b");
+		assertString("top", parser.getSuggestion());
+		parser.output = "";
+		parser.filterString("\033[C");
+		assertString("stop", parser.getBuffer());
+		assertString("top", parser.output.c_str());
+
+		// Moving the cursor keeps the suggestion, and it's erased when the line is entered
+		parser.clear();
+		parser.filterString("se");
+		parser.output = "";
+		parser.filterString("\033[D");
+		assertString("\033[1D", parser.output.c_str());
+		parser.output = "";
+		parser.filterString("\r");
+		assertInt(0, parser.output.indexOf("\033[24;5H\033[0K"));
+		assertInt(4, parser.historySize());
+	}
+
+	{
+		// Usage counts with decay
+		SerialCommandUsageTable table;
+		table.record("status", 6);
+		table.record("status", 6);
+		table.record("get temp", 8);
+		assertInt(2, table.getScore("status", 6));
+		assertInt(1, table.getScore("get temp", 8));
+		assertInt(0, table.getScore("stop", 4));
+		table.decay();
+		assertInt(1, table.getScore("status", 6));
+		assertInt(0, table.getScore("get temp", 8));
+
+		// When full, the least used is replaced
+		table.record("status", 6);
+		char line[16];
+		for(size_t ii = 0; ii < SerialCommandUsageTable::MAX_ENTRIES; ii++) {
+			snprintf(line, sizeof(line), "cmd%u", (unsigned)ii);
+			table.record(line, strlen(line));
+		}
+		assertInt(2, table.getScore("status", 6));
+		assertInt(0, table.getScore("cmd0", 4));
+		assertInt(1, table.getScore("cmd1", 4));
+	}
+
+	{
+		// Completions and Page Up ranked by use
+		SerialCommandUsageTable table;
+		CaptureEditor parser;
+		parser.withUsageTable(&table);
+		parser.getHistory().withMoveToFront();
+		parser.addCommandHandler("set", "", [](SerialCommandParserBase *) { });
+		parser.addCommandHandler("setup", "", [](SerialCommandParserBase *) { });
+		parser.addCommandHandler("settings", "", [](SerialCommandParserBase *) { });
+		parser.handleConnected(true);
+		parser.filterString("\033[24;80R\033[24;3R");
+
+		parser.filterString("settings\rsetup a\rsettings\rset\r");
+		assertInt(2, table.getScore("settings", 8));
+		assertInt(1, table.getScore("setup", 5));
+		assertInt(3, parser.historySize());
+
+		parser.output = "";
+		parser.filterString("se\t\t");
+		assertInt(true, (parser.output.indexOf("settings  set       setup\r\n") >= 0));
+
+		// Page Up goes from the most used line, then the newest of the lines used the same number of times
+		parser.clear();
+		parser.filterString("x\033[5~");
+		assertString("settings", parser.getBuffer());
+		parser.filterString("\033[5~");
+		assertString("set", parser.getBuffer());
+		parser.filterString("\033[5~");
+		assertString("setup a", parser.getBuffer());
+		parser.filterString("\033[5~");
+		assertString("setup a", parser.getBuffer());
+		parser.filterString("\033[6~\033[6~");
+		assertString("settings", parser.getBuffer());
+		parser.filterString("\033[6~");
+		assertString("x", parser.getBuffer());
+	}
+
+	{
+		// Ranked completions come first and the rest follow them across pages, each listed once
+		SerialCommandUsageTable table;
+		CaptureEditor parser;
+		parser.withUsageTable(&table);
+		for(int ii = 0; ii < 6; ii++) {
+			parser.addCommandHandler(String::format("cmd%d", ii), "", [](SerialCommandParserBase *) { });
+		}
+		parser.handleConnected(true);
+		parser.filterString("\033[3;16R\033[3;3R");
+		parser.filterString("cmd4\rcmd2\rcmd4\r");
+
+		// 6 matches in 2 columns, 2 rows a page
+		parser.output = "";
+		parser.filterString("c\t\t");
+		assertInt(true, (parser.output.indexOf("cmd4  cmd2\r\ncmd0  cmd1\r\n--More--") >= 0));
+		parser.output = "";
+		parser.filterString(" ");
+		assertInt(true, (parser.output.indexOf("cmd3  cmd5\r\n") >= 0));
+		assertInt(-1, parser.output.indexOf("cmd4"));
+		assertInt(-1, parser.output.indexOf("--More--"));
+	}
+
+#if SERIAL_COMMAND_TCP_EPOLL
+	{
+		// Linux epoll backend, using a loopback connection
+		SerialCommandTCPServer server(512, 128, 10, 2, false, 0);
+		server.addCommandHandler("hello", "", [](SerialCommandParserBase *parser) {
+			parser->println("world");
+		});
+		server.setup();
+		assertInt(true, server.getEpollFd() >= 0);
+		assertInt(true, server.getPort() != 0);
+
+		int fd = connectLoopback(server);
+		const char *input = "\033[24;80R\033[1;3Rhello\r";
+		send(fd, input, strlen(input), 0);
+
+		std::string received;
+		assertInt(true, pumpUntil(server, [fd, &received]() {
+			recvAvailable(fd, received);
+			return received.find("world") != std::string::npos;
+		}, 200));
+
+		// An idle session is not serviced by loop()
+		server.loop();
+		assertInt(0, server.getActiveCount());
+		assertInt(0, server.nextDeadline());
+
+		// Partial escape sequence keeps the session active for the escape timer
+		send(fd, "\033", 1, 0);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getActiveCount() > 0; }, 100));
+		assertInt(1, server.getActiveCount());
+		assertInt(true, server.nextDeadline() != 0);
+
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+		assertInt(false, server.hasPendingInput());
+		assertInt(0, server.getActiveCount());
+	}
+
+	{
+		// A burst of connections is accepted in one loop, and extra ones are rejected
+		SerialCommandTCPServer server(512, 128, 10, 2, false, 0);
+		server.setup();
+		assertInt(true, (server.getSessionSize() >= sizeof(SerialCommandTCPClient) + sizeof(SerialCommandEditorBase) + 512 + 128 + 10 * sizeof(char *)));
+
+		int fds[3];
+		for(size_t ii = 0; ii < 3; ii++) {
+			fds[ii] = connectLoopback(server);
+		}
+		server.loop();
+		assertInt(2, server.getSessionCount());
+
+		std::string received;
+		assertInt(true, waitUntil([&fds, &received]() { return !recvAvailable(fds[2], received); }, 1000));
+		assertString("too many sessions\r\n", received.c_str());
+
+		// Closing a session frees its slot for the next connection
+		close(fds[0]);
+		close(fds[2]);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 1; }, 100));
+		fds[0] = connectLoopback(server);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 2; }, 100));
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	{
+		// Growable buffers start small, grow with the line and history, and are freed on disconnect
+		SerialCommandTCPServer server(512, 256, 10, 2, false, 0);
+		server.withGrowableBuffers(1024);
+		size_t argLen = 0;
+		server.addCommandHandler("echo", "", [&argLen](SerialCommandParserBase *parser) {
+			argLen = strlen(parser->getArgString(1));
+		});
+		server.setup();
+		assertInt(0, server.getGrowableMemoryUsed());
+
+		int fd = connectLoopback(server);
+		char line[128];
+		strcpy(line, "\033[24;80R\033[1;3Recho ");
+		size_t offset = strlen(line);
+		for(size_t ii = 0; ii < 100; ii++) {
+			line[offset++] = (char)('a' + (ii % 26));
+		}
+		line[offset++] = '\r';
+		send(fd, line, offset, 0);
+		assertInt(true, pumpUntil(server, [&argLen]() { return argLen != 0; }, 100));
+		assertInt(100, argLen);
+
+		// 105 characters needs a 128 byte line buffer, and the first history buffer is 128 bytes plus its index
+		assertInt(256 + SerialCommandHistory::indexSize(128) * sizeof(SerialCommandHistory::IndexEntry), server.getGrowableMemoryUsed());
+
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+		assertInt(0, server.getGrowableMemoryUsed());
+	}
+
+	{
+		// Output is queued per session and sent round-robin within the per-loop budget
+		SerialCommandTCPServer server(512, 128, 10, 2, false, 0);
+		server.withOutputBudget(300);
+		server.addCommandHandler("dump", "", [](SerialCommandParserBase *parser) {
+			for(size_t ii = 0; ii < 20; ii++) {
+				parser->println("0123456789012345678901234567890123456789");
+			}
+		});
+		server.setup();
+
+		int fds[2];
+		const char *setup = "\033[24;80R\033[1;3R";
+		for(size_t ii = 0; ii < 2; ii++) {
+			fds[ii] = connectLoopback(server);
+			send(fds[ii], setup, strlen(setup), 0);
+		}
+		SerialCommandTCPClient::OutputStats stats[2];
+		auto queuesEmpty = [&server, &stats]() {
+			for(size_t ii = 0; ii < 2; ii++) {
+				if (!server.getOutputStats(ii, stats[ii]) || stats[ii].queueDepth != 0) {
+					return false;
+				}
+			}
+			return true;
+		};
+
+		// Wait for both sessions to handle the screen size and send their prompts
+		assertInt(true, pumpUntil(server, [&server, &queuesEmpty]() {
+			return !server.hasPendingInput() && server.getActiveCount() == 0 && queuesEmpty();
+		}, 100));
+		uint32_t sentBefore = 0;
+		for(size_t ii = 0; ii < 2; ii++) {
+			assertInt(true, server.getOutputStats(ii, stats[ii]));
+			assertInt(0, stats[ii].queueDepth);
+			sentBefore += stats[ii].bytesSent;
+		}
+
+		for(size_t ii = 0; ii < 2; ii++) {
+			send(fds[ii], "dump\r", 5, 0);
+		}
+		assertInt(true, waitUntil([&server]() { return server.hasPendingInput(); }, 100));
+		server.loop();
+
+		uint32_t sent = 0;
+		for(size_t ii = 0; ii < 2; ii++) {
+			server.getOutputStats(ii, stats[ii]);
+			assertInt(true, stats[ii].queueDepth > 0);
+			sent += stats[ii].bytesSent;
+		}
+		assertInt(true, (sent - sentBefore) <= 300);
+
+		assertInt(true, pumpUntil(server, queuesEmpty, 100));
+		for(size_t ii = 0; ii < 2; ii++) {
+			server.getOutputStats(ii, stats[ii]);
+			assertInt(0, stats[ii].queueDepth);
+			assertInt(0, stats[ii].bytesDropped);
+			assertInt(true, stats[ii].maxQueueDepth >= 800);
+			close(fds[ii]);
+		}
+		assertInt(false, server.getOutputStats(2, stats[0]));
+	}
+
+	{
+		// Output that doesn't fit the queue grows it instead of being sent outside the budget or discarded, and
+		// the session's input waits until it's been sent
+		SerialCommandTCPServer server(512, 128, 10, 1, false, 0);
+		server.withOutputBudget(100);
+		const char *line = "0123456789012345678901234567890123456789";
+		server.addCommandHandler("dump", "", [line](SerialCommandParserBase *parser) {
+			for(size_t ii = 0; ii < 50; ii++) {
+				parser->println(line);
+			}
+		});
+		server.addCommandHandler("hello", "", [](SerialCommandParserBase *parser) {
+			parser->println("world");
+		});
+		server.setup();
+
+		int fd = connectLoopback(server);
+		const char *setup = "\033[24;80R\033[1;3R";
+		send(fd, setup, strlen(setup), 0);
+		SerialCommandTCPClient::OutputStats stats;
+		assertInt(true, pumpUntil(server, [&server, &stats]() {
+			return !server.hasPendingInput() && server.getActiveCount() == 0 && server.getOutputStats(0, stats) && stats.queueDepth == 0;
+		}, 100));
+		uint32_t sentBefore = stats.bytesSent;
+
+		send(fd, "dump\r", 5, 0);
+		assertInt(true, waitUntil([&server]() { return server.hasPendingInput(); }, 100));
+		server.loop();
+		server.getOutputStats(0, stats);
+		assertInt(true, (stats.bytesSent - sentBefore) <= 100);
+		assertInt(0, stats.bytesDropped);
+		assertInt(true, (stats.queueDepth > SerialCommandTCPClient::OUT_BUFFER_SIZE));
+		assertInt(true, (server.getGrowableMemoryUsed() > 0));
+
+		// The next command isn't run while the queue is over OUT_BUFFER_SIZE, so nothing more is queued
+		send(fd, "hello\r", 6, 0);
+		size_t depthBefore = stats.queueDepth;
+		sentBefore = stats.bytesSent;
+		server.loop();
+		server.getOutputStats(0, stats);
+		assertInt((int)(depthBefore - (stats.bytesSent - sentBefore)), (int)stats.queueDepth);
+
+		// All of the output arrives, followed by the command that waited
+		std::string received;
+		assertInt(true, pumpUntil(server, [fd, &received]() {
+			recvAvailable(fd, received);
+			return received.find("world") != std::string::npos;
+		}, 500));
+		size_t lines = 0;
+		for(size_t pos = received.find(line); pos != std::string::npos; pos = received.find(line, pos + 1)) {
+			lines++;
+		}
+		assertInt(50, lines);
+		assertInt(true, (received.find("world") > received.rfind(line)));
+		server.getOutputStats(0, stats);
+		assertInt(0, stats.bytesDropped);
+		assertInt(0, server.getGrowableMemoryUsed());
+
+		// Only output past the limit is discarded, and a budget of 0 is unlimited
+		server.withOutputQueueLimit(SerialCommandTCPClient::OUT_BUFFER_SIZE).withOutputBudget(0);
+		send(fd, "dump\r", 5, 0);
+		assertInt(true, waitUntil([&server]() { return server.hasPendingInput(); }, 100));
+		server.loop();
+		server.getOutputStats(0, stats);
+		assertInt(true, (stats.bytesDropped > 0));
+		assertInt(0, stats.queueDepth);
+
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+	}
+
+	{
+		// Telnet: the screen size comes from NAWS without probing, and commands are removed from the input
+		SerialCommandTCPServer server(512, 128, 10, 2, false, 0);
+		server.withTelnet();
+		server.addCommandHandler("size", "", [](SerialCommandParserBase *parser) {
+			SerialCommandEditorBase *editor = static_cast<SerialCommandEditorBase *>(parser);
+			parser->printlnf("size=%dx%d", editor->getScreenCols(), editor->getScreenRows());
+		});
+		SerialCommandTCPClient::OutputStats iacStats = {};
+		server.addCommandHandler("iac", "", [&server, &iacStats](SerialCommandParserBase *parser) {
+			// Fill the queue to one byte short of the limit, so the escaped 255 doesn't fit. Ending the
+			// editor's frame lets each write reach the queue right away.
+			SerialCommandEditorBase *editor = static_cast<SerialCommandEditorBase *>(parser);
+			editor->endFrame();
+			size_t index = (size_t) server.getSessionIndex(parser);
+			server.getOutputStats(index, iacStats);
+			while(iacStats.queueDepth < SerialCommandTCPClient::OUT_BUFFER_SIZE - 1) {
+				parser->write('a');
+				server.getOutputStats(index, iacStats);
+			}
+			parser->write(TelnetFilter::IAC);
+			server.getOutputStats(index, iacStats);
+			editor->beginFrame();
+		});
+		server.setup();
+
+		int fd = connectLoopback(server);
+		const uint8_t reply[] = {
+			TelnetFilter::IAC, TelnetFilter::DO, TelnetFilter::OPTION_ECHO,
+			TelnetFilter::IAC, TelnetFilter::DO, TelnetFilter::OPTION_SGA,
+			TelnetFilter::IAC, TelnetFilter::WILL, TelnetFilter::OPTION_SGA,
+			TelnetFilter::IAC, TelnetFilter::WILL, TelnetFilter::OPTION_NAWS,
+			TelnetFilter::IAC, TelnetFilter::SB, TelnetFilter::OPTION_NAWS, 0, 100, 0, 30, TelnetFilter::IAC, TelnetFilter::SE,
+			// The DSR reply for the prompt's cursor position
+			0x1b, '[', '3', ';', '3', 'R',
+			's', 'i', 'z', 'e', '\r', 0
+		};
+		send(fd, reply, sizeof(reply), 0);
+
+		std::string received;
+		assertInt(true, pumpUntil(server, [fd, &received]() {
+			recvAvailable(fd, received);
+			return received.find("size=") != std::string::npos;
+		}, 2000));
+		assertInt(true, (received.size() >= TelnetFilter::START_SIZE));
+		assertInt(TelnetFilter::IAC, (uint8_t) received[0]);
+		assertInt(TelnetFilter::WILL, (uint8_t) received[1]);
+		assertInt(true, (received.find("size=100x30") != std::string::npos));
+		assertInt(true, (received.find("\033[999;999H") == std::string::npos));
+
+		// Both bytes of IAC IAC are dropped when only one fits
+		server.withOutputQueueLimit(SerialCommandTCPClient::OUT_BUFFER_SIZE);
+		send(fd, "iac\r", 4, 0);
+		assertInt(true, pumpUntil(server, [&iacStats]() { return iacStats.bytesDropped != 0; }, 200));
+		assertInt(2, iacStats.bytesDropped);
+		assertInt(SerialCommandTCPClient::OUT_BUFFER_SIZE - 1, iacStats.queueDepth);
+
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+	}
+
+	{
+		// Telnet LINEMODE: the client edits the line and the session processes whole lines without echo
+		SerialCommandTCPServer server(512, 128, 10, 2, false, 0);
+		server.withTelnet().withLineMode();
+		server.addCommandHandler("hello", "", [](SerialCommandParserBase *parser) {
+			parser->println("world");
+		});
+		server.setup();
+
+		int fd = connectLoopback(server);
+		const uint8_t input[] = {
+			TelnetFilter::IAC, TelnetFilter::WILL, TelnetFilter::OPTION_LINEMODE,
+			'h', 'e', 'l', 'l', 'o', '\r', '\n'
+		};
+		send(fd, input, sizeof(input), 0);
+
+		std::string received;
+		assertInt(true, pumpUntil(server, [fd, &received]() {
+			recvAvailable(fd, received);
+			return received.find("world") != std::string::npos;
+		}, 2000));
+		assertInt(TelnetFilter::OPTION_LINEMODE, (uint8_t) received[2]);
+		assertInt(true, (received.find("world") != std::string::npos));
+		assertInt(true, (received.find("hello") == std::string::npos));
+		assertInt(true, (received.find("\033[") == std::string::npos));
+
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+	}
+
+	{
+		// An observer gets the primary session's output, and its own input is ignored
+		SerialCommandTCPServer server(512, 128, 10, 3, false, 0);
+		int primary = -1;
+		int observer = -1;
+		server.addCommandHandler("primary", "", [&server, &primary](SerialCommandParserBase *parser) {
+			primary = server.getSessionIndex(parser);
+		});
+		server.addCommandHandler("watch", "", [&server, &primary, &observer](SerialCommandParserBase *parser) {
+			observer = server.getSessionIndex(parser);
+			if (server.attachObserver(observer, primary)) {
+				parser->println("watching");
+			}
+		});
+		server.addCommandHandler("hello", "", [](SerialCommandParserBase *parser) {
+			parser->println("world");
+		});
+		server.setup();
+
+		int fds[2];
+		std::string received[2];
+		// Returns true once until has been received on session which
+		auto pump = [&server, &fds, &received](const char *until, size_t which) {
+			return pumpUntil(server, [&fds, &received, until, which]() {
+				for(size_t ii = 0; ii < 2; ii++) {
+					recvAvailable(fds[ii], received[ii]);
+				}
+				return received[which].find(until) != std::string::npos;
+			}, 200);
+		};
+		const char *setup = "\033[24;80R\033[1;3R";
+		for(size_t ii = 0; ii < 2; ii++) {
+			fds[ii] = connectLoopback(server);
+			send(fds[ii], setup, strlen(setup), 0);
+		}
+		send(fds[0], "primary\r", 8, 0);
+		assertInt(true, pump("primary", 0));
+		assertInt(true, (primary >= 0));
+		assertInt(false, server.attachObserver(primary, primary));
+
+		send(fds[1], "watch\r", 6, 0);
+		assertInt(true, pump("watching", 1));
+		assertInt(1, server.getObserverCount(primary));
+
+		// The observer's own commands are ignored
+		send(fds[1], "hello\r", 6, 0);
+		assertInt(false, pump("world", 1));
+
+		send(fds[0], "hello\r", 6, 0);
+		assertInt(true, pump("world", 0));
+		assertInt(true, pump("world", 1));
+
+		// A detached observer stops getting output, and its input is still ignored
+		server.detachObserver(observer);
+		assertInt(0, server.getObserverCount(primary));
+		received[1].clear();
+		send(fds[1], "hello\r", 6, 0);
+		assertInt(false, pump("world", 1));
+
+		// An observer can be attached again
+		assertInt(true, server.attachObserver(observer, primary));
+
+		// Closing the primary disconnects the observer
+		close(fds[0]);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+		assertInt(false, recvAvailable(fds[1], received[1]));
+		close(fds[1]);
+	}
+
+	{
+		// With eviction enabled, a connection when full closes the longest idle session instead of being rejected
+		SerialCommandTCPServer server(512, 128, 10, 1, false, 0);
+		server.withIdleTimeout(60000).withEvictIdle();
+		server.setup();
+
+		int fds[2];
+		fds[0] = connectLoopback(server);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 1; }, 100));
+
+		// The first session is closed for the second, so it reads EOF after the prompt
+		fds[1] = connectLoopback(server);
+		std::string received;
+		assertInt(true, pumpUntil(server, [&fds, &received]() { return !recvAvailable(fds[0], received); }, 100));
+		assertInt(1, server.getSessionCount());
+
+		for(size_t ii = 0; ii < 2; ii++) {
+			close(fds[ii]);
+		}
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+	}
+
+	{
+		// Timeouts warn once before closing, and input pushes the idle timeout back but not the session timeout
+		SerialCommandTCPServer server(512, 128, 10, 1, false, 0);
+		server.withIdleTimeout(5000).withTimeoutWarning(1000, "closing soon");
+		server.setup();
+
+		int fd = -1;
+		std::string received;
+		auto connectAt = [&server, &fd, &received](unsigned long ms) {
+			setTestMillis(ms);
+			received.clear();
+			fd = connectLoopback(server);
+			const char *setup = "\033[24;80R\033[1;3R";
+			send(fd, setup, strlen(setup), 0);
+		};
+		// Returns true when the session was closed
+		auto runAt = [&server, &fd, &received](unsigned long ms) {
+			setTestMillis(ms);
+			return pumpUntil(server, [&fd, &received]() { return !recvAvailable(fd, received); }, 20);
+		};
+		auto warnings = [&received]() {
+			size_t count = 0;
+			for(size_t pos = received.find("closing soon"); pos != std::string::npos; pos = received.find("closing soon", pos + 1)) {
+				count++;
+			}
+			return count;
+		};
+
+		// Input at 3000 moves the warning from 4000 to 7000 and the close from 5000 to 8000
+		connectAt(0);
+		assertInt(false, runAt(0));
+		send(fd, "x", 1, 0);
+		assertInt(false, runAt(3000));
+		assertInt(false, runAt(4500));
+		assertInt(false, runAt(5500));
+		assertInt(0, warnings());
+		assertInt(false, runAt(7300));
+		assertInt(1, warnings());
+		assertInt(false, runAt(7800));
+		assertInt(true, runAt(8300));
+		assertInt(1, warnings());
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+
+		// Input after the warning keeps the session open, and it's warned again before the new idle timeout
+		connectAt(10000);
+		assertInt(false, runAt(10000));
+		assertInt(false, runAt(14300));
+		assertInt(1, warnings());
+		send(fd, "x", 1, 0);
+		assertInt(false, runAt(14500));
+		assertInt(false, runAt(15300));
+		assertInt(1, warnings());
+		assertInt(false, runAt(18700));
+		assertInt(2, warnings());
+		assertInt(true, runAt(19800));
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+
+		// The session timeout isn't moved by input
+		server.withIdleTimeout(0).withSessionTimeout(2000);
+		connectAt(20000);
+		assertInt(false, runAt(20000));
+		assertInt(false, runAt(21300));
+		assertInt(1, warnings());
+		send(fd, "x", 1, 0);
+		assertInt(false, runAt(21500));
+		assertInt(true, runAt(22300));
+		assertInt(1, warnings());
+		close(fd);
+		assertInt(true, pumpUntil(server, [&server]() { return server.getSessionCount() == 0; }, 100));
+		setTestMillis(0);
+	}
+
+	{
+		// Sessions served by several worker threads sharing a frozen configuration
+		SerialCommandConfig config;
+		int count = 0;
+		config.addCommandHandler("count", "", [&count](SerialCommandParserBase *parser) {
+			// Not thread safe, so handlers are run one at a time
+			count++;
+			parser->println("counted");
+		});
+		config.addCommandHandler("ping", "", [](SerialCommandParserBase *parser) {
+			parser->println("pong");
+		}).withThreadSafe();
+
+		SerialCommandTCPExecutor executor(&config, 2, 512, 128, 10, 4, 0);
+		assertInt(true, executor.start());
+		assertInt(false, executor.start());
+		assertInt(true, executor.isRunning());
+		assertInt(true, config.isFrozen());
+		assertInt(true, executor.getPort() != 0);
+
+		// Commands can't be added once frozen
+		config.addCommandHandler("late", "", [](SerialCommandParserBase *) {});
+		assertInt(true, (config.getCommandHandlerInfo("late") == NULL));
+
+		const size_t numClients = 6;
+		int fds[numClients];
+		std::string received[numClients];
+		const char *input = "\033[24;80R\033[1;3Rcount\rping\r";
+		for(size_t ii = 0; ii < numClients; ii++) {
+			fds[ii] = connectLoopback(executor);
+			send(fds[ii], input, strlen(input), 0);
+		}
+		for(size_t ii = 0; ii < numClients; ii++) {
+			// The executor's worker threads run the sessions, so this only waits for the output
+			std::string &output = received[ii];
+			int fd = fds[ii];
+			waitUntil([fd, &output]() {
+				recvAvailable(fd, output);
+				return output.find("pong") != std::string::npos;
+			}, 2000);
+			assertInt(true, (received[ii].find("counted") != std::string::npos));
+			assertInt(true, (received[ii].find("pong") != std::string::npos));
+		}
+
+		executor.stop();
+		assertInt(false, executor.isRunning());
+		assertInt((int)numClients, count);
+
+		// Each connection goes to the shard with the fewest sessions, so none is rejected while another shard has room
+		for(size_t ii = 0; ii < executor.getThreadCount(); ii++) {
+			assertInt((int)(numClients / executor.getThreadCount()), executor.getShard(ii)->getSessionCount());
+		}
+
+		for(size_t ii = 0; ii < numClients; ii++) {
+			close(fds[ii]);
+		}
+	}
+
+	{
+		// A failed start leaves nothing allocated and the configuration unfrozen, so it can be retried
+		int blocker = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = 0;
+		assertInt(0, bind(blocker, (struct sockaddr *)&addr, sizeof(addr)));
+		assertInt(0, listen(blocker, 1));
+		socklen_t addrLen = sizeof(addr);
+		getsockname(blocker, (struct sockaddr *)&addr, &addrLen);
+
+		SerialCommandConfig config;
+		SerialCommandTCPExecutor executor(&config, 2, 512, 128, 10, 2, ntohs(addr.sin_port));
+		assertInt(false, executor.start());
+		assertInt(false, config.isFrozen());
+		assertInt(false, executor.isRunning());
+		assertInt(0, executor.getPort());
+		assertInt(true, (executor.getShard(0) == NULL));
+
+		close(blocker);
+		assertInt(true, executor.start());
+		assertInt(true, config.isFrozen());
+		assertInt(ntohs(addr.sin_port), executor.getPort());
+		executor.stop();
+	}
+
+	{
+		// The server stops the store from using its shared history before freeing it
+		const char *path = "/tmp/SerialCommandParserSharedHistoryTest.log";
+		unlink(path);
+		SerialCommandHistoryFileStore store(path);
+		store.withMaxFileSize(1);
+		{
+			SerialCommandTCPServer server(128, 64, 10, 2, true, 0);
+			server.withSharedHistory().withHistoryStore(&store);
+			server.setup();
+		}
+		// Flushing after the server is gone appends instead of rewriting the file from the freed history
+		store.append("status", 6);
+		store.flush();
+		assertInt(SerialCommandHistoryFileStore::RECORD_HEADER_SIZE + 6, store.getFileSize());
+		unlink(path);
+	}
+#endif /* SERIAL_COMMAND_TCP_EPOLL */
+
 	printf("paserUnitTest complete!\n");
 
 }
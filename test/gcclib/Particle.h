@@ -10,16 +10,22 @@
 #include <cassert>
 
 #include "spark_wiring_string.h"
+#include "spark_wiring_print.h"
 #include "rng_hal.h"
 
-class Stream {
+class Stream : public Print {
 public:
-	inline int available() { return 0; }
-	inline int read() { return 0; }
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() = 0;
 };
 
 extern "C" {
 	unsigned long millis();
+
+	// Unit tests only: set the value millis() returns
+	void setTestMillis(unsigned long ms);
 }
 
 #endif /* __PARTICLE_H */
@@ -75,7 +75,15 @@ uint32_t HAL_RNG_GetRandomNumber(void) {
 	return (uint32_t) rand();
 }
 
+// Time stands still unless a test sets it
+static unsigned long testMillis = 0;
+
 extern "C"
 unsigned long millis() {
-	return 0;
+	return testMillis;
+}
+
+extern "C"
+void setTestMillis(unsigned long ms) {
+	testMillis = ms;
 }